@@ -0,0 +1,233 @@
+#include "git.h"
+
+CatFile::CatFile () {
+  this->batch_command = false;
+  for (auto& channel : this->channels) {
+    channel.pid = -1;
+    channel.stdin_fd = -1;
+    channel.stdout_fd = -1;
+  }
+}
+
+CatFile::~CatFile () {
+  this->stop();
+}
+
+// Point the coprocess at a repository
+void CatFile::set_repository (const std::string& working_path, const std::string& git_version) {
+  /*
+    git cat-file --batch-command exists
+    since git 2.36, it lets one process
+    answer both info and contents
+    requests. Older gits get a
+    --batch-check and a --batch
+    coprocess instead.
+  */
+
+  this->stop();
+  this->working_path = working_path;
+  this->batch_command = git_version_at_least(git_version, 2, 36);
+}
+
+// Start a channel's coprocess if it is not running yet
+bool CatFile::start (const uint32_t channel) {
+  CatFileChannel& ch = this->channels[channel];
+  if (ch.pid != -1)
+    return true;
+
+  if (this->working_path.empty())
+    return false;
+
+  std::vector<std::string> argv = {"git", "cat-file"};
+  if (this->batch_command) {
+    argv.push_back("--batch-command");
+    argv.push_back("--buffer");
+  } else argv.push_back(channel == 0 ? "--batch-check" : "--batch");
+
+  ch.pid = spawn_process(argv, this->working_path, &ch.stdin_fd, &ch.stdout_fd, NULL);
+  if (ch.pid == -1) {
+    std::string err_msg = "CatFile::start() ==> Could not start git cat-file at path: " + this->working_path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  ch.buffer.clear();
+  return true;
+}
+
+// Stop all coprocesses
+void CatFile::stop () {
+  for (auto& ch : this->channels) {
+    if (ch.pid == -1)
+      continue;
+
+    // Closing stdin makes cat-file exit on its own
+    close(ch.stdin_fd);
+    close(ch.stdout_fd);
+    wait_process(ch.pid);
+    ch.pid = -1;
+    ch.stdin_fd = -1;
+    ch.stdout_fd = -1;
+    ch.buffer.clear();
+  }
+}
+
+// Write a whole request to a channel
+bool CatFile::write_request (const uint32_t channel, const std::string& request) {
+  CatFileChannel& ch = this->channels[channel];
+  size_t written = 0;
+  while (written < request.size()) {
+    ssize_t count = write(ch.stdin_fd, request.data() + written, request.size() - written);
+    if (count == -1) {
+      if (errno == EINTR) continue;
+      print_error("CatFile::write_request() ==> Could not write to git cat-file");
+      this->stop();
+      return false;
+    } written += count;
+  } return true;
+}
+
+// Make sure at least length bytes are buffered from a channel
+bool CatFile::fill (const uint32_t channel, const size_t length) {
+  CatFileChannel& ch = this->channels[channel];
+  char buffer[65536];
+  while (ch.buffer.size() < length) {
+    ssize_t count = read(ch.stdout_fd, buffer, sizeof(buffer));
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count <= 0) {
+      print_error("CatFile::fill() ==> git cat-file closed unexpectedly");
+      this->stop();
+      return false;
+    } ch.buffer.append(buffer, count);
+  } return true;
+}
+
+// Read one response line from a channel
+bool CatFile::read_line (const uint32_t channel, std::string& line) {
+  CatFileChannel& ch = this->channels[channel];
+  size_t end;
+  while ((end = ch.buffer.find('\n')) == std::string::npos) {
+    if (!this->fill(channel, ch.buffer.size() + 1))
+      return false;
+  }
+
+  line.assign(ch.buffer, 0, end);
+  ch.buffer.erase(0, end + 1);
+  return true;
+}
+
+// Parse "<oid> <type> <size>" or "<name> missing"
+static bool parse_object_header (const std::string& line, const std::string& name, ObjectInfo& info) {
+  info.name = name;
+  info.oid.clear();
+  info.type.clear();
+  info.size = 0;
+  info.exists = false;
+
+  size_t first = line.find(' ');
+  size_t last = line.rfind(' ');
+  if (first == std::string::npos)
+    return false;
+
+  // "missing" and "ambiguous" replies echo the requested name
+  if (first == last || line.compare(last + 1, std::string::npos, "missing") == 0 ||
+  line.compare(last + 1, std::string::npos, "ambiguous") == 0)
+    return true;
+
+  info.oid = line.substr(0, first);
+  info.type = line.substr(first + 1, last - first - 1);
+  info.size = std::strtoull(line.c_str() + last + 1, NULL, 10);
+  info.exists = true;
+  return true;
+}
+
+// Look up the type and size of many objects at once
+bool CatFile::info (const std::vector<std::string>& names, std::vector<ObjectInfo>& infos) {
+  /*
+    Requests are pipelined in chunks small
+    enough that neither the request nor the
+    response side can fill a pipe buffer,
+    so writing never blocks on a reader
+    that is itself waiting on us.
+  */
+
+  const size_t chunk_size = 128;
+  infos.clear();
+
+  for (const auto& name : names) {
+    if (name.empty() || name.find('\n') != std::string::npos) {
+      std::string err_msg = "CatFile::info() ==> Invalid object name: " + name + '\n';
+      print_error(err_msg.c_str());
+      return false;
+    }
+  }
+
+  if (!this->start(0))
+    return false;
+
+  for (size_t begin = 0; begin < names.size(); begin += chunk_size) {
+    size_t end = std::min(begin + chunk_size, names.size());
+
+    std::string request;
+    for (size_t name = begin; name < end; name++) {
+      if (this->batch_command) request += "info ";
+      request += names[name] + '\n';
+    } if (this->batch_command) request += "flush\n";
+
+    if (!this->write_request(0, request))
+      return false;
+
+    for (size_t name = begin; name < end; name++) {
+      std::string line;
+      ObjectInfo object_info;
+      if (!this->read_line(0, line) || !parse_object_header(line, names[name], object_info))
+        return false;
+      infos.push_back(object_info);
+    }
+  }
+
+  return true;
+}
+
+// Read the contents of a single object
+bool CatFile::contents (const std::string& name, ObjectInfo& info, std::string& content) {
+  uint32_t channel = this->batch_command ? 0 : 1;
+  content.clear();
+
+  if (name.empty() || name.find('\n') != std::string::npos)
+    return false;
+
+  if (!this->start(channel))
+    return false;
+
+  std::string request;
+  if (this->batch_command) request = "contents " + name + "\nflush\n";
+  else request = name + '\n';
+
+  std::string line;
+  if (!this->write_request(channel, request) ||
+  !this->read_line(channel, line) ||
+  !parse_object_header(line, name, info))
+    return false;
+
+  if (!info.exists)
+    return true;
+
+  // Object body is followed by a single LF
+  CatFileChannel& ch = this->channels[channel];
+  if (!this->fill(channel, info.size + 1))
+    return false;
+
+  content.assign(ch.buffer, 0, info.size);
+  ch.buffer.erase(0, info.size + 1);
+  return true;
+}
+
+// Resolve a revision to an object id (empty if it does not exist)
+std::string CatFile::resolve (const std::string& name) {
+  std::vector<ObjectInfo> infos;
+  if (!this->info({name}, infos) || infos.empty())
+    return "";
+  return infos.front().oid;
+}
@@ -0,0 +1,447 @@
+#include "git.h"
+
+#include <fnmatch.h>
+#include <climits>
+
+// Lower case a config section or key name
+static std::string config_lower (const std::string& s) {
+  std::string lower = s;
+  for (auto& c : lower)
+    c = std::tolower(static_cast<unsigned char>(c));
+  return lower;
+}
+
+// Normalize a dotted key, section and name are case-insensitive
+static std::string config_normalize_key (const std::string& key) {
+  size_t first = key.find('.');
+  size_t last = key.rfind('.');
+  if (first == std::string::npos)
+    return config_lower(key);
+
+  return config_lower(key.substr(0, first)) + key.substr(first, last - first) + config_lower(key.substr(last));
+}
+
+// Directory part of a path
+static std::string config_dirname (const std::string& path) {
+  size_t slash = path.rfind('/');
+  if (slash == std::string::npos) return ".";
+  if (slash == 0) return "/";
+  return path.substr(0, slash);
+}
+
+// Expand ~/ to $HOME
+static std::string config_expand_home (const std::string& path) {
+  if (path.compare(0, 2, "~/") != 0)
+    return path;
+
+  const char* home = getenv("HOME"); // envariables do not have to be freed
+  if (home == NULL)
+    return path;
+  return std::string(home) + path.substr(1);
+}
+
+// Parse a boolean config value
+bool config_bool (const std::string& value, const bool has_value) {
+  if (!has_value)
+    return true;
+
+  std::string lower = config_lower(value);
+  return lower == "true" || lower == "yes" || lower == "on" || (!lower.empty() && std::atoi(lower.c_str()) != 0);
+}
+
+GitConfig::GitConfig () {
+  return;
+}
+
+// Load system, global, local and worktree configuration
+bool GitConfig::load (const std::string& git_dir, const std::string& common_dir) {
+  /*
+    Files are read in the same order git
+    reads them, so for single valued keys
+    the last entry wins, and multi valued
+    keys keep their order.
+  */
+
+  this->entries.clear();
+  this->files.clear();
+  this->git_dir = git_dir;
+
+  // Current branch, for includeIf "onbranch:"
+  Ref head;
+  this->branch.clear();
+  if (!git_dir.empty() && read_head(git_dir, head) && head.symref.compare(0, 11, "refs/heads/") == 0)
+    this->branch = head.symref.substr(11);
+
+  // System
+  if (getenv("GIT_CONFIG_NOSYSTEM") == NULL) {
+    const char* system_config = getenv("GIT_CONFIG_SYSTEM");
+    this->read(system_config != NULL ? system_config : "/etc/gitconfig", 0);
+  }
+
+  // Global
+  const char* global_config = getenv("GIT_CONFIG_GLOBAL");
+  if (global_config != NULL)
+    this->read(global_config, 0);
+  else {
+    const char* xdg_config_home = getenv("XDG_CONFIG_HOME");
+    if (xdg_config_home != NULL && *xdg_config_home != '\0')
+      this->read(std::string(xdg_config_home) + "/git/config", 0);
+    else this->read(config_expand_home("~/.config/git/config"), 0);
+    this->read(config_expand_home("~/.gitconfig"), 0);
+  }
+
+  // Local
+  if (!common_dir.empty() && !this->read(common_dir + "/config", 0))
+    return false;
+
+  // Worktree
+  bool worktree_config_set = false;
+  for (const auto& entry : this->entries) {
+    if (entry.key == "extensions.worktreeconfig") {
+      worktree_config_set = config_bool(entry.value, entry.has_value);
+    }
+  } if (worktree_config_set && !git_dir.empty())
+    this->read(git_dir + "/config.worktree", 0);
+
+  // Environment (GIT_CONFIG_COUNT, GIT_CONFIG_KEY_n, GIT_CONFIG_VALUE_n)
+  const char* count = getenv("GIT_CONFIG_COUNT");
+  for (int entry = 0; count != NULL && entry < std::atoi(count); entry++) {
+    const char* key = getenv(("GIT_CONFIG_KEY_" + std::to_string(entry)).c_str());
+    const char* value = getenv(("GIT_CONFIG_VALUE_" + std::to_string(entry)).c_str());
+    if (key != NULL && value != NULL)
+      this->entries.push_back({config_normalize_key(key), value, true});
+  }
+
+  return true;
+}
+
+// Check an includeIf condition
+bool GitConfig::include_condition (const std::string& condition, const std::string& path) const {
+  std::string pattern;
+  int flags = 0;
+
+  if (condition.compare(0, 7, "gitdir:") == 0)
+    pattern = condition.substr(7);
+  else if (condition.compare(0, 9, "gitdir/i:") == 0) {
+    pattern = condition.substr(9);
+    flags = FNM_CASEFOLD;
+  } else if (condition.compare(0, 9, "onbranch:") == 0) {
+    pattern = condition.substr(9);
+    if (!pattern.empty() && pattern.back() == '/')
+      pattern += "**";
+    return !this->branch.empty() && fnmatch(pattern.c_str(), this->branch.c_str(), 0) == 0;
+  } else return false;
+
+  if (this->git_dir.empty() || pattern.empty())
+    return false;
+
+  // Pattern rules follow git-config(1)
+  pattern = config_expand_home(pattern);
+  if (pattern.compare(0, 2, "./") == 0)
+    pattern = config_dirname(path) + pattern.substr(1);
+  else if (pattern[0] != '/')
+    pattern = "**/" + pattern;
+  if (pattern.back() == '/')
+    pattern += "**";
+
+  // Match both the given and the resolved gitdir
+  if (fnmatch(pattern.c_str(), this->git_dir.c_str(), flags) == 0)
+    return true;
+
+  char resolved[PATH_MAX];
+  if (realpath(this->git_dir.c_str(), resolved) == NULL)
+    return false;
+  return fnmatch(pattern.c_str(), resolved, flags) == 0;
+}
+
+// Read a config file (and everything it includes)
+bool GitConfig::read (const std::string& path, const uint32_t depth) {
+  /*
+    Missing files are fine, git treats
+    them as empty. Include depth is
+    capped the same way git caps it.
+  */
+
+  if (depth > 10) {
+    std::string err_msg = "GitConfig::read() ==> Include depth exceeded at: " + path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  this->files.push_back(path);
+
+  std::string content;
+  if (!read_file(path, content))
+    return errno == ENOENT || errno == ENOTDIR;
+
+  if (!this->parse(content, path, depth)) {
+    std::string err_msg = "GitConfig::read() ==> Bad config file: " + path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  } return true;
+}
+
+// Parse config file contents
+bool GitConfig::parse (const std::string& content, const std::string& path, const uint32_t depth) {
+  std::string section;
+  size_t i = 0;
+  const size_t n = content.size();
+
+  while (i < n) {
+    char c = content[i];
+
+    // Whitespace, comments and empty lines
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      i++;
+      continue;
+    } if (c == '#' || c == ';') {
+      while (i < n && content[i] != '\n') i++;
+      continue;
+    }
+
+    // [section], [section "subsection"] or legacy [section.subsection]
+    if (c == '[') {
+      i++;
+      std::string name;
+      while (i < n && (std::isalnum(static_cast<unsigned char>(content[i])) || content[i] == '-' || content[i] == '.'))
+        name += std::tolower(static_cast<unsigned char>(content[i++]));
+      if (name.empty())
+        return false;
+
+      if (i < n && content[i] == ']') {
+        section = name;
+        i++;
+        continue;
+      }
+
+      while (i < n && (content[i] == ' ' || content[i] == '\t')) i++;
+      if (i >= n || content[i] != '"')
+        return false;
+      i++;
+
+      std::string subsection;
+      while (i < n && content[i] != '"') {
+        if (content[i] == '\n')
+          return false;
+        if (content[i] == '\\' && i + 1 < n)
+          i++;
+        subsection += content[i++];
+      }
+      if (i + 1 >= n || content[i + 1] != ']')
+        return false;
+      i += 2;
+
+      section = name + '.' + subsection;
+      continue;
+    }
+
+    // key [= value]
+    if (!std::isalpha(static_cast<unsigned char>(c)) || section.empty())
+      return false;
+
+    std::string name;
+    while (i < n && (std::isalnum(static_cast<unsigned char>(content[i])) || content[i] == '-'))
+      name += std::tolower(static_cast<unsigned char>(content[i++]));
+    while (i < n && (content[i] == ' ' || content[i] == '\t')) i++;
+
+    ConfigEntry entry;
+    entry.key = section + '.' + name;
+    entry.has_value = false;
+
+    if (i < n && content[i] == '=') {
+      i++;
+      entry.has_value = true;
+
+      // Value, with quoting, escapes and line continuation
+      bool quoted = false;
+      size_t spaces = 0;
+      while (true) {
+        if (i >= n || content[i] == '\n') {
+          if (quoted)
+            return false;
+          break;
+        }
+
+        c = content[i++];
+        if (!quoted && (c == ';' || c == '#')) {
+          while (i < n && content[i] != '\n') i++;
+          break;
+        }
+
+        if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+          if (!entry.value.empty()) spaces++;
+          continue;
+        }
+
+        for (; spaces > 0; spaces--)
+          entry.value += ' ';
+
+        if (c == '\\') {
+          if (i >= n)
+            return false;
+          c = content[i++];
+          if (c == '\n') continue;
+          else if (c == 't') entry.value += '\t';
+          else if (c == 'b') entry.value += '\b';
+          else if (c == 'n') entry.value += '\n';
+          else if (c == '\\' || c == '"') entry.value += c;
+          else return false;
+          continue;
+        }
+
+        if (c == '"') {
+          quoted = !quoted;
+          continue;
+        }
+
+        entry.value += c;
+      }
+    } else if (i < n && content[i] != '\n' && content[i] != '#' && content[i] != ';')
+      return false;
+
+    this->entries.push_back(entry);
+
+    // include.path and includeIf.<condition>.path are followed right away
+    if (!entry.has_value || name != "path")
+      continue;
+
+    bool include = section == "include";
+    if (section.compare(0, 10, "includeif.") == 0)
+      include = this->include_condition(section.substr(10), path);
+
+    if (include) {
+      std::string include_path = config_expand_home(entry.value);
+      if (!include_path.empty() && include_path[0] != '/')
+        include_path = config_dirname(path) + '/' + include_path;
+      if (!this->read(include_path, depth + 1))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Get all values of a multi valued key, in order
+std::vector<std::string> GitConfig::get_all (const std::string& key) const {
+  std::string normalized = config_normalize_key(key);
+  std::vector<std::string> values;
+  for (const auto& entry : this->entries) {
+    if (entry.key == normalized)
+      values.push_back(entry.value);
+  } return values;
+}
+
+// Get the last value of a key
+bool GitConfig::get (const std::string& key, std::string& value) const {
+  std::vector<std::string> values = this->get_all(key);
+  if (values.empty())
+    return false;
+  value = values.back();
+  return true;
+}
+
+// Apply url.<base>.insteadOf (or pushInsteadOf) rewriting
+std::string GitConfig::rewrite_url (const std::string& url, const bool push) const {
+  /*
+    The longest matching prefix wins,
+    as in git. push selects
+    pushInsteadOf, which returns the url
+    unchanged if nothing matches so the
+    caller can fall back to insteadOf.
+  */
+
+  const std::string suffix = push ? ".pushinsteadof" : ".insteadof";
+  std::string base;
+  size_t longest = 0;
+
+  for (const auto& entry : this->entries) {
+    if (entry.key.compare(0, 4, "url.") != 0 || entry.key.length() <= suffix.length() + 4 ||
+    entry.key.compare(entry.key.length() - suffix.length(), suffix.length(), suffix) != 0)
+      continue;
+
+    if (entry.value.length() > longest && url.compare(0, entry.value.length(), entry.value) == 0) {
+      longest = entry.value.length();
+      base = entry.key.substr(4, entry.key.length() - suffix.length() - 4);
+    }
+  }
+
+  if (longest == 0)
+    return url;
+  return base + url.substr(longest);
+}
+
+// Build every remote with its fetch and push urls in one pass
+std::vector<RemoteLinks> GitConfig::get_remotes () const {
+  /*
+    Fetch urls are remote.<name>.url,
+    push urls are remote.<name>.pushurl
+    if any are set, otherwise the fetch
+    urls rewritten with pushInsteadOf
+    (falling back to insteadOf).
+  */
+
+  std::map<std::string, RemoteLinks> remotes;
+  std::map<std::string, std::vector<std::string>> push_urls;
+
+  for (const auto& entry : this->entries) {
+    if (entry.key.compare(0, 7, "remote.") != 0)
+      continue;
+
+    size_t last = entry.key.rfind('.');
+    if (last <= 7)
+      continue;
+
+    std::string name = entry.key.substr(7, last - 7);
+    std::string variable = entry.key.substr(last + 1);
+    RemoteLinks& remote = remotes[name];
+    remote.name = name;
+
+    if (variable == "url" && entry.has_value)
+      remote.fetch_links.push_back(entry.value);
+    else if (variable == "pushurl" && entry.has_value)
+      push_urls[name].push_back(entry.value);
+  }
+
+  std::vector<RemoteLinks> output;
+  for (auto& remote : remotes) {
+    RemoteLinks& links = remote.second;
+    std::vector<std::string> urls = links.fetch_links;
+    links.fetch_links.clear();
+
+    for (const auto& url : urls)
+      links.fetch_links.push_back(this->rewrite_url(url, false));
+
+    if (push_urls.count(remote.first)) {
+      for (const auto& url : push_urls[remote.first])
+        links.push_links.push_back(this->rewrite_url(url, false));
+    } else {
+      for (const auto& url : urls) {
+        std::string push_url = this->rewrite_url(url, true);
+        if (push_url == url)
+          push_url = this->rewrite_url(url, false);
+        links.push_links.push_back(push_url);
+      }
+    }
+
+    // Remotes with nothing but e.g. a fetch refspec are not remotes to git either
+    if (!links.fetch_links.empty() || !links.push_links.empty())
+      output.push_back(links);
+  }
+
+  return output;
+}
+
+// Get every configured remote with its links
+bool get_remote_configs (const std::string& working_path, std::vector<RemoteLinks>& remotes) {
+  std::string git_dir;
+  std::string common_dir;
+  if (!get_git_dirs(working_path, git_dir, common_dir))
+    return false;
+
+  GitConfig config;
+  if (!config.load(git_dir, common_dir))
+    return false;
+
+  remotes = config.get_remotes();
+  return true;
+}
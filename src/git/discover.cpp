@@ -0,0 +1,243 @@
+#include "git.h"
+
+#include <climits>
+
+/*
+  Finding the repository a path is in,
+  the way git does, without running it.
+  From the path up, every directory is
+  opened once and asked, with fstatat,
+  for a .git entry, and then whether it
+  is a gitdir itself (a bare repository,
+  or somewhere inside a .git directory).
+  GIT_DIR skips the search altogether,
+  GIT_CEILING_DIRECTORIES stops it short,
+  and so does another filesystem, unless
+  GIT_DISCOVERY_ACROSS_FILESYSTEM is set.
+*/
+
+// Absolute, with no empty, . or .. components, relative paths start at base
+static std::string discover_normalize (const std::string& path, const std::string& base) {
+  std::string full = path.empty() || path[0] != '/' ? base + '/' + path : path;
+
+  std::vector<std::string> components;
+  size_t position = 0;
+  while (position <= full.length()) {
+    size_t slash = full.find('/', position);
+    if (slash == std::string::npos) slash = full.length();
+    std::string component = full.substr(position, slash - position);
+    if (component == "..") {
+      if (!components.empty()) components.pop_back();
+    } else if (!component.empty() && component != ".")
+      components.push_back(component);
+    position = slash + 1;
+  }
+
+  std::string normalized;
+  for (const auto& component : components)
+    normalized += '/' + component;
+  return normalized.empty() ? "/" : normalized;
+}
+
+// Parent of a normalized path, "/" is its own
+static std::string discover_parent (const std::string& path) {
+  size_t slash = path.rfind('/');
+  if (slash == 0 || slash == std::string::npos)
+    return "/";
+  return path.substr(0, slash);
+}
+
+// The directory .git points at, whether it is one or a gitfile (gitdir: path)
+static bool discover_dot_git (const int dir_fd, const std::string& directory, std::string& git_dir) {
+  struct stat st;
+  if (fstatat(dir_fd, ".git", &st, 0) != 0)
+    return false;
+
+  std::string dot_git = (directory == "/" ? "" : directory) + "/.git";
+  if (S_ISDIR(st.st_mode)) {
+    git_dir = dot_git;
+    return true;
+  }
+
+  std::string gitfile;
+  if (!S_ISREG(st.st_mode) || !read_file(dot_git, gitfile) || gitfile.compare(0, 8, "gitdir: ") != 0)
+    return false;
+
+  git_dir = get_lines_from_string(gitfile.substr(8)).front();
+  if (git_dir.empty())
+    return false;
+  if (git_dir[0] != '/')
+    git_dir = directory + '/' + git_dir;
+  return true;
+}
+
+// The common dir of a gitdir, which linked worktrees name in their commondir file
+static std::string discover_common_dir (const std::string& git_dir) {
+  std::string commondir;
+  if (!read_file(git_dir + "/commondir", commondir) || commondir.empty())
+    return git_dir;
+
+  std::string common_dir = get_lines_from_string(commondir).front();
+  if (common_dir[0] != '/')
+    common_dir = git_dir + '/' + common_dir;
+  return common_dir;
+}
+
+// Whether a directory is a gitdir: HEAD, with objects and refs in its common dir
+static bool discover_is_git_dir (const int dir_fd, const std::string& git_dir, std::string& common_dir) {
+  struct stat st;
+  if (fstatat(dir_fd, "HEAD", &st, 0) != 0 || !S_ISREG(st.st_mode))
+    return false;
+
+  common_dir = discover_common_dir(git_dir);
+  return stat((common_dir + "/objects").c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+    stat((common_dir + "/refs").c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Same, for a gitdir that is not open yet
+static bool discover_is_git_dir (const std::string& git_dir, std::string& common_dir) {
+  int dir_fd = open(git_dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return false;
+
+  bool is_git_dir = discover_is_git_dir(dir_fd, git_dir, common_dir);
+  close(dir_fd);
+  return is_git_dir;
+}
+
+// Climb from start to the first directory that has a repository, within the ceilings and the filesystem
+static bool discover_climb (const std::string& start, const std::vector<std::string>& ceilings, const dev_t* device, RepoLocation& location) {
+  for (std::string directory = start;; directory = discover_parent(directory)) {
+    int dir_fd = open(directory.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+      return false;
+
+    struct stat st;
+    if (device != NULL && (fstat(dir_fd, &st) != 0 || st.st_dev != *device)) {
+      close(dir_fd);
+      return false;
+    }
+
+    // dir/.git, then dir itself
+    bool found = false;
+    std::string git_dir;
+    if (discover_dot_git(dir_fd, directory, git_dir) && discover_is_git_dir(git_dir, location.common_dir)) {
+      location.toplevel = directory;
+      location.git_dir = git_dir;
+      found = true;
+    } else if (discover_is_git_dir(dir_fd, directory, location.common_dir)) {
+      location.git_dir = directory;
+      location.bare = true;
+      found = true;
+    } close(dir_fd);
+
+    if (found)
+      return true;
+    if (directory == "/" || std::find(ceilings.begin(), ceilings.end(), discover_parent(directory)) != ceilings.end())
+      return false;
+  }
+}
+
+RepoLocation::RepoLocation () {
+  this->bare = false;
+}
+
+// Find the repository containing path, its gitdir, common dir and superproject, without running git
+bool discover_repository (const std::string& path, RepoLocation& location) {
+  location = RepoLocation();
+  if (path.empty())
+    return false;
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    return false;
+  std::string start = discover_normalize(path, cwd);
+
+  // GIT_DIR names the gitdir, the working tree is GIT_WORK_TREE or where git runs
+  const char* git_dir_env = getenv("GIT_DIR");
+  if (git_dir_env != NULL && *git_dir_env != '\0') {
+    location.git_dir = discover_normalize(git_dir_env, cwd);
+    if (!discover_is_git_dir(location.git_dir, location.common_dir))
+      return false;
+
+    const char* work_tree_env = getenv("GIT_WORK_TREE");
+    location.toplevel = work_tree_env != NULL && *work_tree_env != '\0' ? discover_normalize(work_tree_env, cwd) : start;
+    location.superproject = location.toplevel;
+    return true;
+  }
+
+  // Absolute entries only, git treats an empty one as a marker and skips relative ones
+  std::vector<std::string> ceilings;
+  const char* ceilings_env = getenv("GIT_CEILING_DIRECTORIES");
+  if (ceilings_env != NULL) {
+    std::string entries = ceilings_env;
+    size_t position = 0;
+    while (position <= entries.length()) {
+      size_t colon = entries.find(':', position);
+      if (colon == std::string::npos) colon = entries.length();
+      std::string entry = entries.substr(position, colon - position);
+      if (!entry.empty() && entry[0] == '/')
+        ceilings.push_back(discover_normalize(entry, "/"));
+      position = colon + 1;
+    }
+  }
+
+  const char* across_env = getenv("GIT_DISCOVERY_ACROSS_FILESYSTEM");
+  struct stat st;
+  if (stat(start.c_str(), &st) != 0)
+    return false;
+  dev_t device = st.st_dev;
+  const dev_t* same_device = across_env != NULL && config_bool(across_env, true) ? NULL : &device;
+
+  if (!discover_climb(start, ceilings, same_device, location))
+    return false;
+
+  /*
+    The superproject is the outermost
+    working tree around this one, found
+    by climbing on from above each
+    toplevel until there is none.
+  */
+
+  location.superproject = location.toplevel;
+  while (!location.superproject.empty() && location.superproject != "/") {
+    std::string parent = discover_parent(location.superproject);
+    if (std::find(ceilings.begin(), ceilings.end(), parent) != ceilings.end())
+      break;
+
+    RepoLocation outer;
+    if (!discover_climb(parent, ceilings, same_device, outer) || outer.toplevel.empty())
+      break;
+    location.superproject = outer.toplevel;
+  }
+
+  return true;
+}
+
+// Locate the gitdir and common dir of a working tree
+bool get_git_dirs (const std::string& toplevel_path, std::string& git_dir, std::string& common_dir) {
+  /*
+    .git is either the repository itself,
+    or a gitfile pointing elsewhere, as is
+    the case for submodules and linked
+    worktrees, in the format,
+    gitdir: path
+
+    Linked worktrees keep HEAD in their
+    own gitdir, but share every other ref
+    with the main repository, whose path
+    is found in the commondir file.
+  */
+
+  int dir_fd = open(toplevel_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return false;
+
+  bool found = discover_dot_git(dir_fd, toplevel_path, git_dir);
+  close(dir_fd);
+  if (!found)
+    return false;
+
+  common_dir = discover_common_dir(git_dir);
+  return true;
+}
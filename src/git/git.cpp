@@ -12,10 +12,10 @@ std::string* get_git_version() {
     git version x.xx.x
   */
 
-  std::string command = "git -v";
+  std::vector<std::string> commands = {"git", "-v"};
 
   // Get the git version
-  std::string* git_version = execute_with_output_single_line(command);
+  std::string* git_version = execute_with_output_single_line(commands);
 
   // Extract the version number
   if (git_version == NULL)
@@ -38,6 +38,24 @@ std::string* get_git_version() {
   return new std::string(words[2]);
 }
 
+// Compare git version against major.minor
+bool git_version_at_least (const std::string& git_version, const uint32_t major, const uint32_t minor) {
+  /*
+    Versions look like 2.39.5, or
+    2.39.5.windows.1 and the like,
+    only the first two numbers matter.
+  */
+
+  uint32_t version_major = 0;
+  uint32_t version_minor = 0;
+  if (std::sscanf(git_version.c_str(), "%u.%u", &version_major, &version_minor) < 1)
+    return false;
+
+  if (version_major != major)
+    return version_major > major;
+  return version_minor >= minor;
+}
+
 // Check dugit external dependencies
 bool check_dugit_external_dependencies () {
   /*
@@ -54,147 +72,125 @@ bool check_dugit_external_dependencies () {
 // Get remote names
 std::string* get_remote_names(const std::string& working_path) {
   /*
-    We can use git remote to get all of the
-    names of each connected remote, simply
-    delimited by new-lines.
+    Remote names are read from the
+    remote.<name> sections of the git
+    configuration, delimited by new-lines,
+    just like git remote prints them.
   */
 
-  std::vector<std::string> commands = {
-    "cd", working_path, "&&","git", "remote"
-  }; return execute_with_output(commands);
+  std::vector<RemoteLinks> remotes;
+  if (!get_remote_configs(working_path, remotes))
+    return NULL;
+
+  std::vector<std::string> names;
+  for (const auto& remote : remotes)
+    names.push_back(remote.name);
+  return new std::string(get_string_from_lines(names));
 }
 
 // Get remote push links, filtered by remote name and direction
 std::string* get_remote_links(const std::string& working_path, const std::string& remote_name, const std::string& direction) {
   /*
-    To get the remote push links, one can
-    use git remote get-url remote_name --push or --all,
-    we can also verify the direction of each url via
-    git remote -v.
-
-    The output is expected to come in the format,
-    link
-
-    and for the second command, the output is strange
-    with padding characters, hence the first command is
-    used to fetch the name, and the format is like so,
-    remote_name  link (direction)
-    with hidden padding characters between each word.
+    The links come from the git
+    configuration, with pushurl and
+    insteadOf/pushInsteadOf applied the
+    same way git remote -v shows them.
+    direction is either (fetch) or (push).
   */
 
-  std::vector<std::string> commands = {
-    "cd", working_path, "&&","git", "remote", "get-url", remote_name, "--all"
-  };
-  std::vector<std::string> verify_commands = {
-    "cd", working_path, "&&", "git", "remote", "-v"
-  };
-
-  // Get remote links
-  std::string* remote_links_str = execute_with_output(commands);
-  if (remote_links_str == NULL)
-    return NULL;
-  
-  std::string* verify_remote_links_str = execute_with_output(verify_commands);
-  if (verify_remote_links_str == NULL) {
-    delete(remote_links_str);
+  std::vector<RemoteLinks> remotes;
+  if (!get_remote_configs(working_path, remotes))
     return NULL;
-  }
 
-  std::vector<std::string> output;
-  for (const auto& link : get_lines_from_string(*remote_links_str)) {
-    for (const auto& line : get_lines_from_string(*verify_remote_links_str)) {
-      if (line.empty() || link.empty()) continue;
-      if (line.find(link) != std::string::npos &&
-      line.find(direction) != std::string::npos &&
-      line.find(remote_name) == 0)
-        output.push_back(link);
-    }
+  for (const auto& remote : remotes) {
+    if (remote.name != remote_name)
+      continue;
+
+    if (direction == "(push)")
+      return new std::string(get_string_from_lines(remote.push_links));
+    return new std::string(get_string_from_lines(remote.fetch_links));
   }
 
-  delete(remote_links_str);
-  delete(verify_remote_links_str);
-  return new std::string(get_string_from_lines(output));
+  std::string err_msg = "get_remote_links() ==> No such remote: " + remote_name + '\n';
+  print_error(err_msg.c_str());
+  return NULL;
 }
 
 // Get local branch names
 std::string* get_local_branch_names (const std::string& working_path) {
   /*
-    This can be achieved using git branch, and the
-    output is expected to be in the format of
-      branch_name, notice the two spaces.
+    Local branches are the refs below
+    refs/heads/, read straight from
+    the ref database (loose refs and
+    packed-refs) instead of parsing
+    git branch output.
   */
 
-  std::vector<std::string> commands = {
-    "cd", working_path, "&&", "git", "branch"
-  };
-
-  std::string* command_out = execute_with_output(commands);
-  if (command_out == NULL)
+  std::string git_dir;
+  std::string common_dir;
+  if (!get_git_dirs(working_path, git_dir, common_dir))
     return NULL;
 
-  std::vector<std::string> local_branch_names = get_lines_from_string(*command_out);
-  delete(command_out);
-  if (!strings_trim_fronts(local_branch_names, 2))
+  std::vector<Ref> refs;
+  if (!read_refs(common_dir, "refs/heads/", refs))
     return NULL;
 
+  std::vector<std::string> local_branch_names;
+  for (const auto& ref : refs)
+    local_branch_names.push_back(ref.name.substr(11));
+
   return new std::string(get_string_from_lines(local_branch_names));
 }
 
 // Get remote branch names, filtered by remote name
 std::string* get_remote_branch_names (const std::string& working_path, const std::string& remote_name) {
   /*
-    Remote branch names can be
-    fetched with git branch -r. The
-    output has the expected format
-    of remote_name/branch_name.
+    Remote branches of remote_name are
+    the refs below refs/remotes/remote_name/,
+    the symbolic remote HEAD is skipped.
   */
 
-  std::vector<std::string> commands = {
-    "cd", working_path, "&&", "git", "branch", "-r"
-  };
-
-  // Get remote branch names
-  std::string* command_out = execute_with_output(commands);
+  std::string git_dir;
+  std::string common_dir;
+  if (!get_git_dirs(working_path, git_dir, common_dir))
+    return NULL;
 
-  if (command_out == NULL)
+  std::string prefix = "refs/remotes/" + remote_name + '/';
+  std::vector<Ref> refs;
+  if (!read_refs(common_dir, prefix, refs))
     return NULL;
 
-  // Filter for remote_name
-  std::vector<std::string> all_branch_names = get_lines_from_string(*command_out);
-  delete(command_out);
   std::vector<std::string> remote_branch_names;
-  for (const auto& name : all_branch_names) {
-    if (name.empty())
-      continue;
-    
-    // Skip if line contains "HEAD"
-    if (name.find("HEAD") != std::string::npos)
+  for (const auto& ref : refs) {
+    if (!ref.symref.empty() || ref.name == prefix + "HEAD")
       continue;
-
-    // Filter for remote name
-    if (name.find(remote_name) == std::string::npos)
-      continue;
-    
-    remote_branch_names.push_back(name);
+    remote_branch_names.push_back(ref.name.substr(prefix.length()));
   }
 
-  if (!strings_trim_fronts(remote_branch_names, remote_name.length() + 3))
-    return NULL;
-  
   return new std::string(get_string_from_lines(remote_branch_names));
 }
 
 // Get current branch name
 std::string* get_current_branch_name (const std::string& working_path) {
   /*
-    The current branch name can be
-    fetched with the command,
-    git branch --show-current.
+    The current branch is the target of
+    the symbolic HEAD of this working
+    tree. A detached HEAD has no current
+    branch, same as git branch --show-current.
   */
 
-  std::vector<std::string> commands = {
-    "cd", working_path, "&&", "git", "branch", "--show-current"
-  }; return execute_with_output_single_line(commands);
+  std::string git_dir;
+  std::string common_dir;
+  if (!get_git_dirs(working_path, git_dir, common_dir))
+    return NULL;
+
+  Ref head;
+  if (!read_head(git_dir, head))
+    return NULL;
+
+  if (head.symref.compare(0, 11, "refs/heads/") != 0)
+    return new std::string();
+  return new std::string(head.symref.substr(11));
 }
 
 // Get Super Project Working Tree path
@@ -230,84 +226,43 @@ std::string* get_toplevel_path (const std::string& working_path) {
 // Get Super Project Working Tree path manually
 std::string* get_superproject_path_manually (const std::string& working_path) {
   /*
-    We can get the toplevel path of the
-    super project by recursively going 
-    through the directories starting
-    from the current working directory.
+    The toplevel path of the super
+    project is the outermost working
+    tree found going up from the current
+    working directory.
   */
 
-  std::string current_path = working_path;
-  std::string last_valid_path = "";
-
-  while (is_inside_working_tree(current_path) &&
-    current_path != last_valid_path) {
-    last_valid_path = current_path;
-    std::string* command_out = execute_with_output_single_line(
-      {"cd", current_path, "&&", "cd ..", "&&", "pwd"}
-    );
-    if (command_out == NULL) return NULL;
-    current_path = *command_out;
-    delete(command_out);
-  }
-
-  if (last_valid_path.empty()) return NULL;
-  return new std::string(last_valid_path);
+  RepoLocation location;
+  if (!discover_repository(working_path, location) || location.toplevel.empty())
+    return NULL;
+  return new std::string(location.superproject);
 }
 
 // Get Top Level path manually
 std::string* get_toplevel_path_manually (const std::string& working_path) {
   /*
-    We can get the toplevel path of the
-    current repo by recursively going 
-    backwards through the directories
-    starting from the current working
-    directory.
+    The toplevel path of the current
+    repo is the first directory going up
+    from the current working directory
+    with a .git directory or gitfile.
   */
 
-  std::string current_path = working_path;
-  std::string previous_path;
-  std::string first_valid_path = "";
-
-  while (is_inside_working_tree(current_path) &&
-    current_path != previous_path &&
-    first_valid_path.empty()) {
-    if (dir_exists(current_path + "/.git"))
-      first_valid_path = current_path;
-    previous_path = current_path;
-    std::string* command_out = execute_with_output_single_line(
-      {"cd", current_path, "&&", "cd ..", "&&", "pwd"}
-    );
-    if (command_out == NULL) return NULL;
-    current_path = *command_out;
-    delete(command_out);
-  }
-
-  if (first_valid_path.empty()) return NULL;
-  return new std::string(first_valid_path);
+  RepoLocation location;
+  if (!discover_repository(working_path, location) || location.toplevel.empty())
+    return NULL;
+  return new std::string(location.toplevel);
 }
 
 // Return if currently inside working tree
 bool is_inside_working_tree (const std::string& path) {
   /*
-    We can check if we are currently
-    inside a working tree by using,
+    Inside a working tree, but not inside
+    its gitdir, like
     git rev-parse --is-inside-work-tree
   */
 
-  if (path.empty())
-    return false;
-
-  std::vector<std::string> commands(
-    {"cd", path, "&&", "git rev-parse --is-inside-work-tree"}
-  );
-
-  std::string* command_out = execute_with_output_single_line(commands);
-  if (command_out == NULL) return NULL;
-  std::string result = *command_out;
-  delete(command_out);
-  if (result == "true")
-    return true;
-  return false;
+  RepoLocation location;
+  return discover_repository(path, location) && !location.toplevel.empty();
 }
 
 // Get .dugit path
@@ -354,36 +309,37 @@ bool check_dugit_in_gitignore (const std::string& path) {
   return line_in_file_exists(path + "/.gitignore", ".dugit/");
 }
 
-// Check .lock file
-bool check_lock_file (const std::string& path, const std::string& ppid) {
-  if (!file_exists(path))
-    return false;
-  
-  if (line_pos_in_file(path, ppid) == -1)
-    return false;
-
-  return true;
-}
-
-// set .lock file
-bool set_lock_file (const std::string& path, const std::string& ppid) {
-  if (!lock_file(path))
-    return false;
-  
-  if (!append_line_to_file(path, ppid))
-    return false;
-
-  return true;
-}
+// Keep .dugit out of git add and git status, through info/exclude of the repository
+bool exclude_dugit (const std::string& common_dir) {
+  /*
+    .dugit holds the lock, the snapshot
+    and the --isolated worktree, none of
+    which may ever be staged. Unlike a
+    .gitignore entry, info/exclude is
+    not part of the working tree, so it
+    needs no commit of its own.
+  */
 
-// unset .lock file
-bool unset_lock_file (const std::string& path) {
-  if (!clear_file(path))
+  std::string path = common_dir + "/info/exclude";
+  std::string content;
+  if (read_file(path, content)) {
+    for (const auto& line : get_lines_from_string(content)) {
+      if (line == ".dugit/" || line == "/.dugit/" || line == ".dugit" || line == "/.dugit")
+        return true;
+    }
+  } else if (!create_dirs(common_dir + "/info"))
     return false;
 
-  if (!unlock_file(path))
+  std::ofstream file(path, std::ios::app);
+  if (!file.is_open()) {
+    std::string err_msg = "exclude_dugit() ==> Failed to open file: " + path + '\n';
+    print_error(err_msg.c_str());
     return false;
+  }
 
+  if (!content.empty() && content.back() != '\n')
+    file << '\n';
+  file << "/.dugit/\n";
   return true;
 }
 
@@ -399,7 +355,7 @@ bool stage_changes (const std::string& working_path, const bool all) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "stage_changes() ==> Could not stage (add) changes at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
 
     // Unstage everything before moving on
     unstage_changes(working_path);
@@ -419,7 +375,7 @@ bool unstage_changes (const std::string& working_path) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "unstage_changes() ==> Could not unstage (remove) staged changes at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   }
 
@@ -430,14 +386,20 @@ bool unstage_changes (const std::string& working_path) {
 // Auto Commit Message
 std::string commit_local_message (const std::string& working_path) {
   std::time_t now_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  std::tm* now_tm = std::localtime(&now_time);
+  std::tm now_tm;
+  localtime_r(&now_time, &now_tm);
   std::ostringstream oss;
-  oss << std::put_time(now_tm, "%Y-%m-%d %H:%M:%S");
-  std::string* diff_file_names_output = get_diff_cached_names(working_path);
+  oss << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
+  // Names are cut off at 256 characters below, so there is no point reading many more
+  std::string* diff_file_names_output = get_diff_cached_names(working_path, 512);
   std::string diff_file_names;
   if (diff_file_names_output == NULL)
     return '[' + oss.str() + "] Dugit Commit.";
-  
+
+  // Drop a name that was only read partially
+  if (diff_file_names_output->size() >= 512)
+    diff_file_names_output->erase(diff_file_names_output->rfind('\n') + 1);
+
   diff_file_names += ", Changes apply to: ";
   for (const auto& name : get_lines_from_string(*diff_file_names_output)) {
     diff_file_names += name + ", ";
@@ -460,7 +422,7 @@ bool fetch_remote (const std::string& working_path, const std::string& remote_na
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "fetch_remote() ==> Could not fetch from remote " + remote_name + '/' + branch_name + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   }
 
@@ -468,20 +430,38 @@ bool fetch_remote (const std::string& working_path, const std::string& remote_na
   return true;
 }
 
+// Fetch from several remotes concurrently
+bool fetch_remotes (const std::string& working_path, const std::vector<std::string>& remote_names, const std::string& branch_name, const uint32_t jobs, std::vector<ProcessResult>& results) {
+  /*
+    Every remote gets its own git fetch,
+    at most jobs of them at a time. Each
+    result holds that remote's own output,
+    in the order of remote_names, so one
+    failing remote does not affect the
+    others.
+  */
+
+  std::vector<std::vector<std::string>> commands;
+  for (const auto& remote_name : remote_names)
+    commands.push_back({"git", "fetch", remote_name, branch_name});
+
+  return run_processes(commands, working_path, jobs, results);
+}
+
 // Merge Sequence (No commit nor fast-forward, with autostash enabled)
 bool merge (const std::string& working_path, const std::string& remote_name, const std::string& branch_name, const bool ff) {
   std::vector<std::string> commands = {
     "cd", working_path, "&&", "git", "merge", "--no-commit" //, "--autostash"
   };
 
-  if (ff) commands.push_back("--fast-forward");
+  if (ff) commands.push_back("--ff");
   else commands.push_back("--no-ff");
   commands.push_back(remote_name + '/' + branch_name);
 
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "merge() ==> Could not merge with " + remote_name + '/' + branch_name + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
 
     std::string* status = get_status(working_path);
     if (status != NULL) {
@@ -502,6 +482,39 @@ bool merge (const std::string& working_path, const std::string& remote_name, con
   return true;
 }
 
+// Octopus merge of several remotes at once (No commit nor fast-forward)
+bool merge_octopus (const std::string& working_path, const std::vector<std::string>& remote_names, const std::string& branch_name, const bool ff) {
+  /*
+    A single git merge with every remote
+    branch as a head checks the tree out
+    once and records one merge commit.
+    The octopus strategy refuses to do
+    conflicts, either rewinding the tree
+    or leaving a failed merge behind, in
+    which case the caller aborts it and
+    falls back to one remote at a time.
+  */
+
+  std::vector<std::string> commands = {
+    "cd", working_path, "&&", "git", "merge", "--no-commit"
+  };
+
+  if (ff) commands.push_back("--ff");
+  else commands.push_back("--no-ff");
+  for (const auto& remote_name : remote_names)
+    commands.push_back(remote_name + '/' + branch_name);
+
+  std::string* command_out = execute_with_output(commands);
+  if (command_out == NULL) {
+    std::string err_msg = "merge_octopus() ==> Could not merge " + std::to_string(remote_names.size()) + " remotes at once\n";
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  delete(command_out);
+  return true;
+}
+
 // Abort merge
 bool merge_abort (const std::string& working_path) {
   std::vector<std::string> commands = {
@@ -511,16 +524,177 @@ bool merge_abort (const std::string& working_path) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "merge_abort() ==> Could not abort merge, please investigate.\n";
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   }
 
   std::string err_msg = "merge_abort() ==> Merge aborted.\n";
-  perror(err_msg.c_str());
+  print_error(err_msg.c_str());
   delete(command_out);
   return true;
 }
 
+// Merge refs into HEAD one after another in memory, stopping at the first conflict
+bool preview_merges (const std::string& working_path, const std::vector<std::string>& refs, std::string& conflicting_ref, std::vector<std::string>& conflicts) {
+  /*
+    git merge-tree --write-tree (git 2.38)
+    runs a real merge against the object
+    store only, the index and working tree
+    are never touched. Exit status 1 means
+    conflicts, and --name-only lists the
+    conflicting paths after the tree id.
+
+    To preview the merges the way sync
+    applies them, each clean result is
+    turned into a throwaway commit with
+    git commit-tree, no ref points to it,
+    and becomes the base of the next one.
+  */
+
+  conflicting_ref.clear();
+  conflicts.clear();
+
+  std::string base = "HEAD";
+  for (uint32_t ref = 0; ref < refs.size(); ref++) {
+    ProcessResult result;
+    run_process({"git", "merge-tree", "--write-tree", "--name-only", "--no-messages", base, refs.at(ref)}, working_path, result);
+    if (result.exit_status != 0 && result.exit_status != 1) {
+      std::string err_msg = "preview_merges() ==> Could not merge " + refs.at(ref) + " in memory at path: " + working_path + '\n' + result.err;
+      print_error(err_msg.c_str());
+      return false;
+    }
+
+    std::vector<std::string> lines = get_lines_from_string(result.out);
+    if (lines.empty() || lines.front().empty()) {
+      std::string err_msg = "preview_merges() ==> No tree written for " + refs.at(ref) + '\n';
+      print_error(err_msg.c_str());
+      return false;
+    }
+
+    if (result.exit_status == 1) {
+      conflicting_ref = refs.at(ref);
+      for (uint32_t line = 1; line < lines.size() && !lines.at(line).empty(); line++)
+        conflicts.push_back(lines.at(line));
+      return true;
+    }
+
+    // The last merge needs no commit to build on
+    if (ref + 1 == refs.size())
+      break;
+
+    ProcessResult commit_result;
+    if (!run_process({"git", "-c", "user.name=dugit", "-c", "user.email=dugit@localhost", "commit-tree", lines.front(), "-p", base, "-p", refs.at(ref), "-m", "dugit merge preview"}, working_path, commit_result)) {
+      std::string err_msg = "preview_merges() ==> Could not record the merge with " + refs.at(ref) + '\n' + commit_result.err;
+      print_error(err_msg.c_str());
+      return false;
+    } base = commit_result.out.substr(0, commit_result.out.find('\n'));
+  }
+
+  return true;
+}
+
+// Paths changed on each ref since it forked from base, concurrently
+bool get_incoming_paths (const std::string& working_path, const std::string& base, const std::vector<std::string>& refs, const uint32_t jobs, std::vector<std::string>& paths) {
+  /*
+    base...ref diffs the merge base against
+    the ref, which is exactly what a merge
+    brings in. --no-renames reports both
+    sides of a rename.
+  */
+
+  paths.clear();
+
+  std::vector<std::vector<std::string>> commands;
+  for (const auto& ref : refs)
+    commands.push_back({"git", "diff", "--name-only", "-z", "--no-renames", base + "..." + ref});
+
+  std::vector<ProcessResult> results;
+  if (!run_processes(commands, working_path, jobs, results)) {
+    std::string err_msg = "get_incoming_paths() ==> Could not diff incoming changes at path: " + working_path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  for (const auto& result : results) {
+    size_t position = 0;
+    while (position < result.out.size()) {
+      size_t end = result.out.find('\0', position);
+      if (end == std::string::npos) end = result.out.size();
+      if (end > position)
+        paths.push_back(result.out.substr(position, end - position));
+      position = end + 1;
+    }
+  }
+
+  return true;
+}
+
+// Check out commit, detached and clean, in a linked worktree, adding it if needed
+bool prepare_worktree (const std::string& working_path, const std::string& worktree_path, const std::string& commit) {
+  /*
+    The worktree is detached so it never
+    holds the branch the user has checked
+    out, git refuses to check a branch out
+    twice. Whatever an earlier sync left in
+    it, including a half finished merge, is
+    thrown away.
+  */
+
+  ProcessResult result;
+  struct stat st;
+  if (stat((worktree_path + "/.git").c_str(), &st) != 0) {
+    // A worktree directory that was deleted by hand is still registered
+    run_process({"git", "worktree", "prune"}, working_path, result);
+    if (!run_process({"git", "worktree", "add", "--quiet", "--detach", worktree_path, commit}, working_path, result)) {
+      std::string err_msg = "prepare_worktree() ==> Could not add worktree at path: " + worktree_path + '\n' + result.err;
+      print_error(err_msg.c_str());
+      return false;
+    } return true;
+  }
+
+  if (!run_process({"git", "reset", "--quiet", "--hard"}, worktree_path, result) ||
+  !run_process({"git", "checkout", "--quiet", "--force", "--detach", commit}, worktree_path, result) ||
+  !run_process({"git", "clean", "--quiet", "-fd"}, worktree_path, result)) {
+    std::string err_msg = "prepare_worktree() ==> Could not reset worktree at path: " + worktree_path + '\n' + result.err;
+    print_error(err_msg.c_str());
+    return false;
+  } return true;
+}
+
+// Merge a ref and commit the result right away
+bool merge_commit (const std::string& working_path, const std::string& ref, const bool ff, const std::string& message) {
+  ProcessResult result;
+  if (!run_process({"git", "merge", "--no-edit", ff ? "--ff" : "--no-ff", "-m", message, ref}, working_path, result)) {
+    std::string err_msg = "merge_commit() ==> Could not merge with " + ref + '\n' + result.out + result.err;
+    print_error(err_msg.c_str());
+    return false;
+  } return true;
+}
+
+// Fast-forward the checked out branch to commit, refusing anything else
+bool fast_forward (const std::string& working_path, const std::string& commit) {
+  ProcessResult result;
+  if (!run_process({"git", "merge", "--quiet", "--ff-only", commit}, working_path, result)) {
+    std::string err_msg = "fast_forward() ==> Could not fast-forward to " + commit + " at path: " + working_path + '\n' + result.err;
+    print_error(err_msg.c_str());
+    return false;
+  } return true;
+}
+
+// Object id of HEAD (NULL on failure)
+std::string* get_head_commit (const std::string& working_path) {
+  std::vector<std::string> commands = {
+    "cd", working_path, "&&", "git", "rev-parse", "--verify", "HEAD"
+  };
+
+  std::string* command_out = execute_with_output_single_line(commands);
+  if (command_out == NULL) {
+    std::string err_msg = "get_head_commit() ==> Could not resolve HEAD at path: " + working_path + '\n';
+    print_error(err_msg.c_str());
+    return NULL;
+  } return command_out;
+}
+
 // Push Sequence
 bool push_remote (const std::string& working_path, const std::string& remote_name, const std::string& branch_name) {
   std::vector<std::string> commands = {
@@ -530,7 +704,7 @@ bool push_remote (const std::string& working_path, const std::string& remote_nam
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "push_remote() ==> Could not push to " + remote_name + '/' + branch_name + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   }
 
@@ -538,6 +712,21 @@ bool push_remote (const std::string& working_path, const std::string& remote_nam
   return true;
 }
 
+// Push to several remotes concurrently
+bool push_remotes (const std::string& working_path, const std::vector<std::string>& remote_names, const std::string& branch_name, const uint32_t jobs, std::vector<ProcessResult>& results) {
+  /*
+    Same as fetch_remotes, every remote
+    gets its own git push and its own
+    result, in the order of remote_names.
+  */
+
+  std::vector<std::vector<std::string>> commands;
+  for (const auto& remote_name : remote_names)
+    commands.push_back({"git", "push", remote_name, branch_name});
+
+  return run_processes(commands, working_path, jobs, results);
+}
+
 // Git Status
 std::string* get_status (const std::string& working_path) {
   std::vector<std::string> commands = {
@@ -547,7 +736,7 @@ std::string* get_status (const std::string& working_path) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "get_status() ==> Could not get git status at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
@@ -561,7 +750,7 @@ std::string* get_diff_head (const std::string& working_path) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "get_diff_head() ==> Could not get git diff HEAD at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
@@ -575,7 +764,7 @@ std::string* get_diff_head_remote (const std::string& working_path, const std::s
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "get_diff_head_remote() ==> Could not get git diff HEAD " + remote_branch + " at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
@@ -589,21 +778,21 @@ std::string* get_diff_cached (const std::string& working_path) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "get_diff_cached() ==> Could not get git diff --cached at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
 
-// Git Diff cached file names
-std::string* get_diff_cached_names (const std::string& working_path) {
+// Git Diff cached file names, at most max_bytes of them
+std::string* get_diff_cached_names (const std::string& working_path, const size_t max_bytes) {
   std::vector<std::string> commands = {
     "cd", working_path, "&&", "git", "diff", "--cached", "--name-only"
   };
 
-  std::string* command_out = execute_with_output(commands);
+  std::string* command_out = execute_with_output_bounded(commands, max_bytes);
   if (command_out == NULL) {
     std::string err_msg = "get_diff_cached_names() ==> Could not get git diff --cached --name-only at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
@@ -617,7 +806,7 @@ std::string* get_diff_uncached (const std::string& working_path) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "get_diff_uncached() ==> Could not get git diff at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
@@ -629,13 +818,13 @@ bool commit (const std::string& working_path, const std::string& message) {
   };
 
   if (!message.empty()) {
-    commands.push_back(std::string('\"' + message + '\"'));
-  } else commands.push_back(std::string('\"' + "Dugit, no commit message provided." + '\"'));
+    commands.push_back(message);
+  } else commands.push_back("Dugit, no commit message provided.");
 
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "commit() ==> Could not commit at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   } delete(command_out);
   return true;
@@ -644,9 +833,10 @@ bool commit (const std::string& working_path, const std::string& message) {
 // Automatic Commit Message after committing sync merging
 std::string commit_sync_message () {
   std::time_t now_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  std::tm* now_tm = std::localtime(&now_time);
+  std::tm now_tm;
+  localtime_r(&now_time, &now_tm);
   std::ostringstream oss;
-  oss << std::put_time(now_tm, "%Y-%m-%d %H:%M:%S");
+  oss << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
   return '[' + oss.str() + "] Dugit Repository Sync.";
 }
 
@@ -659,11 +849,101 @@ std::string* get_log_diff (const std::string& working_path, const std::string& b
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "get_log_diff() ==> Could not get git log " + branch_a + ".." + branch_b + " path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return NULL;
   } return command_out;
 }
 
+// Ahead/behind counts of several refs against a base, in one go
+bool get_ahead_behind (const std::string& working_path, const std::string& git_version, const std::string& base, const std::vector<std::string>& refs, const uint32_t jobs, std::vector<AheadBehind>& counts) {
+  /*
+    git 2.41 and newer can count every
+    ref against the base in a single
+    git for-each-ref --format=%(ahead-behind:base)
+    call, where ahead is the number of
+    commits only on the ref (incoming)
+    and behind the number only on the
+    base (outgoing).
+
+    Older gits get one
+    git rev-list --left-right --count base...ref
+    per ref, all run concurrently.
+    refs are expected to exist.
+  */
+
+  counts.clear();
+  for (const auto& ref : refs) {
+    AheadBehind count;
+    count.ref = ref;
+    count.incoming = 0;
+    count.outgoing = 0;
+    count.valid = false;
+    counts.push_back(count);
+  }
+
+  if (refs.empty())
+    return true;
+
+  if (git_version_at_least(git_version, 2, 41)) {
+    std::vector<std::string> commands = {
+      "git", "for-each-ref", "--format=%(refname) %(ahead-behind:" + base + ")"
+    };
+    for (const auto& ref : refs)
+      commands.push_back(ref);
+
+    ProcessResult result;
+    if (!run_process(commands, working_path, result)) {
+      std::string err_msg = "get_ahead_behind() ==> Could not count commits against " + base + " at path: " + working_path + '\n' + result.err;
+      print_error(err_msg.c_str());
+      return false;
+    }
+
+    for (const auto& line : get_lines_from_string(result.out)) {
+      std::stringstream ss(line);
+      std::string name;
+      uint32_t ahead;
+      uint32_t behind;
+      if (!(ss >> name >> ahead >> behind))
+        continue;
+
+      for (auto& count : counts) {
+        if (count.ref != name) continue;
+        count.incoming = ahead;
+        count.outgoing = behind;
+        count.valid = true;
+      }
+    }
+  } else {
+    std::vector<std::vector<std::string>> commands;
+    for (const auto& ref : refs)
+      commands.push_back({"git", "rev-list", "--left-right", "--count", base + "..." + ref});
+
+    std::vector<ProcessResult> results;
+    run_processes(commands, working_path, jobs, results);
+
+    for (uint32_t ref = 0; ref < refs.size(); ref++) {
+      std::stringstream ss(results.at(ref).out);
+      uint32_t left;
+      uint32_t right;
+      if (results.at(ref).exit_status != 0 || !(ss >> left >> right))
+        continue;
+      counts.at(ref).outgoing = left;
+      counts.at(ref).incoming = right;
+      counts.at(ref).valid = true;
+    }
+  }
+
+  for (const auto& count : counts) {
+    if (!count.valid) {
+      std::string err_msg = "get_ahead_behind() ==> Could not count commits between " + base + " and " + count.ref + '\n';
+      print_error(err_msg.c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
 std::string commit_custom_message () {
   std::cout << "Please enter a custom commit message here:\n";
   std::string input;
@@ -671,15 +951,6 @@ std::string commit_custom_message () {
   return input;
 }
 
-bool clean_commit_message (std::string& message) {
-  std::string new_message;
-  for (const auto& c : message) {
-    if (c == 34) new_message += '\\';
-    new_message += c;
-  } message = new_message;
-  return true;
-}
-
 // Stash all changes
 bool stash (const std::string& working_path, const bool& keep_index) {
   std::vector<std::string> commands = {
@@ -692,7 +963,7 @@ bool stash (const std::string& working_path, const bool& keep_index) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "stash() ==> Could not stash changes at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   } delete(command_out);
   return true;
@@ -710,43 +981,32 @@ bool pop_stash (const std::string& working_path, const bool& keep_index) {
   std::string* command_out = execute_with_output(commands);
   if (command_out == NULL) {
     std::string err_msg = "pop_stash() ==> Could not pop stash changes at path: " + working_path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   } delete(command_out);
   return true;
 }
 
-// Check for untracked files
-bool check_untracked (const std::string& working_path) {
-  std::vector<std::string> commands = {
-    "cd", working_path, "&&", "git", "ls-files", "--others", "--exclude-standard"
-  };
-
-  std::string* command_out = execute_with_output(commands);
-  if (command_out == NULL) {
-    std::string err_msg = "check_untracked() ==> Could not check untracked files at path: " + working_path + '\n';
-    perror(err_msg.c_str());
-    return false;
-  }
-
-  if (!command_out->empty()) {
-    delete(command_out);
-    return true;
-  } delete(command_out);
-  return false;
+// A file in the gitdir of a working tree, which is not always .git (submodules, linked worktrees)
+static bool git_dir_file_exists (const std::string& working_path, const std::string& name) {
+  std::string git_dir;
+  std::string common_dir;
+  if (!get_git_dirs(working_path, git_dir, common_dir))
+    git_dir = working_path + "/.git";
+  return file_exists(git_dir + '/' + name);
 }
 
 // Check MERGE_HEAD file
 bool check_merge_head_file (const std::string& working_path) {
-  return file_exists(working_path + "/.git/MERGE_HEAD");
+  return git_dir_file_exists(working_path, "MERGE_HEAD");
 }
 
 // Check MERGE_MSG file
 bool check_merge_msg_file (const std::string& working_path) {
-  return file_exists(working_path + "/.git/MERGE_MSG");
+  return git_dir_file_exists(working_path, "MERGE_MSG");
 }
 
 // Check MERGE_MODE file
 bool check_merge_mode_file (const std::string& working_path) {
-  return file_exists(working_path + "/.git/MERGE_MODE");
+  return git_dir_file_exists(working_path, "MERGE_MODE");
 }
\ No newline at end of file
@@ -13,6 +13,9 @@
 // Get git version
 std::string* get_git_version();
 
+// Compare git version against major.minor
+bool git_version_at_least(const std::string& git_version, const uint32_t major, const uint32_t minor);
+
 // Check dugit external dependencies
 bool check_dugit_external_dependencies();
 
@@ -22,6 +25,29 @@ std::string* get_remote_names(const std::string& working_path);
 // Get remote push and fetch links
 std::string* get_remote_links(const std::string& working_path, const std::string& remote_name, const std::string& direction);
 
+// Locate the gitdir and common dir of a working tree
+bool get_git_dirs(const std::string& toplevel_path, std::string& git_dir, std::string& common_dir);
+
+struct RepoLocation {
+  // Root of the working tree, empty without one (a bare repository, or inside a gitdir)
+  std::string toplevel;
+
+  // gitdir, and the common dir shared by its worktrees
+  std::string git_dir;
+  std::string common_dir;
+
+  // Outermost working tree around toplevel, toplevel itself if there is none
+  std::string superproject;
+
+  // The repository was found as a gitdir rather than through a .git entry
+  bool bare;
+
+  RepoLocation();
+};
+
+// Find the repository containing path, its gitdir, common dir and superproject, without running git
+bool discover_repository(const std::string& path, RepoLocation& location);
+
 // Get local branch names
 std::string* get_local_branch_names(const std::string& working_path);
 
@@ -58,14 +84,8 @@ bool add_dugit_to_gitignore(const std::string& path);
 // Check if .dugit is already in the .gitignore
 bool check_dugit_in_gitignore(const std::string& path);
 
-// Check .lock file
-bool check_lock_file(const std::string& path, const std::string& ppid);
-
-// Set .lock file
-bool set_lock_file(const std::string& path, const std::string& ppid);
-
-// Unset .lock file
-bool unset_lock_file(const std::string& path);
+// Keep .dugit out of git add and git status, through info/exclude of the repository
+bool exclude_dugit(const std::string& common_dir);
 
 // Stage Changes
 bool stage_changes(const std::string& working_path, const bool all);
@@ -76,18 +96,48 @@ bool unstage_changes(const std::string& working_path);
 // Fetch Sequence
 bool fetch_remote(const std::string& working_path, const std::string& remote_name, const std::string& branch_name);
 
+// Fetch from several remotes concurrently (results keep remote_names order)
+bool fetch_remotes(const std::string& working_path, const std::vector<std::string>& remote_names, const std::string& branch_name, const uint32_t jobs, std::vector<ProcessResult>& results);
+
 // Merge Sequence (No commit nor fast-forward, with autostash enabled)
 bool merge(const std::string& working_path, const std::string& remote_name, const std::string& branch_name, const bool ff);
 
+// Octopus merge of several remotes at once (No commit nor fast-forward)
+bool merge_octopus(const std::string& working_path, const std::vector<std::string>& remote_names, const std::string& branch_name, const bool ff);
+
 // Abort merge
 bool merge_abort(const std::string& working_path);
 
+// Merge refs into HEAD in memory, reporting the first ref that conflicts and its paths
+bool preview_merges(const std::string& working_path, const std::vector<std::string>& refs, std::string& conflicting_ref, std::vector<std::string>& conflicts);
+
+// Paths an eventual merge of refs into base would change
+bool get_incoming_paths(const std::string& working_path, const std::string& base, const std::vector<std::string>& refs, const uint32_t jobs, std::vector<std::string>& paths);
+
+// Check out commit, detached and clean, in a linked worktree, adding it if needed
+bool prepare_worktree(const std::string& working_path, const std::string& worktree_path, const std::string& commit);
+
+// Merge a ref and commit the result right away
+bool merge_commit(const std::string& working_path, const std::string& ref, const bool ff, const std::string& message);
+
+// Fast-forward the checked out branch to commit, refusing anything else
+bool fast_forward(const std::string& working_path, const std::string& commit);
+
+// Object id of HEAD
+std::string* get_head_commit(const std::string& working_path);
+
 // Git Commit
 bool commit(const std::string& working_path, const std::string& message);
 
+// Commit only paths (gitlinks included) as they are in the working tree, whatever else is staged
+bool commit_paths(const std::string& working_path, const std::vector<std::string>& paths, const std::string& message);
+
 // Push Sequence
 bool push_remote(const std::string& working_path, const std::string& remote_name, const std::string& branch_name);
 
+// Push to several remotes concurrently (results keep remote_names order)
+bool push_remotes(const std::string& working_path, const std::vector<std::string>& remote_names, const std::string& branch_name, const uint32_t jobs, std::vector<ProcessResult>& results);
+
 // Git Status
 std::string* get_status(const std::string& working_path);
 
@@ -100,8 +150,8 @@ std::string* get_diff_head_remote(const std::string& working_path, const std::st
 // Git Diff cached
 std::string* get_diff_cached(const std::string& working_path);
 
-// Git Diff cached file names
-std::string* get_diff_cached_names(const std::string& working_path);
+// Git Diff cached file names, at most max_bytes of them
+std::string* get_diff_cached_names(const std::string& working_path, const size_t max_bytes);
 
 // Git Diff Uncached
 std::string* get_diff_uncached(const std::string& working_path);
@@ -109,27 +159,39 @@ std::string* get_diff_uncached(const std::string& working_path);
 // Git log diff between local and remote
 std::string* get_log_diff(const std::string& working_path, const std::string& branch_a, const std::string& branch_b);
 
+struct AheadBehind {
+  // Ref compared against the base
+  std::string ref;
+
+  // Commits only on the ref (to merge), and only on the base (to push)
+  uint32_t incoming;
+  uint32_t outgoing;
+
+  // Counts could be computed
+  bool valid;
+};
+
+// Ahead/behind counts of several refs against a base, in one go
+bool get_ahead_behind(const std::string& working_path, const std::string& git_version, const std::string& base, const std::vector<std::string>& refs, const uint32_t jobs, std::vector<AheadBehind>& counts);
+
 // Automatic Commit Message after committing sync merging
 std::string commit_sync_message();
 
+// Automatic Commit Message for submodules that moved
+std::string commit_submodule_message(const std::vector<std::string>& paths);
+
 // Auto Commit Message
 std::string commit_local_message(const std::string& working_path);
 
 // Custom commit message
 std::string commit_custom_message();
 
-// Clean commit message
-bool clean_commit_message(std::string& message);
-
 // Stash work
 bool stash(const std::string& working_path, const bool& keep_index);
 
 // Pop stashed work
 bool pop_stash(const std::string& working_path, const bool& keep_index);
 
-// Check for untracked changes
-bool check_untracked(const std::string& working_path);
-
 // Check MERGE_HEAD file
 bool check_merge_head_file(const std::string& working_path);
 
@@ -139,4 +201,328 @@ bool check_merge_msg_file(const std::string& working_path);
 // Check MERGE_MODE file
 bool check_merge_mode_file(const std::string& working_path);
 
+struct Ref {
+  /*
+    A single ref as stored by git,
+    either pointing at an object id
+    or symbolic (ref: target).
+  */
+
+  // Full ref name, e.g. refs/heads/main
+  std::string name;
+
+  // Object id (empty for symbolic refs)
+  std::string oid;
+
+  // Symbolic ref target (empty otherwise)
+  std::string symref;
+};
+
+struct PackedRefs {
+  /*
+    Read-only view of an mmap'd
+    packed-refs file.
+  */
+
+  const char* data;
+  size_t length;
+
+  // Offset of the first record (past the header)
+  size_t body;
+
+  // Records are sorted by name (binary searchable)
+  bool sorted;
+
+  PackedRefs();
+  ~PackedRefs();
+
+  // Map packed-refs into memory
+  bool open(const std::string& common_dir);
+
+  // Collect packed refs whose name starts with prefix
+  void collect(const std::string& prefix, std::map<std::string, Ref>& refs) const;
+
+  // Record navigation
+  const char* record_start(const char* position) const;
+  const char* parse_record(const char* position, Ref& ref) const;
+  const char* lower_bound(const std::string& prefix) const;
+};
+
+// Read HEAD of a working tree
+bool read_head(const std::string& git_dir, Ref& ref);
+
+// Read all refs below a prefix such as refs/heads/, sorted by name
+bool read_refs(const std::string& common_dir, const std::string& prefix, std::vector<Ref>& refs);
+
+struct ConfigEntry {
+  // Normalized key, section.subsection.name
+  std::string key;
+
+  // Value (empty if has_value is false)
+  std::string value;
+
+  // False for bare boolean keys
+  bool has_value;
+};
+
+struct RemoteLinks {
+  // Remote name
+  std::string name;
+
+  // Remote url/ssh links, after url rewriting
+  std::vector<std::string> fetch_links;
+  std::vector<std::string> push_links;
+};
+
+struct GitConfig {
+  /*
+    In-process reader for git's
+    configuration files, so remotes
+    and their links can be read
+    without asking git for them one
+    at a time.
+  */
+
+  // Every entry of every file, in the order git reads them
+  std::vector<ConfigEntry> entries;
+
+  // Every file read or looked for (missing ones included)
+  std::vector<std::string> files;
+
+  // Context for includeIf conditions
+  std::string git_dir;
+  std::string branch;
+
+  GitConfig();
+
+  // Load system, global, local and worktree configuration
+  bool load(const std::string& git_dir, const std::string& common_dir);
+
+  // Read and parse a single file (and everything it includes)
+  bool read(const std::string& path, const uint32_t depth);
+  bool parse(const std::string& content, const std::string& path, const uint32_t depth);
+  bool include_condition(const std::string& condition, const std::string& path) const;
+
+  // Lookups
+  std::vector<std::string> get_all(const std::string& key) const;
+  bool get(const std::string& key, std::string& value) const;
+
+  // Apply url.<base>.insteadOf (or pushInsteadOf) rewriting
+  std::string rewrite_url(const std::string& url, const bool push) const;
+
+  // Build every remote with its fetch and push urls in one pass
+  std::vector<RemoteLinks> get_remotes() const;
+};
+
+// Parse a boolean config value
+bool config_bool(const std::string& value, const bool has_value);
+
+// Get every configured remote with its links
+bool get_remote_configs(const std::string& working_path, std::vector<RemoteLinks>& remotes);
+
+struct ObjectInfo {
+  /*
+    Type and size of an object as
+    reported by git cat-file.
+  */
+
+  // Requested name (revision, ref or oid)
+  std::string name;
+
+  // Resolved object id
+  std::string oid;
+
+  // blob, tree, commit or tag
+  std::string type;
+
+  // Size in bytes
+  uint64_t size;
+
+  // False if the name did not resolve
+  bool exists;
+};
+
+struct CatFileChannel {
+  // Coprocess id and pipes
+  pid_t pid;
+  int stdin_fd;
+  int stdout_fd;
+
+  // Unconsumed output
+  std::string buffer;
+};
+
+struct CatFile {
+  /*
+    A long-lived git cat-file coprocess,
+    so object and ref lookups cost a
+    pipe round-trip instead of spawning
+    git every time. It is started on
+    first use.
+  */
+
+  // Repository the coprocess runs in
+  std::string working_path;
+
+  // git cat-file --batch-command is available
+  bool batch_command;
+
+  // 0: info (or batch-command), 1: contents (legacy --batch)
+  CatFileChannel channels[2];
+
+  CatFile();
+  ~CatFile();
+
+  // Point the coprocess at a repository
+  void set_repository(const std::string& working_path, const std::string& git_version);
+
+  // Start or stop the coprocesses
+  bool start(const uint32_t channel);
+  void stop();
+
+  // Look up the type and size of many objects at once
+  bool info(const std::vector<std::string>& names, std::vector<ObjectInfo>& infos);
+
+  // Read the contents of a single object
+  bool contents(const std::string& name, ObjectInfo& info, std::string& content);
+
+  // Resolve a revision to an object id (empty if it does not exist)
+  std::string resolve(const std::string& name);
+
+  // Channel I/O
+  bool write_request(const uint32_t channel, const std::string& request);
+  bool fill(const uint32_t channel, const size_t length);
+  bool read_line(const uint32_t channel, std::string& line);
+};
+
+
+struct RepoState {
+  // # branch.oid, "(initial)" before the first commit
+  std::string oid;
+
+  // # branch.head, "(detached)" when HEAD is detached
+  std::string head;
+
+  // # branch.upstream and # branch.ab, if there is an upstream
+  std::string upstream;
+  bool has_upstream;
+  uint32_t ahead;
+  uint32_t behind;
+
+  // Paths changed in the index, in the working tree, untracked and unmerged
+  std::vector<std::string> staged;
+  std::vector<std::string> unstaged;
+  std::vector<std::string> untracked;
+  std::vector<std::string> conflicted;
+
+  // Original paths of renamed or copied entries
+  std::vector<std::string> renamed_from;
+
+  // A merge is waiting to be committed (MERGE_HEAD, MERGE_MSG or MERGE_MODE)
+  bool merging;
+
+  RepoState();
+
+  // Fill from a single git status --porcelain=v2 -z --branch
+  bool load(const std::string& working_path, const std::string& git_dir);
+
+  // Same, looking only at paths (no branch headers), every other path must be clean
+  bool load(const std::string& working_path, const std::string& git_dir, const std::vector<std::string>& paths);
+
+  // Answer the same questions from the index without git, false if unsure
+  bool load_native(const std::string& working_path, const std::string& git_dir, const std::string& common_dir, const std::string& head_tree, const bool check_untracked);
+  bool parse(const char* data, const size_t length);
+
+  // Tracked files differ from HEAD (staged, unstaged or conflicted)
+  bool dirty() const;
+
+  // Every path reported, in any of the lists
+  std::vector<std::string> paths() const;
+};
+
+struct DirtyPaths {
+  /*
+    A superset of the paths that differ
+    from HEAD or are untracked, kept by
+    whoever watches the working tree. It
+    only holds for the index and HEAD it
+    was computed against, anything that
+    rewrites either can dirty a path
+    without touching the working tree.
+  */
+
+  std::vector<std::string> paths;
+
+  // Index stat data and HEAD commit at the time paths was computed
+  std::string key;
+  bool known;
+
+  DirtyPaths();
+
+  void record(const std::string& git_dir, const std::string& common_dir);
+  bool current(const std::string& git_dir, const std::string& common_dir) const;
+};
+
+
+struct IndexEntry {
+  std::string path;
+
+  // Stat data cached by git, as stored (32 bits each)
+  uint32_t ctime_sec;
+  uint32_t ctime_nsec;
+  uint32_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t ino;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t size;
+
+  // Stage and name length, and v3+ extended flags (skip-worktree, intent-to-add)
+  uint16_t flags;
+  uint16_t extended_flags;
+
+  // Recorded commit, gitlinks only
+  std::string oid;
+};
+
+struct GitIndex {
+  // Entries sorted by path, then stage
+  std::vector<IndexEntry> entries;
+  uint32_t version;
+
+  // Root of the cache-tree extension, empty if missing or invalidated
+  std::string tree_oid;
+
+  // Modification time of the index file, entries as new as it are racy
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+
+  // Split index (link) and untracked cache (UNTR) extensions are present
+  bool split;
+  bool untracked_cache;
+
+  GitIndex();
+
+  // Map and parse <git_dir>/index (versions 2 to 4)
+  bool load(const std::string& git_dir, const uint32_t hash_size);
+
+  // Lookups
+  std::vector<IndexEntry>::const_iterator lower_bound(const std::string& path) const;
+  bool tracked(const std::string& path) const;
+  bool tracked_dir(const std::string& directory) const;
+};
+
+struct Submodule {
+  // Name in .gitmodules, and path relative to the superproject
+  std::string name;
+  std::string path;
+
+  // Commit the superproject's index records for it
+  std::string gitlink;
+};
+
+// Checked out submodules of a working tree, from its index and .gitmodules
+bool get_submodules(const std::string& toplevel_path, std::vector<Submodule>& submodules);
+
 #endif
@@ -0,0 +1,626 @@
+#include "git.h"
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Read a big endian u32 from the index
+static uint32_t index_u32 (const unsigned char* data) {
+  return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+}
+
+// Read a big endian u16 from the index
+static uint16_t index_u16 (const unsigned char* data) {
+  return (uint16_t(data[0]) << 8) | uint16_t(data[1]);
+}
+
+// Hex encode an object id
+static std::string index_hex (const unsigned char* data, const uint32_t length) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (uint32_t byte = 0; byte < length; byte++) {
+    hex += digits[data[byte] >> 4];
+    hex += digits[data[byte] & 15];
+  } return hex;
+}
+
+GitIndex::GitIndex () {
+  this->version = 0;
+  this->mtime_sec = 0;
+  this->mtime_nsec = 0;
+  this->split = false;
+  this->untracked_cache = false;
+}
+
+// Map and parse <git_dir>/index
+bool GitIndex::load (const std::string& git_dir, const uint32_t hash_size) {
+  /*
+    The index is a header,
+    "DIRC", version, entry count
+    followed by the entries, sorted by
+    path then stage, and extensions.
+
+    Each entry holds the stat data git
+    saw when it last looked at the file,
+    ctime, mtime, dev, ino, mode, uid,
+    gid, size, then the object id, flags
+    (stage and path length), extended
+    flags on v3+, and the path. v2/v3
+    paths are NUL padded to a multiple of
+    8 bytes, v4 paths instead strip a
+    varint number of bytes off the end of
+    the previous path and append the rest.
+
+    Only the cache-tree (TREE) root is
+    read from the extensions. A split
+    index (link) keeps most entries in
+    another file, and is reported rather
+    than followed.
+  */
+
+  std::string path = git_dir + "/index";
+  int file_descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(file_descriptor, &st) != 0 || st.st_size < static_cast<off_t>(12 + hash_size)) {
+    close(file_descriptor);
+    return false;
+  }
+
+  void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+  close(file_descriptor);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  this->mtime_sec = st.st_mtim.tv_sec;
+  this->mtime_nsec = st.st_mtim.tv_nsec;
+
+  const unsigned char* data = static_cast<const unsigned char*>(mapped);
+  const unsigned char* end = data + st.st_size - hash_size;
+  bool valid = memcmp(data, "DIRC", 4) == 0;
+  this->version = index_u32(data + 4);
+  valid = valid && this->version >= 2 && this->version <= 4;
+  uint32_t count = index_u32(data + 8);
+
+  const size_t stat_size = 40;
+  const unsigned char* position = data + 12;
+  std::string previous_path;
+  this->entries.clear();
+  if (valid) this->entries.reserve(count);
+
+  for (uint32_t entry = 0; valid && entry < count; entry++) {
+    if (static_cast<size_t>(end - position) < stat_size + hash_size + 2) {
+      valid = false;
+      break;
+    }
+
+    IndexEntry index_entry;
+    index_entry.ctime_sec = index_u32(position);
+    index_entry.ctime_nsec = index_u32(position + 4);
+    index_entry.mtime_sec = index_u32(position + 8);
+    index_entry.mtime_nsec = index_u32(position + 12);
+    index_entry.ino = index_u32(position + 20);
+    index_entry.mode = index_u32(position + 24);
+    index_entry.uid = index_u32(position + 28);
+    index_entry.gid = index_u32(position + 32);
+    index_entry.size = index_u32(position + 36);
+    index_entry.flags = index_u16(position + stat_size + hash_size);
+    index_entry.extended_flags = 0;
+
+    // Gitlinks are compared by object id, not by stat data
+    if ((index_entry.mode & 0170000) == 0160000)
+      index_entry.oid = index_hex(position + stat_size, hash_size);
+
+    const unsigned char* name = position + stat_size + hash_size + 2;
+    if (this->version >= 3 && (index_entry.flags & 0x4000)) {
+      if (end - name < 2) {
+        valid = false;
+        break;
+      }
+      index_entry.extended_flags = index_u16(name);
+      name += 2;
+    }
+
+    if (this->version == 4) {
+      // Varint of bytes to strip from the previous path
+      size_t strip = 0;
+      if (name >= end) { valid = false; break; }
+      unsigned char byte = *name++;
+      strip = byte & 127;
+      while (byte & 128) {
+        if (name >= end) { valid = false; break; }
+        byte = *name++;
+        strip = ((strip + 1) << 7) | (byte & 127);
+      }
+
+      const unsigned char* name_end = static_cast<const unsigned char*>(memchr(name, '\0', end - name));
+      if (!valid || name_end == NULL || strip > previous_path.size()) {
+        valid = false;
+        break;
+      }
+
+      index_entry.path = previous_path.substr(0, previous_path.size() - strip);
+      index_entry.path.append(reinterpret_cast<const char*>(name), name_end - name);
+      position = name_end + 1;
+    } else {
+      const unsigned char* name_end = static_cast<const unsigned char*>(memchr(name, '\0', end - name));
+      if (name_end == NULL) {
+        valid = false;
+        break;
+      }
+
+      index_entry.path.assign(reinterpret_cast<const char*>(name), name_end - name);
+
+      // Entries are padded with 1 to 8 NULs to a multiple of 8 bytes
+      size_t length = (name_end - position + 8) & ~size_t(7);
+      if (static_cast<size_t>(end - position) < length) {
+        valid = false;
+        break;
+      } position += length;
+    }
+
+    previous_path = index_entry.path;
+    this->entries.push_back(index_entry);
+  }
+
+  // Extensions
+  this->tree_oid.clear();
+  while (valid && end - position >= 8) {
+    const unsigned char* extension = position;
+    uint32_t size = index_u32(position + 4);
+    position += 8;
+    if (static_cast<size_t>(end - position) < size)
+      break;
+
+    if (memcmp(extension, "TREE", 4) == 0) {
+      // Root: "" NUL entry_count SP subtrees LF oid, entry_count is -1 when invalidated
+      const unsigned char* line_end = static_cast<const unsigned char*>(memchr(position, '\n', size));
+      if (size > 0 && *position == '\0' && line_end != NULL && position[1] != '-' &&
+      static_cast<size_t>(position + size - (line_end + 1)) >= hash_size)
+        this->tree_oid = index_hex(line_end + 1, hash_size);
+    } else if (memcmp(extension, "link", 4) == 0)
+      this->split = true;
+    else if (memcmp(extension, "UNTR", 4) == 0)
+      this->untracked_cache = true;
+
+    position += size;
+  }
+
+  munmap(mapped, st.st_size);
+  if (!valid)
+    this->entries.clear();
+  return valid;
+}
+
+// First entry not ordered before path
+std::vector<IndexEntry>::const_iterator GitIndex::lower_bound (const std::string& path) const {
+  return std::lower_bound(this->entries.begin(), this->entries.end(), path,
+    [](const IndexEntry& entry, const std::string& value) { return entry.path < value; });
+}
+
+// Path is in the index
+bool GitIndex::tracked (const std::string& path) const {
+  std::vector<IndexEntry>::const_iterator it = this->lower_bound(path);
+  return it != this->entries.end() && it->path == path;
+}
+
+// Some path in the index lives below directory (which ends in '/')
+bool GitIndex::tracked_dir (const std::string& directory) const {
+  std::vector<IndexEntry>::const_iterator it = this->lower_bound(directory);
+  return it != this->entries.end() && it->path.compare(0, directory.size(), directory) == 0;
+}
+
+struct IgnorePattern {
+  // Pattern split on '/', and the directory of the file it came from ("" or "dir/")
+  std::vector<std::string> segments;
+  std::string base;
+
+  bool negated;
+  bool dir_only;
+  bool anchored;
+};
+
+struct IgnoreFrame {
+  // Patterns of one source, later ones win, then the parent frame
+  std::vector<IgnorePattern> patterns;
+  std::shared_ptr<const IgnoreFrame> parent;
+};
+
+// Parse gitignore syntax into a frame
+static void parse_ignore_file (const std::string& content, const std::string& base, IgnoreFrame& frame) {
+  for (std::string line : get_lines_from_string(content)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    // Trailing spaces are dropped unless escaped
+    while (!line.empty() && line.back() == ' ' && (line.size() < 2 || line[line.size() - 2] != '\\'))
+      line.pop_back();
+
+    IgnorePattern pattern;
+    pattern.base = base;
+    pattern.negated = line[0] == '!';
+    if (pattern.negated)
+      line.erase(0, 1);
+    else if (line[0] == '\\')
+      line.erase(0, 1);
+
+    pattern.dir_only = !line.empty() && line.back() == '/';
+    if (pattern.dir_only)
+      line.pop_back();
+    if (line.empty())
+      continue;
+
+    pattern.anchored = line.find('/') != std::string::npos;
+    if (line[0] == '/')
+      line.erase(0, 1);
+
+    std::stringstream ss(line);
+    std::string segment;
+    while (std::getline(ss, segment, '/'))
+      pattern.segments.push_back(segment);
+    frame.patterns.push_back(pattern);
+  }
+}
+
+// Match path segments against pattern segments, "**" spanning any number of them
+static bool match_segments (const std::vector<std::string>& pattern, size_t p, const std::vector<std::string>& path, size_t s) {
+  for (; p < pattern.size(); p++, s++) {
+    if (pattern[p] == "**") {
+      for (size_t skip = s; skip <= path.size(); skip++) {
+        if (match_segments(pattern, p + 1, path, skip))
+          return true;
+      } return false;
+    }
+
+    if (s >= path.size() || fnmatch(pattern[p].c_str(), path[s].c_str(), 0) != 0)
+      return false;
+  } return s == path.size();
+}
+
+// Whether the last matching pattern, deepest frame first, ignores the path
+static bool is_ignored (const IgnoreFrame* frame, const std::string& path, const std::string& name, const bool is_dir) {
+  // Path split on '/' below the base of the last anchored pattern tried
+  std::vector<std::string> segments;
+  std::string segments_base;
+  bool split = false;
+
+  for (; frame != NULL; frame = frame->parent.get()) {
+    for (std::vector<IgnorePattern>::const_reverse_iterator it = frame->patterns.rbegin(); it != frame->patterns.rend(); it++) {
+      if (it->dir_only && !is_dir)
+        continue;
+
+      bool matched;
+      if (!it->anchored)
+        matched = fnmatch(it->segments.front().c_str(), name.c_str(), 0) == 0;
+      else {
+        if (path.compare(0, it->base.size(), it->base) != 0)
+          continue;
+
+        if (!split || segments_base != it->base) {
+          segments.clear();
+          std::stringstream ss(path.substr(it->base.size()));
+          std::string segment;
+          while (std::getline(ss, segment, '/'))
+            segments.push_back(segment);
+          segments_base = it->base;
+          split = true;
+        }
+        matched = match_segments(it->segments, 0, segments, 0);
+      }
+
+      if (matched)
+        return !it->negated;
+    }
+  } return false;
+}
+
+// Compare an entry's cached stat data with the file, true if git would not need to look closer
+static bool entry_up_to_date (const GitIndex& index, const IndexEntry& entry, const std::string& toplevel_path, const bool filemode) {
+  /*
+    Mirrors git's own stat comparison,
+    mtime, ctime, ino, uid, gid and the
+    size truncated to 32 bits, plus the
+    file type and executable bit. An
+    entry modified in the same instant
+    the index was written is racy, only
+    its content could tell, so it is not
+    considered up to date either.
+  */
+
+  if ((entry.mode & 0170000) == 0160000) {
+    // A submodule is clean when its HEAD is the recorded commit
+    std::string git_dir;
+    std::string common_dir;
+    Ref head;
+    if (!get_git_dirs(toplevel_path + '/' + entry.path, git_dir, common_dir))
+      return true;
+    return read_head(git_dir, head) && head.symref.empty() && head.oid == entry.oid;
+  }
+
+  struct stat st;
+  if (lstat((toplevel_path + '/' + entry.path).c_str(), &st) != 0)
+    return false;
+
+  uint32_t type = entry.mode & 0170000;
+  if ((type == 0100000 && !S_ISREG(st.st_mode)) || (type == 0120000 && !S_ISLNK(st.st_mode)))
+    return false;
+  if (type == 0100000 && filemode && ((entry.mode & 0100) != 0) != ((st.st_mode & S_IXUSR) != 0))
+    return false;
+
+  if (entry.mtime_sec != uint32_t(st.st_mtim.tv_sec) || entry.mtime_nsec != uint32_t(st.st_mtim.tv_nsec) ||
+  entry.ctime_sec != uint32_t(st.st_ctim.tv_sec) || entry.ctime_nsec != uint32_t(st.st_ctim.tv_nsec) ||
+  entry.ino != uint32_t(st.st_ino) || entry.uid != uint32_t(st.st_uid) || entry.gid != uint32_t(st.st_gid) ||
+  entry.size != uint32_t(st.st_size))
+    return false;
+
+  return index.mtime_sec > int64_t(entry.mtime_sec) ||
+    (index.mtime_sec == int64_t(entry.mtime_sec) && index.mtime_nsec > int64_t(entry.mtime_nsec));
+}
+
+// Check every tracked entry on several threads, stopping at the first one that is not up to date
+static bool tracked_up_to_date (const GitIndex& index, const std::string& toplevel_path, const bool filemode, const uint32_t threads) {
+  const size_t chunk_size = 512;
+  std::atomic<size_t> next(0);
+  std::atomic<bool> up_to_date(true);
+
+  std::function<void()> sweep = [&]() {
+    while (up_to_date.load(std::memory_order_relaxed)) {
+      size_t begin = next.fetch_add(chunk_size);
+      if (begin >= index.entries.size())
+        return;
+
+      size_t end = std::min(begin + chunk_size, index.entries.size());
+      for (size_t entry = begin; entry < end; entry++) {
+        // Entries outside a sparse checkout are not in the working tree
+        if (index.entries[entry].extended_flags & 0x4000)
+          continue;
+        if (!entry_up_to_date(index, index.entries[entry], toplevel_path, filemode)) {
+          up_to_date = false;
+          return;
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t worker = 1; worker < threads; worker++)
+    workers.emplace_back(sweep);
+  sweep();
+  for (auto& worker : workers)
+    worker.join();
+
+  return up_to_date;
+}
+
+struct UntrackedWalk {
+  // Directories left to read, relative to the toplevel ("" or "dir/")
+  std::deque<std::pair<std::string, std::shared_ptr<const IgnoreFrame>>> work;
+  uint32_t busy;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+
+  // First untracked path found, or a failure that makes the walk inconclusive
+  std::atomic<bool> stop;
+  std::string found;
+  bool failed;
+};
+
+// Read one directory of the untracked walk
+static void walk_directory (const GitIndex& index, const std::string& toplevel_path, UntrackedWalk& walk, const std::string& directory, std::shared_ptr<const IgnoreFrame> frame) {
+  std::string path = toplevel_path + '/' + directory;
+
+  // The directory's own .gitignore applies to everything below it
+  std::string content;
+  if (read_file(path + ".gitignore", content)) {
+    std::shared_ptr<IgnoreFrame> child = std::make_shared<IgnoreFrame>();
+    parse_ignore_file(content, directory, *child);
+    child->parent = frame;
+    frame = child;
+  }
+
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    std::lock_guard<std::mutex> lock(walk.mutex);
+    walk.failed = true;
+    walk.stop = true;
+    return;
+  }
+
+  struct dirent* entry;
+  while (!walk.stop && (entry = readdir(dir)) != NULL) {
+    std::string name = entry->d_name;
+    if (name == "." || name == ".." || name == ".git")
+      continue;
+
+    std::string child = directory + name;
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat((toplevel_path + '/' + child).c_str(), &st) != 0)
+        continue;
+      is_dir = S_ISDIR(st.st_mode);
+    }
+
+    // Submodules and tracked files
+    if (index.tracked(child))
+      continue;
+
+    if (is_ignored(frame.get(), child, name, is_dir))
+      continue;
+
+    if (is_dir) {
+      // Another repository that is not a submodule shows up as untracked
+      struct stat st;
+      if (!index.tracked_dir(child + '/') && lstat((toplevel_path + '/' + child + "/.git").c_str(), &st) == 0) {
+        std::lock_guard<std::mutex> lock(walk.mutex);
+        walk.found = child + '/';
+        walk.stop = true;
+        break;
+      }
+
+      std::lock_guard<std::mutex> lock(walk.mutex);
+      walk.work.push_back(std::make_pair(child + '/', frame));
+      walk.changed.notify_one();
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(walk.mutex);
+    walk.found = child;
+    walk.stop = true;
+    break;
+  } closedir(dir);
+}
+
+// Find the first untracked, not ignored path on several threads
+static bool find_untracked (const GitIndex& index, const std::string& toplevel_path, std::shared_ptr<const IgnoreFrame> root, const uint32_t threads, std::string& found) {
+  /*
+    Directories are handed out from a
+    shared queue, each worker reads one,
+    queues the directories below it and
+    stops everyone as soon as it sees a
+    path that is neither tracked nor
+    ignored. Returns false if the walk
+    could not finish.
+  */
+
+  UntrackedWalk walk;
+  walk.busy = 0;
+  walk.stop = false;
+  walk.failed = false;
+  walk.work.push_back(std::make_pair(std::string(), root));
+
+  std::function<void()> worker = [&]() {
+    std::unique_lock<std::mutex> lock(walk.mutex);
+    while (true) {
+      walk.changed.wait(lock, [&]() { return walk.stop || !walk.work.empty() || walk.busy == 0; });
+      if (walk.stop || walk.work.empty())
+        break;
+
+      std::pair<std::string, std::shared_ptr<const IgnoreFrame>> directory = walk.work.front();
+      walk.work.pop_front();
+      walk.busy++;
+      lock.unlock();
+
+      walk_directory(index, toplevel_path, walk, directory.first, directory.second);
+
+      lock.lock();
+      walk.busy--;
+      if (walk.busy == 0 || walk.stop)
+        walk.changed.notify_all();
+    }
+    walk.changed.notify_all();
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t thread = 1; thread < threads; thread++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& thread : workers)
+    thread.join();
+
+  found = walk.found;
+  return !walk.failed;
+}
+
+// Answer "anything staged, unstaged or untracked?" without running git status
+bool RepoState::load_native (const std::string& working_path, const std::string& git_dir, const std::string& common_dir, const std::string& head_tree, const bool check_untracked) {
+  /*
+    Only a certain answer is returned,
+    false means git has to be asked.
+
+    Nothing is staged when the index's
+    cache-tree is valid and matches the
+    tree of HEAD. Nothing is unstaged
+    when every entry's cached stat data
+    still matches its file, checked on
+    all cores with an early exit. Any
+    mismatch may or may not be a real
+    change (filters, touched files), so
+    that is left to git. Untracked files
+    are found with a parallel walk using
+    the repository's ignore rules, and a
+    hit is confirmed with git check-ignore.
+
+    On success staged and unstaged are
+    empty and untracked holds at most the
+    first untracked path found.
+  */
+
+  *this = RepoState();
+  this->merging = file_exists(git_dir + "/MERGE_HEAD") ||
+    file_exists(git_dir + "/MERGE_MSG") ||
+    file_exists(git_dir + "/MERGE_MODE");
+  if (this->merging || head_tree.empty())
+    return false;
+
+  GitConfig config;
+  if (!config.load(git_dir, common_dir))
+    return false;
+
+  std::string value;
+  uint32_t hash_size = config.get("extensions.objectformat", value) && value == "sha256" ? 32 : 20;
+  bool filemode = !config.get("core.filemode", value) || config_bool(value, true);
+
+  GitIndex index;
+  if (!index.load(git_dir, hash_size) || index.split || index.tree_oid != head_tree)
+    return false;
+
+  // Unmerged and intent-to-add entries are never clean
+  for (const auto& entry : index.entries) {
+    if ((entry.flags & 0x3000) != 0 || (entry.extended_flags & 0x2000) != 0)
+      return false;
+  }
+
+  uint32_t threads = std::max(1u, std::min(16u, std::thread::hardware_concurrency()));
+  if (!tracked_up_to_date(index, working_path, filemode, threads))
+    return false;
+
+  if (!check_untracked)
+    return true;
+
+  // core.excludesFile, then info/exclude, then every .gitignore on the way down
+  std::shared_ptr<IgnoreFrame> excludes = std::make_shared<IgnoreFrame>();
+  std::string excludes_file;
+  if (!config.get("core.excludesfile", excludes_file)) {
+    const char* xdg = getenv("XDG_CONFIG_HOME");
+    const char* home = getenv("HOME");
+    if (xdg != NULL && *xdg != '\0') excludes_file = std::string(xdg) + "/git/ignore";
+    else if (home != NULL) excludes_file = std::string(home) + "/.config/git/ignore";
+  } else if (excludes_file.compare(0, 2, "~/") == 0 && getenv("HOME") != NULL)
+    excludes_file = std::string(getenv("HOME")) + excludes_file.substr(1);
+
+  std::string content;
+  if (!excludes_file.empty() && read_file(excludes_file, content))
+    parse_ignore_file(content, "", *excludes);
+
+  std::shared_ptr<IgnoreFrame> info_exclude = std::make_shared<IgnoreFrame>();
+  if (read_file(common_dir + "/info/exclude", content))
+    parse_ignore_file(content, "", *info_exclude);
+  info_exclude->parent = excludes;
+
+  std::string found;
+  if (!find_untracked(index, working_path, info_exclude, threads, found))
+    return false;
+
+  if (!found.empty()) {
+    // Our ignore rules are a subset of git's, let git have the last word
+    ProcessResult result;
+    run_process({"git", "check-ignore", "-q", "--no-index", found}, working_path, result);
+    if (result.exit_status != 1)
+      return false;
+    this->untracked.push_back(found);
+  }
+
+  return true;
+}
@@ -0,0 +1,229 @@
+#include "git.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Parse the contents of a loose ref file
+static bool parse_loose_ref (const std::string& name, const std::string& content, Ref& ref) {
+  ref.name = name;
+  ref.oid.clear();
+  ref.symref.clear();
+
+  std::string line = content.substr(0, content.find('\n'));
+  if (line.compare(0, 5, "ref: ") == 0) {
+    ref.symref = line.substr(5);
+    return !ref.symref.empty();
+  }
+
+  if (line.length() != 40 && line.length() != 64)
+    return false;
+
+  ref.oid = line;
+  return true;
+}
+
+// Read HEAD of a working tree
+bool read_head (const std::string& git_dir, Ref& ref) {
+  std::string content;
+  if (!read_file(git_dir + "/HEAD", content))
+    return false;
+  return parse_loose_ref("HEAD", content, ref);
+}
+
+// Recursively collect loose refs below a directory
+static void read_loose_refs (const std::string& common_dir, const std::string& name, std::map<std::string, Ref>& refs) {
+  DIR* dir = opendir((common_dir + '/' + name).c_str());
+  if (dir == NULL)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    std::string child = name + entry->d_name;
+    std::string path = common_dir + '/' + child;
+
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0)
+        continue;
+      is_dir = S_ISDIR(st.st_mode);
+    }
+
+    if (is_dir) {
+      read_loose_refs(common_dir, child + '/', refs);
+      continue;
+    }
+
+    // Skip lock files of concurrent git processes
+    if (child.length() > 5 && child.compare(child.length() - 5, 5, ".lock") == 0)
+      continue;
+
+    std::string content;
+    Ref ref;
+    if (read_file(path, content) && parse_loose_ref(child, content, ref))
+      refs[child] = ref;
+  } closedir(dir);
+}
+
+PackedRefs::PackedRefs () {
+  this->data = NULL;
+  this->length = 0;
+  this->sorted = false;
+}
+
+PackedRefs::~PackedRefs () {
+  if (this->data != NULL)
+    munmap(const_cast<char*>(this->data), this->length);
+}
+
+// Map packed-refs into memory
+bool PackedRefs::open (const std::string& common_dir) {
+  /*
+    A missing or empty packed-refs file
+    is not an error, there is simply
+    nothing packed.
+  */
+
+  int file_descriptor = ::open((common_dir + "/packed-refs").c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1)
+    return errno == ENOENT;
+
+  struct stat st;
+  if (fstat(file_descriptor, &st) != 0) {
+    close(file_descriptor);
+    return false;
+  }
+
+  if (st.st_size == 0) {
+    close(file_descriptor);
+    return true;
+  }
+
+  void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+  close(file_descriptor);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  this->data = static_cast<const char*>(mapped);
+  this->length = st.st_size;
+
+  // "# pack-refs with: peeled fully-peeled sorted"
+  const char* body = this->data;
+  const char* end = this->data + this->length;
+  if (*body == '#') {
+    const char* header_end = static_cast<const char*>(memchr(body, '\n', end - body));
+    if (header_end == NULL) header_end = end;
+    std::string header(body, header_end);
+    this->sorted = header.find(" sorted") != std::string::npos;
+    body = header_end == end ? end : header_end + 1;
+  }
+
+  this->body = body - this->data;
+  return true;
+}
+
+// Find the start of the record line containing position
+const char* PackedRefs::record_start (const char* position) const {
+  const char* begin = this->data + this->body;
+  while (position > begin && *(position - 1) != '\n')
+    position--;
+
+  // Peeled lines belong to the record above them
+  while (*position == '^' && position > begin) {
+    position--;
+    while (position > begin && *(position - 1) != '\n')
+      position--;
+  } return position;
+}
+
+// Parse a record line, returning a pointer past it (and its peeled line)
+const char* PackedRefs::parse_record (const char* position, Ref& ref) const {
+  const char* end = this->data + this->length;
+  const char* line_end = static_cast<const char*>(memchr(position, '\n', end - position));
+  if (line_end == NULL) line_end = end;
+
+  const char* space = static_cast<const char*>(memchr(position, ' ', line_end - position));
+  ref.symref.clear();
+  if (space == NULL || *position == '^') {
+    ref.name.clear();
+    ref.oid.clear();
+  } else {
+    ref.oid.assign(position, space);
+    ref.name.assign(space + 1, line_end);
+  }
+
+  position = line_end == end ? end : line_end + 1;
+  while (position < end && *position == '^') {
+    line_end = static_cast<const char*>(memchr(position, '\n', end - position));
+    position = line_end == NULL ? end : line_end + 1;
+  } return position;
+}
+
+// Find the first record not ordered before prefix
+const char* PackedRefs::lower_bound (const std::string& prefix) const {
+  /*
+    packed-refs written by git is sorted
+    by refname, so the records can be
+    binary searched directly in the map,
+    without parsing the whole file.
+  */
+
+  const char* low = this->data + this->body;
+  const char* high = this->data + this->length;
+  if (!this->sorted)
+    return low;
+
+  while (low < high) {
+    const char* middle = this->record_start(low + (high - low) / 2);
+    Ref ref;
+    const char* next = this->parse_record(middle, ref);
+    if (ref.name < prefix)
+      low = next;
+    else if (middle == low)
+      return low;
+    else high = middle;
+  } return low;
+}
+
+// Collect packed refs whose name starts with prefix
+void PackedRefs::collect (const std::string& prefix, std::map<std::string, Ref>& refs) const {
+  if (this->data == NULL)
+    return;
+
+  const char* end = this->data + this->length;
+  const char* position = this->lower_bound(prefix);
+  while (position < end) {
+    Ref ref;
+    position = this->parse_record(position, ref);
+    if (ref.name.compare(0, prefix.length(), prefix) != 0) {
+      if (this->sorted && ref.name > prefix) break;
+      continue;
+    }
+
+    // Loose refs take precedence over packed ones
+    if (refs.find(ref.name) == refs.end())
+      refs[ref.name] = ref;
+  }
+}
+
+// Read all refs below a prefix such as refs/heads/, sorted by name
+bool read_refs (const std::string& common_dir, const std::string& prefix, std::vector<Ref>& refs) {
+  std::map<std::string, Ref> found;
+  read_loose_refs(common_dir, prefix, found);
+
+  PackedRefs packed_refs;
+  if (!packed_refs.open(common_dir)) {
+    std::string err_msg = "read_refs() ==> Could not read packed-refs in: " + common_dir + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  } packed_refs.collect(prefix, found);
+
+  refs.clear();
+  for (const auto& ref : found)
+    refs.push_back(ref.second);
+  return true;
+}
@@ -0,0 +1,202 @@
+#include "git.h"
+
+RepoState::RepoState () {
+  this->has_upstream = false;
+  this->ahead = 0;
+  this->behind = 0;
+  this->merging = false;
+}
+
+// Skip count space separated fields, returning the start of the next one
+static const char* skip_fields (const char* position, const char* end, uint32_t count) {
+  while (count-- > 0 && position != NULL) {
+    position = static_cast<const char*>(memchr(position, ' ', end - position));
+    if (position != NULL) position++;
+  } return position;
+}
+
+// Fill from a single git status --porcelain=v2 -z --branch
+bool RepoState::load (const std::string& working_path, const std::string& git_dir) {
+  *this = RepoState();
+
+  ProcessResult result;
+  if (!run_process({"git", "status", "--porcelain=v2", "-z", "--branch"}, working_path, result)) {
+    std::string err_msg = "RepoState::load() ==> Could not get git status at path: " + working_path + '\n' + result.err;
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  this->merging = file_exists(git_dir + "/MERGE_HEAD") ||
+    file_exists(git_dir + "/MERGE_MSG") ||
+    file_exists(git_dir + "/MERGE_MODE");
+  return this->parse(result.out.data(), result.out.size());
+}
+
+// Fill from git status limited to paths, every other path being known to be clean
+bool RepoState::load (const std::string& working_path, const std::string& git_dir, const std::vector<std::string>& paths) {
+  /*
+    Paths go to git as literal pathspecs,
+    so git only stats and walks those. A
+    very long list is not worth the argv,
+    the whole tree is asked for instead.
+  */
+
+  if (paths.size() > 8192)
+    return this->load(working_path, git_dir);
+
+  *this = RepoState();
+  this->merging = file_exists(git_dir + "/MERGE_HEAD") ||
+    file_exists(git_dir + "/MERGE_MSG") ||
+    file_exists(git_dir + "/MERGE_MODE");
+  if (paths.empty())
+    return true;
+
+  std::vector<std::string> argv = {"git", "--no-optional-locks", "status", "--porcelain=v2", "-z", "--"};
+  for (const auto& path : paths)
+    argv.push_back(":(literal)" + path);
+
+  ProcessResult result;
+  if (!run_process(argv, working_path, result)) {
+    std::string err_msg = "RepoState::load() ==> Could not get git status at path: " + working_path + '\n' + result.err;
+    print_error(err_msg.c_str());
+    return false;
+  } return this->parse(result.out.data(), result.out.size());
+}
+
+// Parse porcelain v2 output in place
+bool RepoState::parse (const char* data, const size_t length) {
+  /*
+    Every record ends in a NUL, and is one of
+    # branch.<header> <value>
+    1 XY sub mH mI mW hH hI path
+    2 XY sub mH mI mW hH hI Xscore path, NUL, origPath
+    u XY sub m1 m2 m3 mW h1 h2 h3 path
+    ? path
+
+    Records are walked directly in the
+    output buffer, only the paths and
+    header values are copied out. In XY,
+    X is the index and Y the working tree,
+    a '.' meaning unchanged.
+  */
+
+  const char* position = data;
+  const char* end = data + length;
+
+  while (position < end) {
+    const char* record_end = static_cast<const char*>(memchr(position, '\0', end - position));
+    if (record_end == NULL) record_end = end;
+    const char* next = record_end == end ? end : record_end + 1;
+
+    if (record_end - position < 2) {
+      position = next;
+      continue;
+    }
+
+    switch (*position) {
+      case '#': {
+        const char* header = position + 2;
+        const char* value = skip_fields(header, record_end, 1);
+        if (value == NULL) break;
+        size_t header_length = value - 1 - header;
+
+        if (header_length == 10 && memcmp(header, "branch.oid", 10) == 0)
+          this->oid.assign(value, record_end);
+        else if (header_length == 11 && memcmp(header, "branch.head", 11) == 0)
+          this->head.assign(value, record_end);
+        else if (header_length == 15 && memcmp(header, "branch.upstream", 15) == 0) {
+          this->upstream.assign(value, record_end);
+          this->has_upstream = true;
+        } else if (header_length == 9 && memcmp(header, "branch.ab", 9) == 0) {
+          // +<ahead> -<behind>
+          this->ahead = std::strtoul(value + 1, NULL, 10);
+          const char* behind = skip_fields(value, record_end, 1);
+          if (behind != NULL) this->behind = std::strtoul(behind + 1, NULL, 10);
+        }
+      } break;
+
+      case '1':
+      case '2': {
+        if (record_end - position < 4) break;
+        const char* path = skip_fields(position, record_end, *position == '1' ? 8 : 9);
+        if (path == NULL) break;
+
+        if (position[2] != '.') this->staged.emplace_back(path, record_end);
+        if (position[3] != '.') this->unstaged.emplace_back(path, record_end);
+
+        // The original path is a record of its own
+        if (*position == '2' && next < end) {
+          const char* original_end = static_cast<const char*>(memchr(next, '\0', end - next));
+          if (original_end == NULL) original_end = end;
+          this->renamed_from.emplace_back(next, original_end);
+          next = original_end == end ? end : original_end + 1;
+        }
+      } break;
+
+      case 'u': {
+        const char* path = skip_fields(position, record_end, 10);
+        if (path != NULL) this->conflicted.emplace_back(path, record_end);
+      } break;
+
+      case '?':
+        this->untracked.emplace_back(position + 2, record_end);
+        break;
+    }
+
+    position = next;
+  }
+
+  return true;
+}
+
+// Tracked files differ from HEAD (staged, unstaged or conflicted)
+bool RepoState::dirty () const {
+  return !this->staged.empty() || !this->unstaged.empty() || !this->conflicted.empty();
+}
+
+// Every path the state reports
+std::vector<std::string> RepoState::paths () const {
+  std::vector<std::string> paths;
+  for (const auto* list : {&this->staged, &this->unstaged, &this->untracked, &this->conflicted, &this->renamed_from})
+    paths.insert(paths.end(), list->begin(), list->end());
+  return paths;
+}
+
+// Key of what dirty paths are computed against, the index file and the commit HEAD is on
+static std::string dirty_paths_key (const std::string& git_dir, const std::string& common_dir) {
+  std::string key;
+  struct stat st;
+  if (stat((git_dir + "/index").c_str(), &st) == 0)
+    key = std::to_string(st.st_ino) + ':' + std::to_string(st.st_size) + ':' +
+      std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec);
+  key += ' ';
+
+  Ref head;
+  if (!read_head(git_dir, head))
+    return "";
+  if (head.symref.empty())
+    return key + head.oid;
+
+  std::vector<Ref> refs;
+  if (!read_refs(common_dir, head.symref, refs))
+    return "";
+  for (const auto& ref : refs) {
+    if (ref.name == head.symref)
+      return key + ref.oid;
+  } return key + "(unborn)";
+}
+
+DirtyPaths::DirtyPaths () {
+  this->known = false;
+}
+
+// Remember what paths was computed against
+void DirtyPaths::record (const std::string& git_dir, const std::string& common_dir) {
+  this->key = dirty_paths_key(git_dir, common_dir);
+  this->known = !this->key.empty();
+}
+
+// Nothing changed the index or moved HEAD since
+bool DirtyPaths::current (const std::string& git_dir, const std::string& common_dir) const {
+  return this->known && dirty_paths_key(git_dir, common_dir) == this->key;
+}
@@ -0,0 +1,100 @@
+#include "git.h"
+
+// Checked out submodules of a working tree, from its index and .gitmodules
+bool get_submodules (const std::string& toplevel_path, std::vector<Submodule>& submodules) {
+  /*
+    A submodule is a gitlink (mode 160000)
+    in the index whose path .gitmodules
+    gives a name to. Only the ones that
+    are checked out, with a .git of their
+    own, can be synced. A gitlink that
+    .gitmodules does not know about is a
+    repository someone added by mistake,
+    and is left alone like git does.
+  */
+
+  submodules.clear();
+
+  std::string git_dir;
+  std::string common_dir;
+  GitConfig config;
+  if (!get_git_dirs(toplevel_path, git_dir, common_dir) || !config.load(git_dir, common_dir))
+    return false;
+
+  std::string value;
+  uint32_t hash_size = config.get("extensions.objectformat", value) && value == "sha256" ? 32 : 20;
+
+  // Submodule names by path
+  GitConfig gitmodules;
+  if (!gitmodules.read(toplevel_path + "/.gitmodules", 0))
+    return false;
+
+  std::unordered_map<std::string, std::string> names;
+  for (const auto& entry : gitmodules.entries) {
+    if (entry.key.compare(0, 10, "submodule.") != 0 || entry.key.length() < 16 ||
+    entry.key.compare(entry.key.length() - 5, 5, ".path") != 0)
+      continue;
+    names[entry.value] = entry.key.substr(10, entry.key.length() - 15);
+  }
+
+  if (names.empty())
+    return true;
+
+  // No index yet means no gitlinks yet
+  GitIndex index;
+  if (!index.load(git_dir, hash_size))
+    return errno == ENOENT;
+
+  for (const auto& entry : index.entries) {
+    if ((entry.mode & 0170000) != 0160000 || (entry.flags & 0x3000) != 0)
+      continue;
+
+    auto name = names.find(entry.path);
+    if (name == names.end())
+      continue;
+
+    struct stat st;
+    if (stat((toplevel_path + '/' + entry.path + "/.git").c_str(), &st) != 0)
+      continue;
+
+    Submodule submodule;
+    submodule.name = name->second;
+    submodule.path = entry.path;
+    submodule.gitlink = entry.oid;
+    submodules.push_back(submodule);
+  }
+
+  return true;
+}
+
+// Commit only paths (gitlinks included) as they are in the working tree, whatever else is staged
+bool commit_paths (const std::string& working_path, const std::vector<std::string>& paths, const std::string& message) {
+  std::vector<std::string> commands = {"git", "commit", "--quiet", "-m", message, "--"};
+  commands.insert(commands.end(), paths.begin(), paths.end());
+
+  ProcessResult result;
+  if (!run_process(commands, working_path, result)) {
+    std::string err_msg = "commit_paths() ==> Could not commit at path: " + working_path + '\n' + result.err;
+    print_error(err_msg.c_str());
+    return false;
+  } return true;
+}
+
+// Automatic Commit Message for submodules that moved
+std::string commit_submodule_message (const std::vector<std::string>& paths) {
+  std::time_t now_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  std::tm now_tm;
+  localtime_r(&now_time, &now_tm);
+  std::ostringstream oss;
+  oss << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
+
+  std::string submodules;
+  for (const auto& path : paths)
+    submodules += (submodules.empty() ? ": " : ", ") + path;
+  if (submodules.length() > 256) {
+    submodules.erase(256);
+    submodules += "...";
+  }
+
+  return '[' + oss.str() + "] Dugit Submodule Sync" + submodules;
+}
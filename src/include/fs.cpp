@@ -0,0 +1,103 @@
+#include "include.h"
+
+/*
+  Filesystem probes and directory
+  creation, straight from the system
+  calls instead of a shell running
+  test or mkdir for every one of them.
+*/
+
+// Check if a directory exists
+bool dir_exists (const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    std::string err_msg = "dir_exists() ==> Directory does not exist: " + path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  } return true;
+}
+
+// Create directory in path
+bool create_dir (const std::string& path, const std::string& name) {
+  int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1 || mkdirat(dir_fd, name.c_str(), 0777) != 0) {
+    std::string err_msg = "create_dir() ==> Could not create directory: " + name + ", in path: " + path + '\n';
+    print_error(err_msg.c_str());
+    if (dir_fd != -1) close(dir_fd);
+    return false;
+  }
+
+  close(dir_fd);
+  return true;
+}
+
+// Create a directory and any missing parents
+bool create_dirs (const std::string& path) {
+  /*
+    One component at a time, each made
+    (if missing) and opened relative to
+    the one before it.
+  */
+
+  int dir_fd = open(!path.empty() && path[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  size_t position = 0;
+  while (dir_fd != -1 && position < path.length()) {
+    size_t slash = path.find('/', position);
+    if (slash == std::string::npos) slash = path.length();
+    std::string component = path.substr(position, slash - position);
+    position = slash + 1;
+    if (component.empty() || component == ".")
+      continue;
+
+    int child_fd = -1;
+    if (mkdirat(dir_fd, component.c_str(), 0777) == 0 || errno == EEXIST)
+      child_fd = openat(dir_fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(dir_fd);
+    dir_fd = child_fd;
+  }
+
+  if (dir_fd == -1) {
+    std::string err_msg = "create_dirs() ==> Could not create directory: " + path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  close(dir_fd);
+  return true;
+}
+
+// Check if a file exists
+bool file_exists (const std::string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+// stat(2) a path once, and answer from memory after that
+const PathProbe& ProbeCache::probe (const std::string& path) {
+  auto found = this->probes.find(path);
+  if (found != this->probes.end())
+    return found->second;
+
+  struct stat st;
+  PathProbe probe;
+  probe.exists = stat(path.c_str(), &st) == 0;
+  probe.mode = probe.exists ? st.st_mode : 0;
+  return this->probes[path] = probe;
+}
+
+bool ProbeCache::is_dir (const std::string& path) {
+  const PathProbe& probe = this->probe(path);
+  return probe.exists && S_ISDIR(probe.mode);
+}
+
+// create_dirs, forgetting what was probed at every directory it may create
+bool ProbeCache::create_dirs (const std::string& path) {
+  for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    this->probes.erase(path.substr(0, slash));
+  this->probes.erase(path);
+  return ::create_dirs(path);
+}
+
+void ProbeCache::clear () {
+  this->probes.clear();
+}
@@ -1,5 +1,7 @@
 #include "include.h"
 
+#include <thread>
+
 char* get_shell () {
   return getenv("SHELL"); // envariables do not have to be freed
 }
@@ -14,8 +16,7 @@ std::string* get_ppid () {
     the .lock file.
   */
 
-  std::string command = "echo $PPID";
-  return execute_with_output_single_line(command);
+  return new std::string(std::to_string(getppid()));
 }
 
 std::string* get_cwd () {
@@ -26,8 +27,67 @@ std::string* get_cwd () {
 }
 
 std::string* get_pwd () {
-  std::string command = "pwd";
-  return execute_with_output_single_line(command);
+  std::vector<std::string> commands = {"pwd"};
+  return execute_with_output_single_line(commands);
+}
+
+// Filter out special characters from command output
+std::string* filter_output (const std::string& out, const std::string& err) {
+  std::string out_str = out;
+  std::string* output = new std::string();
+
+  if (out_str.empty())
+    out_str = err;
+
+  for (const auto& c : out_str) {
+    if (c < 32 && c != 10) continue;
+    else (*output) += c;
+  }
+
+  // std::cout << "\nCOMMAND OUTPUT: ";
+  // for (const auto& c : *output)
+  //   std::cout << int(c) << ", ";
+
+  return output;
+}
+
+// Reduce command output to a single line
+std::string* single_line (std::string* command_out) {
+  /*
+    A lot of functions expect a single
+    line output, for which the extraction
+    process looks the same.
+  */
+
+  // If we receive a nullstr, return nullstr
+  if (command_out == NULL)
+    return NULL;
+
+  // If we receive an empty string, return empty string
+  if (command_out->length() == 0)
+    return command_out;
+
+  // Delimit string
+  std::vector<std::string> lines = get_lines_from_string(*command_out);
+  delete(command_out);
+
+  // More than expected
+  if (lines.size() > 1)
+    return NULL;
+
+  return new std::string(lines.front());
+}
+
+// Join argv for error messages
+std::string get_string_from_args (const std::vector<std::string>& args) {
+  std::string concatenated;
+
+  for (const auto& arg : args) {
+    if (!concatenated.empty()) concatenated += ' ';
+    concatenated += arg;
+  }
+
+  return concatenated;
 }
 
 int32_t execute_without_output (const std::string& command) {
@@ -36,15 +96,15 @@ int32_t execute_without_output (const std::string& command) {
     return 1;
 
   int stderr_pipe[2];
-  if (pipe(stderr_pipe) != 0) {
-    perror("pipe");
+  if (pipe2(stderr_pipe, O_CLOEXEC) != 0) {
+    print_error("pipe");
     return 1;
   }
 
   // Fork process into child and parent
   pid_t pid = fork();
   if (pid == -1) {
-    perror("fork");
+    print_error("fork");
     return 1;
   } else if (pid == 0) {
     // Child process
@@ -58,12 +118,9 @@ int32_t execute_without_output (const std::string& command) {
     // Parent process
     close(stderr_pipe[1]);
 
-    std::ostringstream stderr_stream;
-    char buffer[4096];
-    ssize_t count;
-
-    while ((count = read(stderr_pipe[0], buffer, sizeof(buffer))) > 0)
-      stderr_stream.write(buffer, count);
+    std::string stdout_str;
+    std::string stderr_str;
+    drain_pipes(-1, stderr_pipe[0], stdout_str, stderr_str, StreamCallback(), StreamCallback());
 
     close(stderr_pipe[0]);
 
@@ -72,8 +129,8 @@ int32_t execute_without_output (const std::string& command) {
     int exit_status = WEXITSTATUS(status);
 
     if (exit_status != 0) {
-      std::string err_msg = "\nCOMMAND: " + command + "\nERROR: " + stderr_stream.str() + '\n';
-      // perror(err_msg.c_str());
+      std::string err_msg = "\nCOMMAND: " + command + "\nERROR: " + stderr_str + '\n';
+      // print_error(err_msg.c_str());
       return 1;
     }
 
@@ -82,14 +139,25 @@ int32_t execute_without_output (const std::string& command) {
 }
 
 int32_t execute_without_output (const std::vector<std::string>& commands) {
-  // Concatenate the command vector
-  std::string concatenated;
+  /*
+    The command vector is run directly
+    through the process runner, without
+    a shell in between.
+  */
+
+  std::string working_path;
+  std::vector<std::string> argv;
+  if (!split_working_path(commands, working_path, argv))
+    return 1;
 
-  for (const auto& command : commands) {
-    concatenated += command + ' ';
+  ProcessResult result;
+  if (!run_process(argv, working_path, result)) {
+    std::string err_msg = "\nCOMMAND: " + get_string_from_args(argv) + "\nERROR: " + result.err + '\n';
+    // print_error(err_msg.c_str());
+    return 1;
   }
 
-  return execute_without_output(concatenated);
+  return 0;
 }
 
 std::string* execute_with_output (const std::string& command) {
@@ -99,14 +167,14 @@ std::string* execute_with_output (const std::string& command) {
   
   int stdout_pipe[2];
   int stderr_pipe[2];
-  if (pipe(stdout_pipe) != 0 || pipe(stderr_pipe) != 0) {
-    perror("pipe");
+  if (pipe2(stdout_pipe, O_CLOEXEC) != 0 || pipe2(stderr_pipe, O_CLOEXEC) != 0) {
+    print_error("pipe");
     return NULL;
   }
 
   pid_t pid = fork();
   if (pid == -1) {
-    perror("fork");
+    print_error("fork");
     return NULL;
   } else if (pid == 0) {
     // Child process
@@ -124,15 +192,9 @@ std::string* execute_with_output (const std::string& command) {
     close(stdout_pipe[1]);
     close(stderr_pipe[1]);
 
-    std::ostringstream stdout_stream;
-    std::ostringstream stderr_stream;
-    char buffer[4096];
-    ssize_t count;
-
-    while ((count = read(stdout_pipe[0], buffer, sizeof(buffer))) > 0)
-      stdout_stream.write(buffer, count);
-    while ((count = read(stderr_pipe[0], buffer, sizeof(buffer))) > 0)
-      stderr_stream.write(buffer, count);
+    std::string stdout_str;
+    std::string stderr_str;
+    drain_pipes(stdout_pipe[0], stderr_pipe[0], stdout_str, stderr_str, StreamCallback(), StreamCallback());
 
     close(stdout_pipe[0]);
     close(stderr_pipe[0]);
@@ -142,40 +204,56 @@ std::string* execute_with_output (const std::string& command) {
     int exit_status = WEXITSTATUS(status);
 
     if (exit_status != 0) {
-      std::string err_msg = "\nCOMMAND: " + command + "\nERROR: " + stderr_stream.str() + "\nOUTPUT: " + stdout_stream.str() + '\n';
-      // perror(err_msg.c_str());
+      std::string err_msg = "\nCOMMAND: " + command + "\nERROR: " + stderr_str + "\nOUTPUT: " + stdout_str + '\n';
+      // print_error(err_msg.c_str());
       return NULL;
     }
 
-    // Filter out special characters
-    std::string out_str = stdout_stream.str();
-    std::string* output = new std::string();
+    return filter_output(stdout_str, stderr_str);
+  }
+}
 
-    if (out_str.empty())
-      out_str = stderr_stream.str();
-    
-    for (const auto& c : out_str) {
-      if (c < 32 && c != 10) continue;
-      else (*output) += c;
-    }
+std::string* execute_with_output (const std::vector<std::string>& commands) {
+  /*
+    The command vector is run directly
+    through the process runner, without
+    a shell in between.
+  */
 
-    // std::cout << "\nCOMMAND " << command << " : ";
-    // for (const auto& c : output)
-    //   std::cout << int(c) << ", ";
+  std::string working_path;
+  std::vector<std::string> argv;
+  if (!split_working_path(commands, working_path, argv))
+    return NULL;
 
-    return output;
+  ProcessResult result;
+  if (!run_process(argv, working_path, result)) {
+    std::string err_msg = "\nCOMMAND: " + get_string_from_args(argv) + "\nERROR: " + result.err + "\nOUTPUT: " + result.out + '\n';
+    // print_error(err_msg.c_str());
+    return NULL;
   }
+
+  return filter_output(result.out, result.err);
 }
 
-std::string* execute_with_output(const std::vector<std::string>& commands) {
-  // Concatenate the command vector
-  std::string concatenated;
+// Bounded output
+std::string* execute_with_output_bounded (const std::vector<std::string>& commands, const size_t max_bytes) {
+  /*
+    Same as execute_with_output, but the
+    command is stopped once max_bytes of
+    output were read, for callers that
+    would throw the rest away anyway.
+  */
 
-  for (const auto& command : commands) {
-    concatenated += command + ' ';
-  }
+  std::string working_path;
+  std::vector<std::string> argv;
+  if (!split_working_path(commands, working_path, argv))
+    return NULL;
 
-  return execute_with_output(concatenated);
+  ProcessResult result;
+  if (!run_process_bounded(argv, working_path, max_bytes, result))
+    return NULL;
+
+  return filter_output(result.out, result.err);
 }
 
 // Single line out
@@ -186,37 +264,11 @@ std::string* execute_with_output_single_line (const std::string& command) {
     process looks the same.
   */
 
-  // Get output
-  std::string* command_out = execute_with_output(command);
-
-  // If we receive a nullstr, return nullstr
-  if (command_out == NULL)
-    return NULL;
-
-  // If we receive an empty string, return empty string
-  if (command_out->length() == 0)
-    return command_out;
-
-  // Delimit string
-  std::vector<std::string> lines = get_lines_from_string(*command_out);
-  delete(command_out);
-
-  // More than expected
-  if (lines.size() > 1)
-    return NULL;
-
-  return new std::string(lines.front());
+  return single_line(execute_with_output(command));
 }
 
 std::string* execute_with_output_single_line (const std::vector<std::string>& commands) {
-  // Concatenate the command vector
-  std::string concatenated;
-
-  for (const auto& command : commands) {
-    concatenated += command + ' ';
-  }
-
-  return execute_with_output_single_line(concatenated);
+  return single_line(execute_with_output(commands));
 }
 
 // Multi line out (Do not use)
@@ -234,14 +286,15 @@ std::vector<std::string> execute_with_output_multi_line(const std::string& comma
 
 // Do not use
 std::vector<std::string> execute_with_output_multi_line (const std::vector<std::string>& commands) {
-  // Concatenate the command vector
-  std::string concatenated;
+  std::string* command_out = execute_with_output(commands);
 
-  for (const auto& command : commands) {
-    concatenated += command + ' ';
-  }
+  // If we receive a nullstr, return an empty vector
+  if (command_out == NULL)
+    return {};
 
-  return execute_with_output_multi_line(concatenated);
+  std::vector<std::string> output = get_lines_from_string(*command_out);
+  delete(command_out);
+  return output;
 }
 
 // Extract lines from string
@@ -274,24 +327,34 @@ std::string* get_executable_path (const std::string& exec_name) {
     properly.
 
     To ensure these dependencies
-    exist on the host machine,
-    we can run the command,
-    which executable_name
+    exist on the host machine, the
+    directories in $PATH are searched
+    the same way which does it, just
+    without running which.
   */
 
-  std::vector<std::string> commands({"which",exec_name});
-  std::string* command_out = execute_with_output_single_line(commands);
-  if (command_out == NULL) {
-    std::string err_msg = "get_executable_path() ==> Executable does not exist: " + exec_name + '\n';
-    perror(err_msg.c_str());
-    return NULL;
-  } return command_out;
+  const char* path_env = getenv("PATH"); // envariables do not have to be freed
+  if (path_env != NULL && exec_name.find('/') == std::string::npos) {
+    std::stringstream ss(path_env);
+    std::string dir;
+    while (std::getline(ss, dir, ':')) {
+      if (dir.empty()) dir = ".";
+      std::string candidate = dir + '/' + exec_name;
+      struct stat st;
+      if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0)
+        return new std::string(candidate);
+    }
+  }
+
+  std::string err_msg = "get_executable_path() ==> Executable does not exist: " + exec_name + '\n';
+  print_error(err_msg.c_str());
+  return NULL;
 }
 
 // Trim front of a string
 bool string_trim_front(std::string& s, const unsigned long long len) {
   if (s.length() < len) {
-    perror("string_trim_front(): Trying to trim line shorter than expected.");
+    print_error("string_trim_front(): Trying to trim line shorter than expected.");
     return false;
   }
   
@@ -303,7 +366,7 @@ bool strings_trim_fronts(std::vector<std::string>& lines, const unsigned long lo
   // Check that all lines are long enough
   for (const auto& line : lines) {
     if (line.length() < len) {
-      perror("strings_trim_fronts(): Trying to trim line shorter than expected.");
+      print_error("strings_trim_fronts(): Trying to trim line shorter than expected.");
       return false;
     }
   }
@@ -318,7 +381,7 @@ bool strings_trim_fronts(std::vector<std::string>& lines, const unsigned long lo
 // Trim rear of a string
 bool string_trim_rear(std::string& s, const unsigned long long len) {
   if (s.length() < len) {
-    perror("string_trim_rear(): Trying to trim line shorter than expected.");
+    print_error("string_trim_rear(): Trying to trim line shorter than expected.");
     return false;
   }
   
@@ -330,7 +393,7 @@ bool strings_trim_rears(std::vector<std::string>& lines, const unsigned long lon
   // Check that all lines are long enough
   for (const auto& line : lines) {
     if (line.length() < len) {
-      perror("strings_trim_rears(): Trying to trim line shorter than expected.");
+      print_error("strings_trim_rears(): Trying to trim line shorter than expected.");
       return false;
     }
   }
@@ -342,47 +405,32 @@ bool strings_trim_rears(std::vector<std::string>& lines, const unsigned long lon
   return true;
 }
 
-// Check if a directory exists
-bool dir_exists (const std::string& path) {
-  std::vector<std::string> commands(
-    {"[ -d", '\"' + path + '\"', "]"}
-  );
+// Read a whole file into a string
+bool read_file (const std::string& path, std::string& content) {
+  /*
+    Used for the small files git keeps
+    its state in (HEAD, loose refs,
+    gitfiles), so read(2) is used
+    directly rather than a stream.
+  */
 
-  std::string* output = execute_with_output(commands);
-  if (output == NULL) {
-    std::string err_msg = "dir_exists() ==> Directory does not exist: " + path + '\n';
-    perror(err_msg.c_str());
+  content.clear();
+  int file_descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1)
     return false;
-  }
-  delete(output);
-  return true;
-}
-
-// Create directory in path
-bool create_dir (const std::string& path, const std::string& name) {
-  std::vector<std::string> commands(
-    {"cd",path,"&&","mkdir",name}
-  );
-
-  int32_t err_code = execute_without_output(commands);
-  if (err_code == 0)
-    return true;
-  
-  std::string err_msg = "create_dir() ==> Could not create directory: " + name + ", in path: " + path + ", with Error Code: " + std::to_string(err_code) + '\n';
-  perror(err_msg.c_str());
-  return false;
-}
 
-// Check if a file exists
-bool file_exists (const std::string& path) {
-  std::ifstream file(path);
+  char buffer[4096];
+  ssize_t count;
+  while ((count = read(file_descriptor, buffer, sizeof(buffer))) != 0) {
+    if (count == -1) {
+      if (errno == EINTR) continue;
+      close(file_descriptor);
+      return false;
+    } content.append(buffer, count);
+  }
 
-  if (file.good())
-    return true;
-  
-  std::string err_msg = "file_exists() ==> File does not exist: " + path + '\n';
-  // perror(err_msg.c_str());
-  return false;
+  close(file_descriptor);
+  return true;
 }
 
 // Check if line exists in file
@@ -396,10 +444,10 @@ bool line_in_file_exists (const std::string& path, const std::string& s) {
         return true;
     } file.close();
     std::string err_msg = "line_in_file_exists() ==> Could not find line \"" + s + "\" in file: " + path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
   } else {
     std::string err_msg = "line_in_file_exists() ==> File does not exist: " + path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
   }
 
   return false;
@@ -417,7 +465,7 @@ bool append_line_to_file (const std::string& path, const std::string& s) {
     infile.close();
   } else {
     std::string err_msg = "append_line_to_file() ==> Failed to open file: " + path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   }
 
@@ -433,7 +481,7 @@ bool append_line_to_file (const std::string& path, const std::string& s) {
   }
 
   std::string err_msg = "append_line_to_file() ==> Failed to open file: " + path + '\n';
-  perror(err_msg.c_str());
+  print_error(err_msg.c_str());
   return false;
 }
 
@@ -450,53 +498,125 @@ int32_t line_pos_in_file (const std::string& path, const std::string& s) {
     } file.close();
   } else {
     std::string err_msg = "line_pos_in_file() ==> Failed to open file: " + path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return -1;
   }
 
   std::string err_msg = "line_pos_in_file() ==> Could not find line \"" + s + "\" in file: " + path + '\n';
-  perror(err_msg.c_str());
+  print_error(err_msg.c_str());
   return -1;
 }
 
-// Lock file using flock
-bool lock_file (const std::string& path) {
-  int file_descriptor = open(path.c_str(), O_CREAT | O_RDWR, 0666);
+/*
+  flock belongs to the open file, so the
+  descriptor that took a lock is kept
+  until release. A process that outlives
+  its commands, like dugitd, would
+  otherwise never let go of it.
+*/
+
+FileLock::FileLock () {
+  this->file_descriptor = -1;
+  this->shared = false;
+  this->contended = false;
+}
+
+FileLock::~FileLock () {
+  this->release();
+}
 
+// Take the lock if nobody is in the way, false right away otherwise
+bool FileLock::try_acquire (const std::string& path, const bool shared, const std::string& owner) {
+  this->release();
+  this->contended = false;
+
+  int file_descriptor = open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0666);
   if (file_descriptor == -1) {
-    std::string err_msg = "lock_file() ==> Failed to open file: " + path + '\n';
-    perror(err_msg.c_str());
+    std::string err_msg = "FileLock::try_acquire() ==> Failed to open file: " + path + '\n';
+    print_error(err_msg.c_str());
     return false;
   }
 
-  if (flock(file_descriptor, LOCK_EX) == -1) {
-    std::string err_msg = "lock_file() ==> Failed to lock file: " + path + '\n';
-    perror(err_msg.c_str());
+  if (flock(file_descriptor, (shared ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1) {
+    this->contended = errno == EWOULDBLOCK;
+    if (!this->contended) {
+      std::string err_msg = "FileLock::try_acquire() ==> Failed to lock file: " + path + '\n';
+      print_error(err_msg.c_str());
+    }
     close(file_descriptor);
     return false;
   }
 
-  return true;
+  this->path = path;
+  this->file_descriptor = file_descriptor;
+  this->shared = shared;
+
+  // Shared holders are many, only an exclusive one can say who holds the lock
+  if (!shared && ftruncate(file_descriptor, 0) == 0) {
+    std::string line = owner + '\n';
+    if (pwrite(file_descriptor, line.data(), line.size(), 0) != static_cast<ssize_t>(line.size()))
+      print_error("FileLock::try_acquire() ==> Could not record the lock owner.\n");
+  } return true;
 }
 
-// Unlock file using flock
-bool unlock_file (const std::string& path) {
-  int file_descriptor = open(path.c_str(), O_CREAT | O_RDWR, 0666);
+// Take the lock, waiting at most timeout seconds and saying what for
+bool FileLock::acquire (const std::string& path, const bool shared, const std::string& owner, const uint32_t timeout) {
+  /*
+    Polled rather than blocking in flock,
+    so a wait can be reported, and given
+    up on, instead of hanging silently
+    behind another dugit.
+  */
 
-  if (file_descriptor == -1) {
-    std::string err_msg = "unlock_file() ==> Failed to open file: " + path + '\n';
-    perror(err_msg.c_str());
-    return false;
-  }
+  auto start = std::chrono::steady_clock::now();
+  uint32_t reported = 0;
+  while (!this->try_acquire(path, shared, owner)) {
+    if (!this->contended)
+      return false;
 
-  if (flock(file_descriptor, LOCK_UN) == -1) {
-    std::string err_msg = "unlock_file() ==> Failed to unlock file: " + path + '\n';
-    perror(err_msg.c_str());
-    close(file_descriptor);
-    return false;
+    std::string holder;
+    read_file(path, holder);
+    holder = holder.substr(0, holder.find('\n'));
+    if (holder.empty())
+      holder = "another dugit command";
+
+    uint32_t waited = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count();
+    if (waited >= timeout) {
+      std::string err_msg = "FileLock::acquire() ==> Gave up after " + std::to_string(waited) + "s waiting for " + holder + " to release " + path + '\n';
+      print_error(err_msg.c_str());
+      return false;
+    }
+
+    // After a second, then every ten
+    if (waited >= 1 && (reported == 0 || waited >= reported + 10)) {
+      if (reported == 0)
+        std::cout << "Waiting for " << holder << " to release " << path << " (up to " << timeout << "s)..." << std::endl;
+      else std::cout << "Still waiting for " << holder << ", " << waited << "s so far..." << std::endl;
+      reported = waited;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  } return true;
+}
+
+// Unlock, an exclusive holder clears its name first
+void FileLock::release () {
+  if (this->file_descriptor == -1)
+    return;
+
+  if (!this->shared && ftruncate(this->file_descriptor, 0) != 0)
+    print_error("FileLock::release() ==> Could not clear the lock owner.\n");
+  if (flock(this->file_descriptor, LOCK_UN) == -1) {
+    std::string err_msg = "FileLock::release() ==> Failed to unlock file: " + this->path + '\n';
+    print_error(err_msg.c_str());
   }
 
-  return true;
+  close(this->file_descriptor);
+  this->file_descriptor = -1;
+}
+
+bool FileLock::held () const {
+  return this->file_descriptor != -1;
 }
 
 // Clear file
@@ -506,7 +626,7 @@ bool clear_file (const std::string& path) {
 
   if (!output_filestream) {
     std::string err_msg = "clear_file() ==> Failed to open file: " + path + '\n';
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   }
   
@@ -519,7 +639,7 @@ bool remove_file (const std::string& path) {
   int status = remove(path.c_str());
 
   if (status != 0) {
-    perror("Error deleting file");
+    print_error("Error deleting file");
     return false;
   } return true;
 }
@@ -541,7 +661,7 @@ bool check_external_dependencies (const std::vector<std::string>& dependencies)
   }
 
   if (!err_msg.empty()) {
-    perror(err_msg.c_str());
+    print_error(err_msg.c_str());
     return false;
   } return true;
 }
@@ -551,7 +671,10 @@ bool response_generator (const std::string& message) {
   std::string input;
   while (true) {
     std::cout << "Do you accept this ('y' or 'n'):\n";
-    std::getline(std::cin, input);
+
+    // Nobody left to answer (end of input, or dugitd's client hung up)
+    if (!std::getline(std::cin, input))
+      return false;
     if (input == "y" || input == "Y")
       return true;
     else if (input == "n" || input == "N")
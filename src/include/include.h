@@ -30,13 +30,18 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
+#include <atomic>
+#include <mutex>
 #include <chrono>
 #include <iomanip>
 #include <csignal>
+#include <cerrno>
 
 // Useful functions
 char* get_shell();
@@ -45,7 +50,45 @@ std::string* get_cwd();
 std::string* get_pwd();
 std::string* get_executable_path(const std::string& exec_name);
 
-// Run command
+// Process runner result
+struct ProcessResult {
+  int32_t exit_status;
+  std::string out;
+  std::string err;
+
+  // The child was stopped once out held as much as was asked for
+  bool truncated;
+};
+
+// Process output stream callback (chunk, length)
+typedef std::function<void(const char*, size_t)> StreamCallback;
+
+// Split a leading "cd <path> &&" off a command vector
+bool split_working_path(const std::vector<std::string>& commands, std::string& working_path, std::vector<std::string>& argv);
+
+// Refuse to spawn processes while set (a command whose client hung up), returns the previous state
+bool interrupt_processes(const bool interrupted);
+
+// Spawn a process without a shell (NULL fds are not piped)
+pid_t spawn_process(const std::vector<std::string>& argv, const std::string& working_path, int* stdin_fd, int* stdout_fd, int* stderr_fd);
+
+// Wait for a spawned process and return its exit status
+int32_t wait_process(pid_t pid);
+
+// Drain stdout and stderr together until both reach EOF (either fd may be -1)
+bool drain_pipes(int stdout_fd, int stderr_fd, std::string& out, std::string& err, const StreamCallback& on_stdout, const StreamCallback& on_stderr);
+
+// Run a process to completion, collecting its output
+bool run_process(const std::vector<std::string>& argv, const std::string& working_path, ProcessResult& result);
+bool run_process(const std::vector<std::string>& argv, const std::string& working_path, ProcessResult& result, const StreamCallback& on_stdout, const StreamCallback& on_stderr);
+
+// Run a process until it exits or max_bytes of stdout were read, then stop it
+bool run_process_bounded(const std::vector<std::string>& argv, const std::string& working_path, const size_t max_bytes, ProcessResult& result);
+
+// Run several processes with at most jobs of them at a time (results keep argvs order)
+bool run_processes(const std::vector<std::vector<std::string>>& argvs, const std::string& working_path, const uint32_t jobs, std::vector<ProcessResult>& results);
+
+// Run command (the string overloads go through $SHELL -c)
 int32_t execute_without_output(const std::string& command);
 int32_t execute_without_output(const std::vector<std::string>& commands);
 
@@ -53,10 +96,53 @@ int32_t execute_without_output(const std::vector<std::string>& commands);
 std::string* execute_with_output(const std::string& command);
 std::string* execute_with_output(const std::vector<std::string>& commands);
 
+// Run command, reading at most max_bytes of its output
+std::string* execute_with_output_bounded(const std::vector<std::string>& commands, const size_t max_bytes);
+
+// Route std::cout, std::cerr and print_error of the calling thread into output, for as long as this lives
+struct ThreadOutput {
+  std::string* previous;
+
+  ThreadOutput(std::string& output);
+  ~ThreadOutput();
+};
+
+// Write to the real std::cout in one piece, even from a thread that is capturing
+void print_whole(const std::string& output);
+
+// perror, into the calling thread's capture (with its std::cout and std::cerr) when it has one
+void print_error(const char* message);
+
+// A task for WorkPool, and the keys (hosts, for dugit) it holds while it runs
+struct PoolTask {
+  std::function<void()> run;
+  std::vector<std::string> keys;
+};
+
+struct WorkPool {
+  // Worker threads, and how many running tasks may hold the same key
+  uint32_t threads;
+  uint32_t key_cap;
+
+  // Set to start no more tasks, running ones finish
+  std::atomic<bool> stopping;
+
+  WorkPool(const uint32_t threads, const uint32_t key_cap);
+
+  // Run tasks (in priority order) on work-stealing workers, returning once all are done
+  void run(std::vector<PoolTask>& tasks);
+};
+
 // Single line out
 std::string* execute_with_output_single_line(const std::string& command);
 std::string* execute_with_output_single_line(const std::vector<std::string>& commands);
 
+// Filter out special characters from command output
+std::string* filter_output(const std::string& out, const std::string& err);
+
+// Reduce command output to a single line (takes ownership)
+std::string* single_line(std::string* command_out);
+
 // Multi line out (Do not use)
 std::vector<std::string> execute_with_output_multi_line(const std::string& command);
 std::vector<std::string> execute_with_output_multi_line(const std::vector<std::string>& commands);
@@ -67,6 +153,9 @@ std::vector<std::string> get_lines_from_string(const std::string& s);
 // Get string from lines
 std::string get_string_from_lines(const std::vector<std::string>& lines);
 
+// Join argv for error messages
+std::string get_string_from_args(const std::vector<std::string>& args);
+
 // Trim front of a string
 bool string_trim_front(std::string& s, const unsigned long long len);
 bool strings_trim_fronts(std::vector<std::string>& lines, const unsigned long long len);
@@ -81,9 +170,45 @@ bool dir_exists(const std::string& path);
 // Create directory in path
 bool create_dir(const std::string& path, const std::string& name);
 
+// Create a directory and any missing parents
+bool create_dirs(const std::string& path);
+
 // Check if a file exists
 bool file_exists(const std::string& path);
 
+struct PathProbe {
+  // stat(2) found the path, and its type bits
+  bool exists;
+  mode_t mode;
+};
+
+struct ProbeCache {
+  /*
+    The stat(2) results a session got for
+    the paths nothing else creates or
+    removes while it runs (the working
+    path, the toplevel, .dugit), so a
+    command sees each of them one way.
+    Files git creates and removes under
+    a command, like MERGE_HEAD, must not
+    go through it. A session clears it
+    between commands.
+  */
+
+  std::unordered_map<std::string, PathProbe> probes;
+
+  const PathProbe& probe(const std::string& path);
+  bool is_dir(const std::string& path);
+
+  // create_dirs, forgetting what was probed at every directory it may create
+  bool create_dirs(const std::string& path);
+
+  void clear();
+};
+
+// Read a whole file into a string
+bool read_file(const std::string& path, std::string& content);
+
 // Check if line exists in file
 bool line_in_file_exists(const std::string& path, const std::string& s);
 
@@ -93,11 +218,34 @@ bool append_line_to_file(const std::string& path, const std::string& s);
 // Return position of line in file (return -1 otherwise)
 int32_t line_pos_in_file(const std::string& path, const std::string& s);
 
-// Lock file using flock
-bool lock_file(const std::string& path);
+struct FileLock {
+  /*
+    An flock(2) lock, held through the
+    descriptor it was taken on until it
+    is released or the object goes away.
+    An exclusive holder writes who it is
+    into the file, for whoever waits.
+  */
+
+  std::string path;
+  int file_descriptor;
+  bool shared;
+
+  // The last attempt failed because someone else holds the lock
+  bool contended;
+
+  FileLock();
+  ~FileLock();
+
+  // Take the lock if nobody is in the way, false right away otherwise
+  bool try_acquire(const std::string& path, const bool shared, const std::string& owner);
+
+  // Take the lock, waiting at most timeout seconds and saying what for
+  bool acquire(const std::string& path, const bool shared, const std::string& owner, const uint32_t timeout);
 
-// Unlock file using flock
-bool unlock_file(const std::string& path);
+  void release();
+  bool held() const;
+};
 
 // Clear file
 bool clear_file(const std::string& path);
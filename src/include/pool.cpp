@@ -0,0 +1,200 @@
+#include "include.h"
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+/*
+  std::cout is shared by every thread,
+  so a thread that wants its output for
+  itself cannot swap the stream buffer.
+  Instead std::cout gets a buffer once
+  that looks up the calling thread's
+  capture, and writes to the original
+  buffer, one call at a time, when the
+  thread has none. std::cerr and errors
+  reported with print_error go to the
+  same capture, so a thread's errors
+  stay with its output.
+*/
+
+static thread_local std::string* output_capture = NULL;
+
+struct OutputRouter : public std::streambuf {
+  std::streambuf* original;
+  std::mutex mutex;
+
+  int overflow (int c) override {
+    if (c == EOF)
+      return 0;
+    if (output_capture != NULL) {
+      output_capture->push_back(static_cast<char>(c));
+      return c;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->original->sputc(static_cast<char>(c));
+  }
+
+  std::streamsize xsputn (const char* s, std::streamsize n) override {
+    if (output_capture != NULL) {
+      output_capture->append(s, n);
+      return n;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->original->sputn(s, n);
+  }
+
+  int sync () override {
+    if (output_capture != NULL)
+      return 0;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->original->pubsync();
+  }
+};
+
+static OutputRouter output_router;
+static OutputRouter error_router;
+static std::once_flag output_router_installed;
+
+ThreadOutput::ThreadOutput (std::string& output) {
+  std::call_once(output_router_installed, [] () {
+    std::cout.flush();
+    output_router.original = std::cout.rdbuf(&output_router);
+    std::cerr.flush();
+    error_router.original = std::cerr.rdbuf(&error_router);
+  });
+
+  this->previous = output_capture;
+  output_capture = &output;
+}
+
+ThreadOutput::~ThreadOutput () {
+  output_capture = this->previous;
+}
+
+// Write to the real std::cout in one piece, even from a thread that is capturing
+void print_whole (const std::string& output) {
+  std::string* capture = output_capture;
+  output_capture = NULL;
+  std::cout << output << std::flush;
+  output_capture = capture;
+}
+
+// perror, into the calling thread's capture when it has one
+void print_error (const char* message) {
+  if (output_capture == NULL) {
+    perror(message);
+    return;
+  }
+
+  char buffer[256];
+  const char* description = strerror_r(errno, buffer, sizeof(buffer));
+  output_capture->append(message);
+  output_capture->append(": ");
+  output_capture->append(description);
+  output_capture->push_back('\n');
+}
+
+WorkPool::WorkPool (const uint32_t threads, const uint32_t key_cap) {
+  this->threads = std::max(threads, 1u);
+  this->key_cap = std::max(key_cap, 1u);
+  this->stopping = false;
+}
+
+// Run every task, at most key_cap at a time for any key, and return once all are done
+void WorkPool::run (std::vector<PoolTask>& tasks) {
+  /*
+    Every worker owns a deque, and the
+    tasks, already in priority order,
+    are dealt out over them like cards,
+    so the first tasks start first on
+    every worker. A worker takes from
+    the front of its own deque, and once
+    it has nothing it can start, steals
+    from the back of the others, where
+    the least urgent work is.
+
+    A task holds its keys while it runs
+    (for dugit, the hosts a repository
+    syncs with), and is passed over while
+    any of them is at its cap. Deques and
+    keys share one lock, which is only
+    held to pick a task, never to run it.
+  */
+
+  std::vector<std::deque<PoolTask*>> deques(this->threads);
+  for (size_t task = 0; task < tasks.size(); task++)
+    deques[task % this->threads].push_back(&tasks[task]);
+
+  std::mutex mutex;
+  std::condition_variable finished;
+  std::unordered_map<std::string, uint32_t> in_use;
+  size_t queued = tasks.size();
+
+  auto runnable = [&] (const PoolTask* task) {
+    for (const auto& key : task->keys) {
+      auto used = in_use.find(key);
+      if (used != in_use.end() && used->second >= this->key_cap)
+        return false;
+    } return true;
+  };
+
+  auto take = [&] (const uint32_t worker) -> PoolTask* {
+    std::deque<PoolTask*>& own = deques[worker];
+    for (auto task = own.begin(); task != own.end(); task++) {
+      if (runnable(*task)) {
+        PoolTask* taken = *task;
+        own.erase(task);
+        return taken;
+      }
+    }
+
+    for (uint32_t offset = 1; offset < this->threads; offset++) {
+      std::deque<PoolTask*>& victim = deques[(worker + offset) % this->threads];
+      for (auto task = victim.rbegin(); task != victim.rend(); task++) {
+        if (runnable(*task)) {
+          PoolTask* taken = *task;
+          victim.erase(std::next(task).base());
+          return taken;
+        }
+      }
+    } return NULL;
+  };
+
+  auto work = [&] (const uint32_t worker) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (queued > 0 && !this->stopping) {
+      PoolTask* task = take(worker);
+      if (task == NULL) {
+        // Everything left waits on a key, until some task gives one back
+        finished.wait(lock);
+        continue;
+      }
+
+      queued--;
+      for (const auto& key : task->keys)
+        in_use[key]++;
+
+      lock.unlock();
+      task->run();
+      lock.lock();
+
+      for (const auto& key : task->keys)
+        in_use[key]--;
+      finished.notify_all();
+    }
+
+    finished.notify_all();
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t worker = 1; worker < this->threads; worker++)
+    workers.emplace_back(work, worker);
+  work(0);
+
+  for (auto& worker : workers)
+    worker.join();
+}
@@ -0,0 +1,416 @@
+#include "include.h"
+
+#include <spawn.h>
+#include <poll.h>
+
+extern char** environ;
+
+// Set while no new process may start
+static std::atomic<bool> processes_interrupted(false);
+
+// Split a leading "cd <path> &&" off a command vector
+bool split_working_path (const std::vector<std::string>& commands, std::string& working_path, std::vector<std::string>& argv) {
+  /*
+    Most of the git helpers build their
+    commands in the form,
+    cd working_path && git ...
+
+    Rather than handing that to a shell,
+    the leading cd becomes the working
+    directory of the child process, and
+    everything after the && is the argv.
+  */
+
+  working_path.clear();
+  argv.clear();
+
+  std::vector<std::string>::const_iterator it = commands.begin();
+  if (commands.size() >= 3 && commands[0] == "cd" && commands[2] == "&&") {
+    working_path = commands[1];
+    it += 3;
+  }
+
+  for (; it != commands.end(); it++) {
+    if (*it == "&&" || *it == "||" || *it == "|" || *it == ";") {
+      std::string err_msg = "split_working_path() ==> Shell operator \"" + *it + "\" is not supported by the process runner.\n";
+      print_error(err_msg.c_str());
+      return false;
+    } argv.push_back(*it);
+  }
+
+  return !argv.empty();
+}
+
+// Refuse to spawn processes while set, returns the previous state
+bool interrupt_processes (const bool interrupted) {
+  /*
+    Every step of a command runs git, so
+    a command stops at its next step once
+    this is set, and fails its way back
+    to the caller. Processes that are
+    already running finish on their own.
+  */
+
+  return processes_interrupted.exchange(interrupted);
+}
+
+// Spawn a process without a shell
+pid_t spawn_process (const std::vector<std::string>& argv, const std::string& working_path, int* stdin_fd, int* stdout_fd, int* stderr_fd) {
+  /*
+    The argv is executed directly via
+    posix_spawnp, so nothing is ever
+    interpreted by a shell. Any of the
+    fd pointers may be NULL, in which
+    case the child inherits (stdin) or
+    discards (stdout, stderr) that stream.
+    Otherwise the parent's end of a new
+    pipe is returned through the pointer.
+  */
+
+  if (argv.empty())
+    return -1;
+
+  if (processes_interrupted) {
+    errno = ECANCELED;
+    return -1;
+  }
+
+  int stdin_pipe[2] = {-1, -1};
+  int stdout_pipe[2] = {-1, -1};
+  int stderr_pipe[2] = {-1, -1};
+
+  if ((stdin_fd != NULL && pipe2(stdin_pipe, O_CLOEXEC) != 0) ||
+  (stdout_fd != NULL && pipe2(stdout_pipe, O_CLOEXEC) != 0) ||
+  (stderr_fd != NULL && pipe2(stderr_pipe, O_CLOEXEC) != 0)) {
+    print_error("pipe");
+    for (int fd : {stdin_pipe[0], stdin_pipe[1], stdout_pipe[0], stdout_pipe[1], stderr_pipe[0], stderr_pipe[1]})
+      if (fd != -1) close(fd);
+    return -1;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  if (stdin_fd != NULL)
+    posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], STDIN_FILENO);
+
+  if (stdout_fd != NULL)
+    posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
+  else posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+  if (stderr_fd != NULL)
+    posix_spawn_file_actions_adddup2(&actions, stderr_pipe[1], STDERR_FILENO);
+  else posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+  if (!working_path.empty())
+    posix_spawn_file_actions_addchdir_np(&actions, working_path.c_str());
+
+  std::vector<char*> c_argv;
+  for (const auto& arg : argv)
+    c_argv.push_back(const_cast<char*>(arg.c_str()));
+  c_argv.push_back(NULL);
+
+  // dugit ignores SIGPIPE for its coprocesses, children should not
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  sigaddset(&default_signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attributes, &default_signals);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+  pid_t pid;
+  int err_code = posix_spawnp(&pid, c_argv[0], &actions, &attributes, c_argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+
+  // Close the child's ends of the pipes
+  if (stdin_pipe[0] != -1) close(stdin_pipe[0]);
+  if (stdout_pipe[1] != -1) close(stdout_pipe[1]);
+  if (stderr_pipe[1] != -1) close(stderr_pipe[1]);
+
+  if (err_code != 0) {
+    if (stdin_pipe[1] != -1) close(stdin_pipe[1]);
+    if (stdout_pipe[0] != -1) close(stdout_pipe[0]);
+    if (stderr_pipe[0] != -1) close(stderr_pipe[0]);
+    return -1;
+  }
+
+  if (stdin_fd != NULL) *stdin_fd = stdin_pipe[1];
+  if (stdout_fd != NULL) *stdout_fd = stdout_pipe[0];
+  if (stderr_fd != NULL) *stderr_fd = stderr_pipe[0];
+  return pid;
+}
+
+// Wait for a spawned process and return its exit status
+int32_t wait_process (pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      return -1;
+  }
+
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 128 + WTERMSIG(status);
+}
+
+// Drain stdout and stderr together until both reach EOF
+bool drain_pipes (int stdout_fd, int stderr_fd, std::string& out, std::string& err, const StreamCallback& on_stdout, const StreamCallback& on_stderr) {
+  /*
+    Reading one pipe to EOF before
+    touching the other deadlocks as
+    soon as the child fills the pipe
+    buffer of the stream nobody is
+    reading (64 KiB on linux). Both
+    pipes are therefore polled and
+    drained as data arrives. Either
+    fd may be -1 if it is not piped.
+  */
+
+  struct pollfd fds[2];
+  std::string* buffers[2] = {&out, &err};
+  const StreamCallback* callbacks[2] = {&on_stdout, &on_stderr};
+  fds[0].fd = stdout_fd;
+  fds[1].fd = stderr_fd;
+  fds[0].events = fds[1].events = POLLIN;
+
+  std::vector<char> buffer(65536);
+  int open_fds = (stdout_fd != -1) + (stderr_fd != -1);
+
+  while (open_fds > 0) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      print_error("poll");
+      return false;
+    }
+
+    for (int stream = 0; stream < 2; stream++) {
+      if (fds[stream].fd == -1 || fds[stream].revents == 0)
+        continue;
+
+      ssize_t count = read(fds[stream].fd, buffer.data(), buffer.size());
+      if (count > 0) {
+        buffers[stream]->append(buffer.data(), count);
+        if (*callbacks[stream])
+          (*callbacks[stream])(buffer.data(), count);
+      } else if (count == 0 || errno != EINTR) {
+        // EOF (or a hard error), stop polling this stream
+        fds[stream].fd = -1;
+        open_fds--;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Run a process to completion, collecting its output
+bool run_process (const std::vector<std::string>& argv, const std::string& working_path, ProcessResult& result) {
+  return run_process(argv, working_path, result, StreamCallback(), StreamCallback());
+}
+
+// Run a process to completion, streaming its output through callbacks
+bool run_process (const std::vector<std::string>& argv, const std::string& working_path, ProcessResult& result, const StreamCallback& on_stdout, const StreamCallback& on_stderr) {
+  result.exit_status = -1;
+  result.out.clear();
+  result.err.clear();
+  result.truncated = false;
+
+  int stdout_fd;
+  int stderr_fd;
+  pid_t pid = spawn_process(argv, working_path, NULL, &stdout_fd, &stderr_fd);
+  if (pid == -1)
+    return false;
+
+  drain_pipes(stdout_fd, stderr_fd, result.out, result.err, on_stdout, on_stderr);
+
+  close(stdout_fd);
+  close(stderr_fd);
+
+  result.exit_status = wait_process(pid);
+  return result.exit_status == 0;
+}
+
+// Run a process until it exits or max_bytes of stdout were read, then stop it
+bool run_process_bounded (const std::vector<std::string>& argv, const std::string& working_path, const size_t max_bytes, ProcessResult& result) {
+  /*
+    For queries whose answer is known
+    from the first bytes, "is there any
+    output at all" being the extreme
+    case with max_bytes 1. As soon as
+    enough has been read, the child is
+    sent SIGTERM and its pipes closed,
+    instead of letting it walk the rest
+    of the tree. Only use this for
+    commands that change nothing.
+
+    Returns true if the child succeeded,
+    or was stopped early (truncated).
+  */
+
+  result.exit_status = -1;
+  result.out.clear();
+  result.err.clear();
+  result.truncated = false;
+
+  int stdout_fd;
+  int stderr_fd;
+  pid_t pid = spawn_process(argv, working_path, NULL, &stdout_fd, &stderr_fd);
+  if (pid == -1)
+    return false;
+
+  struct pollfd fds[2];
+  fds[0].fd = stdout_fd;
+  fds[1].fd = stderr_fd;
+  fds[0].events = fds[1].events = POLLIN;
+
+  std::vector<char> buffer(65536);
+  int open_fds = 2;
+
+  while (open_fds > 0 && !result.truncated) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      print_error("poll");
+      break;
+    }
+
+    for (int stream = 0; stream < 2; stream++) {
+      if (fds[stream].fd == -1 || fds[stream].revents == 0)
+        continue;
+
+      // Never read more stdout than the cap
+      size_t length = buffer.size();
+      if (stream == 0)
+        length = std::min(length, max_bytes - result.out.size());
+
+      ssize_t count = read(fds[stream].fd, buffer.data(), length);
+      if (count > 0) {
+        (stream == 0 ? result.out : result.err).append(buffer.data(), count);
+        if (stream == 0 && result.out.size() >= max_bytes) {
+          result.truncated = true;
+          break;
+        }
+      } else if (count == 0 || errno != EINTR) {
+        fds[stream].fd = -1;
+        open_fds--;
+      }
+    }
+  }
+
+  if (result.truncated)
+    kill(pid, SIGTERM);
+
+  close(stdout_fd);
+  close(stderr_fd);
+
+  result.exit_status = wait_process(pid);
+  return result.truncated || result.exit_status == 0;
+}
+
+// Run several processes with at most jobs of them at a time
+bool run_processes (const std::vector<std::vector<std::string>>& argvs, const std::string& working_path, const uint32_t jobs, std::vector<ProcessResult>& results) {
+  /*
+    A single poll loop drains every
+    running child, so no threads are
+    needed to run them concurrently.
+    Results are stored in the order of
+    argvs regardless of which process
+    finishes first. Returns true only
+    if every process succeeded.
+  */
+
+  struct Running {
+    size_t index;
+    pid_t pid;
+    int fds[2];
+  };
+
+  results.assign(argvs.size(), ProcessResult());
+  for (auto& result : results) {
+    result.exit_status = -1;
+    result.truncated = false;
+  }
+
+  const uint32_t limit = jobs == 0 ? 1 : jobs;
+  std::vector<Running> running;
+  std::vector<char> buffer(65536);
+  size_t next = 0;
+  bool all_succeeded = true;
+
+  while (next < argvs.size() || !running.empty()) {
+    // Fill free job slots
+    while (next < argvs.size() && running.size() < limit) {
+      Running child;
+      child.index = next++;
+      child.pid = spawn_process(argvs[child.index], working_path, NULL, &child.fds[0], &child.fds[1]);
+      if (child.pid == -1) {
+        all_succeeded = false;
+        continue;
+      } running.push_back(child);
+    }
+
+    if (running.empty())
+      break;
+
+    std::vector<struct pollfd> fds;
+    for (const auto& child : running) {
+      for (int stream = 0; stream < 2; stream++) {
+        struct pollfd fd;
+        fd.fd = child.fds[stream];
+        fd.events = POLLIN;
+        fd.revents = 0;
+        fds.push_back(fd);
+      }
+    }
+
+    if (poll(fds.data(), fds.size(), -1) == -1) {
+      if (errno == EINTR) continue;
+      print_error("run_processes() ==> Could not wait for the output of the running processes.\n");
+
+      // No child is left behind, a zombie or open pipe each, in a long running dugitd
+      for (auto& child : running) {
+        for (int stream = 0; stream < 2; stream++) {
+          if (child.fds[stream] != -1)
+            close(child.fds[stream]);
+        }
+
+        kill(child.pid, SIGTERM);
+        results[child.index].exit_status = wait_process(child.pid);
+      } return false;
+    }
+
+    for (size_t child = 0; child < running.size(); child++) {
+      for (int stream = 0; stream < 2; stream++) {
+        const struct pollfd& fd = fds[child * 2 + stream];
+        if (fd.fd == -1 || fd.revents == 0)
+          continue;
+
+        ssize_t count = read(fd.fd, buffer.data(), buffer.size());
+        ProcessResult& result = results[running[child].index];
+        if (count > 0)
+          (stream == 0 ? result.out : result.err).append(buffer.data(), count);
+        else if (count == 0 || errno != EINTR) {
+          close(running[child].fds[stream]);
+          running[child].fds[stream] = -1;
+        }
+      }
+    }
+
+    // Reap children whose streams are both closed
+    for (size_t child = 0; child < running.size();) {
+      if (running[child].fds[0] != -1 || running[child].fds[1] != -1) {
+        child++;
+        continue;
+      }
+
+      ProcessResult& result = results[running[child].index];
+      result.exit_status = wait_process(running[child].pid);
+      if (result.exit_status != 0)
+        all_succeeded = false;
+      running.erase(running.begin() + child);
+    }
+  }
+
+  return all_succeeded;
+}
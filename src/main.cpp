@@ -1,12 +1,20 @@
 #include "include.h"
 #include "git.h"
 #include "session.h"
+#include "service.h"
 
 Session* session;
 
 // SIGINT Handler
 void sig_handler (int signum) {
   std::cout << "\nSignal Interrupt Sequence...\n";
+
+  // Running syncs finish and clean up after themselves, no new ones start
+  if (interrupt_fleet()) {
+    std::cout << "Finishing the syncs that are running...\n";
+    return;
+  }
+
   std::cout << session << std::endl;
 
   // Terminate program sequence
@@ -27,11 +35,24 @@ int main (int argc, char* argv[]) {
 
   // Signal handler
   signal(SIGINT, sig_handler);
+
+  // A dead git coprocess must not kill dugit on write
+  signal(SIGPIPE, SIG_IGN);
+
+  // Fleet mode runs a session of its own for every repository
+  if (is_fleet_command(args))
+    return fleet_sync(args) ? 0 : 1;
+
+  // Let a running dugitd do the work, it has everything loaded already
+  if (!args.empty() && std::find(service_commands.begin(), service_commands.end(), args.front()) != service_commands.end() &&
+  forward_to_service(args))
+    return 0;
+
   session = new Session;
   if (session == NULL) return 1;
 
-  // Perform Startup Sequence
-  if (session->session_startup_sequence())
+  // Perform Startup Sequence, help, version and examples need none and never wait for the lock
+  if (is_read_only_command(args) || session->session_startup_sequence())
     // Execute args
     session->args_parser(args);
   
@@ -0,0 +1,75 @@
+#include "include.h"
+#include "service.h"
+
+Service* service;
+
+// SIGINT/SIGTERM Handler
+void sig_handler (int) {
+  // Clean up every session (locks, stashes) before leaving
+  if (service != NULL) {
+    service->stop();
+    service = NULL;
+  } exit(0);
+}
+
+// Leave the terminal dugitd was started from
+static bool detach () {
+  /*
+    Without a controlling terminal, a
+    prompt read from a client's terminal
+    never stops dugitd with SIGTTIN, and
+    closing the terminal it was started
+    from does not hang it up. A process
+    group leader (dugitd & in a shell
+    with job control) cannot start a
+    session of its own, so it forks, and
+    the parent leaves.
+  */
+
+  if (setsid() == -1) {
+    pid_t pid = fork();
+    if (pid == -1)
+      return false;
+    if (pid > 0)
+      _exit(0);
+    if (setsid() == -1)
+      return false;
+  }
+
+  int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (null_fd != -1) {
+    dup2(null_fd, STDIN_FILENO);
+    close(null_fd);
+  } return true;
+}
+
+int main (int argc, char* argv[]) {
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  // A client that went away must not kill the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  service = new Service;
+  if (!service->start()) {
+    delete(service);
+    return 1;
+  }
+
+  std::cout << "dugitd listening on " << service->socket_path << std::endl;
+  if (!detach())
+    print_error("main() ==> Could not leave the terminal, prompts may stop dugitd.\n");
+
+  // dugitd <repository>..., serve (and autosync) these without waiting for a command
+  for (int arg = 1; arg < argc; arg++) {
+    if (!service->open(argv[arg])) {
+      std::string err_msg = std::string("main() ==> Could not open repository: ") + argv[arg] + '\n';
+      print_error(err_msg.c_str());
+    }
+  }
+  service->run();
+
+  delete(service);
+  service = NULL;
+  return 0;
+}
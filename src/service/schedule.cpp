@@ -0,0 +1,197 @@
+#include "service.h"
+
+// Longest a failing remote is left out
+static const uint64_t autosync_max_backoff = 24 * 60 * 60;
+
+// What an autosync runs, it must never stop for input nor leave a merge behind
+static const std::vector<std::string> autosync_args = {
+  "sync",
+  "--isolated",
+  "--no-warning",
+  "--auto-message",
+  "--abort-merge",
+};
+
+// Seconds on the monotonic clock
+uint64_t service_clock () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+TimerWheel::TimerWheel () {
+  this->slots.resize(slot_count);
+  this->tick = service_clock();
+  this->count = 0;
+}
+
+// Schedule key delay seconds from the last processed second
+void TimerWheel::schedule (const std::string& key, const uint64_t delay) {
+  uint64_t ticks = std::max<uint64_t>(delay, 1);
+
+  TimerEntry entry;
+  entry.key = key;
+  entry.rounds = (ticks - 1) / slot_count;
+  this->slots[(this->tick + ticks) % slot_count].push_back(entry);
+  this->count++;
+}
+
+// Expire every timer due up to now
+void TimerWheel::advance (const uint64_t now, std::vector<std::string>& due) {
+  while (this->tick < now) {
+    this->tick++;
+
+    std::vector<TimerEntry>& slot = this->slots[this->tick % slot_count];
+    for (size_t entry = 0; entry < slot.size();) {
+      if (slot[entry].rounds > 0) {
+        slot[entry++].rounds--;
+        continue;
+      }
+
+      due.push_back(slot[entry].key);
+      slot[entry] = slot.back();
+      slot.pop_back();
+      this->count--;
+    }
+  }
+}
+
+Autosync::Autosync () {
+  this->interval = 900;
+  this->jitter = 60;
+  this->quiet = 120;
+}
+
+// Whether autosync is enabled for the repository
+bool Autosync::load (const std::string& toplevel_path) {
+  std::string git_dir;
+  std::string common_dir;
+  GitConfig config;
+  if (!get_git_dirs(toplevel_path, git_dir, common_dir) || !config.load(git_dir, common_dir))
+    return false;
+
+  std::string value;
+  if (!config.get("dugit.autosync", value) || !config_bool(value, true))
+    return false;
+
+  if (config.get("dugit.autosyncinterval", value))
+    this->interval = std::max<uint64_t>(std::strtoull(value.c_str(), NULL, 10), 10);
+  if (config.get("dugit.autosyncjitter", value))
+    this->jitter = std::strtoull(value.c_str(), NULL, 10);
+  if (config.get("dugit.autosyncquiet", value))
+    this->quiet = std::strtoull(value.c_str(), NULL, 10);
+  return true;
+}
+
+// Uniform in [0, limit)
+uint64_t Service::random_delay (const uint64_t limit) {
+  if (limit == 0)
+    return 0;
+  return std::uniform_int_distribution<uint64_t>(0, limit - 1)(this->random);
+}
+
+// Schedule autosync for a repository that has it enabled
+void Service::register_autosync (const std::string& toplevel_path) {
+  /*
+    The first sync of a repository lands
+    anywhere within its interval, so the
+    repositories of a daemon started at
+    boot, or of many machines started at
+    once, do not all sync together.
+  */
+
+  if (this->autosyncs.find(toplevel_path) != this->autosyncs.end())
+    return;
+
+  Autosync autosync;
+  if (!autosync.load(toplevel_path))
+    return;
+
+  this->wheel.schedule(toplevel_path, this->random_delay(autosync.interval) + 1);
+  this->autosyncs[toplevel_path] = autosync;
+}
+
+// Sync a repository whose timer expired, and schedule the next one
+void Service::run_autosync (const std::string& toplevel_path) {
+  /*
+    The configuration is read again every
+    time, turning dugit.autosync off ends
+    the schedule. A sync is put off while
+    someone is editing the working tree.
+    Every remote that fails is left out
+    for interval * 2^failures seconds (at
+    most a day), and is tried again
+    once that has passed.
+  */
+
+  auto found = this->autosyncs.find(toplevel_path);
+  if (found == this->autosyncs.end())
+    return;
+
+  Autosync autosync;
+  if (!autosync.load(toplevel_path)) {
+    this->autosyncs.erase(found);
+    return;
+  }
+  autosync.backoff = found->second.backoff;
+
+  uint64_t now = service_clock();
+  auto tracker = this->trackers.find(toplevel_path);
+  if (tracker != this->trackers.end()) {
+    tracker->second->drain();
+    uint64_t idle = now - std::min(now, tracker->second->last_change);
+    if (tracker->second->last_change != 0 && idle < autosync.quiet) {
+      std::cout << "Autosync of " << toplevel_path << " put off, the working tree changed " << idle << "s ago" << std::endl;
+      this->wheel.schedule(toplevel_path, autosync.quiet - idle);
+      found->second = autosync;
+      return;
+    }
+  }
+
+  // dugitd serves everyone, it does not wait behind a dugit run by hand
+  auto open_session = this->sessions.find(toplevel_path);
+  if (open_session != this->sessions.end()) {
+    FileLock probe;
+    if (!probe.try_acquire(open_session->second->lock_path(), true, "") && probe.contended) {
+      std::cout << "Autosync of " << toplevel_path << " put off, another dugit holds the lock" << std::endl;
+      this->wheel.schedule(toplevel_path, autosync.quiet);
+      found->second = autosync;
+      return;
+    }
+  }
+
+  Session* session = this->get_session(toplevel_path);
+  if (session == NULL) {
+    this->autosyncs.erase(toplevel_path);
+    return;
+  }
+
+  for (const auto& remote : autosync.backoff) {
+    if (remote.second.retry_at > now)
+      session->skipped_remotes.insert(remote.first);
+  }
+
+  std::cout << "Autosync of " << toplevel_path << std::endl;
+  this->run_command(session, autosync_args, -1);
+
+  // Back off from the remotes that failed, forget the ones that worked
+  for (const auto& remote : session->remotes) {
+    if (session->skipped_remotes.count(remote->name))
+      continue;
+    if (!session->failed_remotes.count(remote->name)) {
+      autosync.backoff.erase(remote->name);
+      continue;
+    }
+
+    RemoteBackoff& backoff = autosync.backoff[remote->name];
+    backoff.failures = std::min<uint32_t>(backoff.failures + 1, 32);
+    uint64_t delay = autosync.interval << std::min<uint32_t>(backoff.failures, 16);
+    backoff.retry_at = now + std::min(delay, autosync_max_backoff);
+    std::cout << "Autosync of " << toplevel_path << " leaves " << remote->name << " out for " <<
+      std::min(delay, autosync_max_backoff) << "s after " << backoff.failures << " failure(s)" << std::endl;
+  }
+
+  this->track(session);
+  this->wheel.schedule(toplevel_path, autosync.interval + this->random_delay(autosync.jitter + 1));
+  this->autosyncs[toplevel_path] = autosync;
+}
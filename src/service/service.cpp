@@ -1 +1,578 @@
-#include "service.h"
\ No newline at end of file
+#include "service.h"
+
+#include <poll.h>
+#include <stdio_ext.h>
+#include <thread>
+
+extern char** environ;
+
+// Largest request a client may send (environment, working path and args)
+static const uint32_t service_max_request = 1 << 20;
+
+// Socket dugitd listens on
+std::string get_service_socket_path () {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir != NULL && *runtime_dir != '\0')
+    return std::string(runtime_dir) + "/dugitd.sock";
+  return "/tmp/dugitd-" + std::to_string(getuid()) + ".sock";
+}
+
+// Fill a unix socket address, false if the path does not fit
+static bool service_address (const std::string& path, struct sockaddr_un& address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    return false;
+  memcpy(address.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+// Write all bytes to a socket
+static bool service_write (const int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t count = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    written += count;
+  } return true;
+}
+
+// Read exactly length bytes from a socket
+static bool service_read (const int fd, char* data, const size_t length) {
+  size_t done = 0;
+  while (done < length) {
+    ssize_t count = read(fd, data + done, length - done);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    done += count;
+  } return true;
+}
+
+// Append a length prefixed string to a request
+static void service_string (std::string& request, const std::string& value) {
+  uint32_t length = value.size();
+  request.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  request.append(value);
+}
+
+// Append a u32 count and that many length prefixed strings to a request
+static void service_strings (std::string& request, const std::vector<std::string>& values) {
+  uint32_t count = values.size();
+  request.append(reinterpret_cast<const char*>(&count), sizeof(count));
+  for (const auto& value : values)
+    service_string(request, value);
+}
+
+// Read a u32 count and that many length prefixed strings from a request body
+static bool service_parse_strings (const std::string& body, size_t& position, std::vector<std::string>& values) {
+  uint32_t count;
+  if (body.size() - position < sizeof(count))
+    return false;
+  memcpy(&count, body.data() + position, sizeof(count));
+  position += sizeof(count);
+
+  for (uint32_t value = 0; value < count; value++) {
+    uint32_t length;
+    if (body.size() - position < sizeof(length))
+      return false;
+    memcpy(&length, body.data() + position, sizeof(length));
+    position += sizeof(length);
+    if (body.size() - position < length)
+      return false;
+    values.push_back(body.substr(position, length));
+    position += length;
+  } return true;
+}
+
+// The environment of this process, as NAME=value entries
+static std::vector<std::string> service_environment () {
+  std::vector<std::string> environment;
+  for (char** entry = environ; *entry != NULL; entry++)
+    environment.push_back(*entry);
+  return environment;
+}
+
+// Replace the environment of this process
+static void service_set_environment (const std::vector<std::string>& environment) {
+  clearenv();
+  for (const auto& entry : environment) {
+    size_t equals = entry.find('=');
+    if (equals != std::string::npos && equals != 0)
+      setenv(entry.substr(0, equals).c_str(), entry.c_str() + equals + 1, 1);
+  }
+}
+
+// Interrupts a blocked read of the command thread, nothing else
+static void service_wake (int) {}
+
+// Wait until the client hangs up, stopping its command, or until stop_fd is closed
+static void service_watch_client (const int client_fd, const int stop_fd, const pthread_t command_thread) {
+  /*
+    The client sends nothing after its
+    request, the socket only becomes
+    readable once it is gone (Ctrl-C).
+    Its command then runs no new git,
+    reads end of input and writes to
+    nowhere, and a prompt it is waiting
+    on is woken up, so it fails its way
+    back and cleans up like dugit does
+    on SIGINT.
+  */
+
+  struct pollfd fds[2];
+  fds[0].fd = client_fd;
+  fds[0].events = POLLIN | POLLRDHUP;
+  fds[1].fd = stop_fd;
+  fds[1].events = POLLIN;
+
+  while (poll(fds, 2, -1) == -1) {
+    if (errno != EINTR)
+      return;
+  }
+  if (fds[1].revents != 0 || fds[0].revents == 0)
+    return;
+
+  interrupt_processes(true);
+  interrupt_fleet();
+
+  int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null_fd != -1) {
+    for (int stream = 0; stream < 3; stream++)
+      dup2(null_fd, stream);
+    close(null_fd);
+  }
+
+  pthread_kill(command_thread, SIGUSR1);
+}
+
+// Client side, run args in a running dugitd
+bool forward_to_service (const std::vector<std::string>& args) {
+  /*
+    Request layout, native byte order
+    (both ends are on the same machine),
+    u32 length of the rest, u32 umask,
+    then two lists of strings, each a
+    u32 count and that many strings (u32
+    length and bytes). The first is the
+    environment (NAME=value), the second
+    the working path followed by the
+    args. The client's stdin, stdout and
+    stderr travel with the first byte.
+  */
+
+  const char* disabled = getenv("DUGIT_NO_SERVICE");
+  if (disabled != NULL && *disabled != '\0')
+    return false;
+
+  struct sockaddr_un address;
+  if (!service_address(get_service_socket_path(), address))
+    return false;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return false;
+
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+    close(fd);
+    return false;
+  }
+
+  std::string* working_path = get_cwd();
+  if (working_path == NULL) {
+    close(fd);
+    return false;
+  }
+
+  // The command runs with our environment and umask, not the daemon's
+  mode_t mask = umask(0);
+  umask(mask);
+  uint32_t mask_value = mask;
+
+  std::vector<std::string> strings = {*working_path};
+  delete(working_path);
+  strings.insert(strings.end(), args.begin(), args.end());
+
+  std::string body;
+  body.append(reinterpret_cast<const char*>(&mask_value), sizeof(mask_value));
+  service_strings(body, service_environment());
+  service_strings(body, strings);
+
+  std::string request;
+  uint32_t length = body.size();
+  request.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  request.append(body);
+
+  // Hand over the standard streams with the first byte
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(request.data());
+  iov.iov_len = 1;
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+  ssize_t sent;
+  do sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+  while (sent == -1 && errno == EINTR);
+
+  if (sent != 1 || !service_write(fd, request.substr(1))) {
+    close(fd);
+    return false;
+  }
+
+  // Wait for the status byte, the output itself goes straight to our streams
+  char status;
+  if (!service_read(fd, &status, 1))
+    print_error("forward_to_service() ==> dugitd stopped before the command finished.\n");
+
+  // Even then the command was handed over, it must not run a second time here
+  close(fd);
+  return true;
+}
+
+Service::Service () {
+  this->listen_fd = -1;
+  this->random.seed(std::random_device()());
+}
+
+Service::~Service () {
+  this->stop();
+}
+
+// Bind the socket
+bool Service::start () {
+  this->socket_path = get_service_socket_path();
+
+  struct sockaddr_un address;
+  if (!service_address(this->socket_path, address)) {
+    std::string err_msg = "Service::start() ==> Socket path is too long: " + this->socket_path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  this->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (this->listen_fd == -1) {
+    print_error("Service::start() ==> Could not create socket.\n");
+    return false;
+  }
+
+  // A socket nobody answers on is left over from a daemon that died
+  if (connect(this->listen_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0) {
+    std::string err_msg = "Service::start() ==> dugitd is already running on: " + this->socket_path + '\n';
+    print_error(err_msg.c_str());
+    close(this->listen_fd);
+    this->listen_fd = -1;
+    return false;
+  }
+
+  close(this->listen_fd);
+  this->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(this->socket_path.c_str());
+
+  // SIGUSR1 only wakes a command blocked on the terminal of a client that hung up
+  struct sigaction wake;
+  memset(&wake, 0, sizeof(wake));
+  wake.sa_handler = service_wake;
+  sigaction(SIGUSR1, &wake, NULL);
+
+  // Only the owner may connect
+  mode_t mask = umask(0077);
+  bool bound = bind(this->listen_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+  umask(mask);
+
+  if (!bound || listen(this->listen_fd, 16) != 0) {
+    std::string err_msg = "Service::start() ==> Could not listen on: " + this->socket_path + '\n';
+    print_error(err_msg.c_str());
+    close(this->listen_fd);
+    this->listen_fd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+// Accept and run commands until stopped
+void Service::run () {
+  while (this->listen_fd != -1) {
+    // Wait for a client, reading working tree events meanwhile
+    std::vector<struct pollfd> pollfds(1);
+    pollfds[0].fd = this->listen_fd;
+    pollfds[0].events = POLLIN;
+    for (const auto& tracker : this->trackers) {
+      struct pollfd pollfd;
+      pollfd.fd = tracker.second->inotify_fd;
+      pollfd.events = POLLIN;
+      if (pollfd.fd != -1)
+        pollfds.push_back(pollfd);
+    }
+
+    // Wake up every second while autosyncs are scheduled
+    if (poll(pollfds.data(), pollfds.size(), this->wheel.count > 0 ? 1000 : -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (const auto& tracker : this->trackers)
+      tracker.second->drain();
+
+    std::vector<std::string> due;
+    this->wheel.advance(service_clock(), due);
+    for (const auto& toplevel : due)
+      this->run_autosync(toplevel);
+
+    if (!(pollfds[0].revents & POLLIN))
+      continue;
+
+    int client_fd = accept4(this->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+
+    // Only processes of the same user are served
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid())
+      this->handle(client_fd);
+    close(client_fd);
+  }
+}
+
+// Stop listening and clean up every session
+void Service::stop () {
+  if (this->listen_fd != -1) {
+    close(this->listen_fd);
+    this->listen_fd = -1;
+    unlink(this->socket_path.c_str());
+  }
+
+  for (auto& session : this->sessions)
+    delete(session.second);
+  this->sessions.clear();
+
+  for (auto& tracker : this->trackers)
+    delete(tracker.second);
+  this->trackers.clear();
+}
+
+// Find or start the session of the repository containing working_path
+Session* Service::get_session (const std::string& working_path) {
+  std::string* toplevel_path = get_toplevel_path_manually(working_path);
+  if (toplevel_path == NULL)
+    return NULL;
+
+  std::string toplevel = *toplevel_path;
+  delete(toplevel_path);
+
+  auto found = this->sessions.find(toplevel);
+  if (found != this->sessions.end()) {
+    if (found->second->session_resume_sequence())
+      return found->second;
+
+    // Start over if the repository changed beyond what resuming handles
+    delete(found->second);
+    this->sessions.erase(found);
+  }
+
+  Session* session = new Session;
+  if (!session->session_startup_sequence(working_path) || !session->prepare(stage_repository)) {
+    delete(session);
+    return NULL;
+  }
+
+  this->sessions[toplevel] = session;
+  return session;
+}
+
+// Run a single client's command
+bool Service::handle (const int client_fd) {
+  // First byte, with the client's standard streams
+  char first;
+  int fds[3] = {-1, -1, -1};
+  char control[CMSG_SPACE(sizeof(fds))];
+
+  struct iovec iov;
+  iov.iov_base = &first;
+  iov.iov_len = 1;
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t received;
+  do received = recvmsg(client_fd, &message, MSG_CMSG_CLOEXEC);
+  while (received == -1 && errno == EINTR);
+  if (received != 1)
+    return false;
+
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  if (header == NULL || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(fds)))
+    return false;
+  memcpy(fds, CMSG_DATA(header), sizeof(fds));
+
+  // Rest of the length, then the body
+  char length_bytes[sizeof(uint32_t)];
+  length_bytes[0] = first;
+  uint32_t length = 0;
+  std::string body;
+  bool valid = service_read(client_fd, length_bytes + 1, sizeof(length_bytes) - 1);
+  if (valid) {
+    memcpy(&length, length_bytes, sizeof(length));
+    valid = length >= sizeof(uint32_t) && length <= service_max_request;
+  }
+  if (valid) {
+    body.resize(length);
+    valid = service_read(client_fd, &body[0], length);
+  }
+
+  uint32_t mask = 0;
+  std::vector<std::string> environment;
+  std::vector<std::string> strings;
+  if (valid) {
+    memcpy(&mask, body.data(), sizeof(mask));
+    size_t position = sizeof(mask);
+    valid = service_parse_strings(body, position, environment) && service_parse_strings(body, position, strings);
+  }
+
+  if (!valid || strings.empty()) {
+    for (int fd : fds) close(fd);
+    return false;
+  }
+
+  // Run with the client's streams as our own
+  fflush(stdout);
+  fflush(stderr);
+  int saved[3] = {fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0), fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0), fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0)};
+  for (int stream = 0; stream < 3; stream++) {
+    dup2(fds[stream], stream);
+    close(fds[stream]);
+  }
+  __fpurge(stdin);
+  clearerr(stdin);
+  std::cin.clear();
+
+  // And with the client's environment (GIT_*, SSH_AUTH_SOCK, PATH...) and umask
+  std::vector<std::string> saved_environment = service_environment();
+  service_set_environment(environment);
+  mode_t saved_mask = umask(mask & 0777);
+
+  std::string working_path = strings.front();
+  std::vector<std::string> args(strings.begin() + 1, strings.end());
+
+  bool succeeded = false;
+  Session* session = this->get_session(working_path);
+  if (session != NULL)
+    succeeded = this->run_command(session, args, client_fd);
+
+  umask(saved_mask);
+  service_set_environment(saved_environment);
+
+  std::cout.flush();
+  fflush(stdout);
+  fflush(stderr);
+  for (int stream = 0; stream < 3; stream++) {
+    dup2(saved[stream], stream);
+    close(saved[stream]);
+  }
+
+  char status = succeeded ? 0 : 1;
+  bool replied = service_write(client_fd, std::string(1, status));
+
+  // The client has its answer, catch up with the working tree now
+  if (session != NULL) {
+    this->track(session);
+    this->register_autosync(session->toplevel_path);
+  } return replied;
+}
+
+// Run args in a session that get_session made ready, stopping if client_fd (-1 for none) hangs up
+bool Service::run_command (Session* session, const std::vector<std::string>& args, const int client_fd) {
+  auto tracker = this->trackers.find(session->toplevel_path);
+  if (tracker != this->trackers.end())
+    session->dirty_paths = tracker->second->prepare();
+
+  int stop_pipe[2] = {-1, -1};
+  std::thread watch;
+  if (client_fd != -1 && pipe2(stop_pipe, O_CLOEXEC) == 0)
+    watch = std::thread(service_watch_client, client_fd, stop_pipe[0], pthread_self());
+
+  bool succeeded = session->args_parser(args);
+
+  // Clean up runs git again, whether or not the client is still there
+  if (watch.joinable()) {
+    close(stop_pipe[1]);
+    watch.join();
+    close(stop_pipe[0]);
+  }
+  if (interrupt_processes(false))
+    succeeded = false;
+
+  session->clean_up();
+  session->dirty_paths = NULL;
+  return succeeded;
+}
+
+// Serve a repository from the start, without waiting for a client
+bool Service::open (const std::string& working_path) {
+  Session* session = this->get_session(working_path);
+  if (session == NULL || !session->prepare(stage_objects))
+    return false;
+
+  session->clean_up();
+  this->track(session);
+  this->register_autosync(session->toplevel_path);
+  return true;
+}
+
+// Start watching, or catch up with, the working tree of a session
+void Service::track (Session* session) {
+  /*
+    The first command of a repository runs
+    without a watch, the watch and its
+    full status happen after it, off the
+    client's time. A tracker that could
+    not be set up is dropped, and the
+    session goes back to scanning. What
+    the command itself changed in the
+    working tree is no user activity.
+  */
+
+  DirtyTracker*& tracker = this->trackers[session->toplevel_path];
+  bool tracking;
+  if (tracker == NULL) {
+    tracker = new DirtyTracker;
+    tracking = tracker->start(session->toplevel_path, session->git_dir, session->common_dir);
+  } else {
+    uint64_t last_change = tracker->last_change;
+    tracking = tracker->refresh();
+    tracker->last_change = last_change;
+  }
+
+  if (!tracking && tracker->failed) {
+    delete(tracker);
+    this->trackers.erase(session->toplevel_path);
+  }
+}
@@ -5,22 +5,12 @@
   running the dugit background
   service.
 
-  For the time being, this is
-  not a priority for dugit to
-  function manually. Later, I
-  am thinking to create a
-  boot-up service to revive
-  unfinished cron jobs,
-  regarding scheduled autosync
-  and obviously implied, to use
-  crontab for running autosync
-  jobs.
-
-  It's either this, or I will
-  create a single constantly
-  running service that will 
-  do these autosync jobs itself,
-  without crontab.  
+  dugitd is the single constantly
+  running service, it keeps the
+  sessions of the dugit commands
+  warm, and does the scheduled
+  autosync jobs itself, without
+  crontab.
 */
 
 // service.h
@@ -28,5 +18,216 @@
 #define SERVICE_H
 
 #include "include.h"
+#include "session.h"
+
+#include <random>
+#include <sys/un.h>
+
+// Commands dugit hands to a running dugitd
+const std::vector<std::string> service_commands = {
+  "sync",
+  "commit",
+};
+
+// Socket dugitd listens on, $XDG_RUNTIME_DIR/dugitd.sock or /tmp/dugitd-<uid>.sock
+std::string get_service_socket_path();
+
+// Client side, run args in a running dugitd (false if none could be reached)
+bool forward_to_service(const std::vector<std::string>& args);
+
+// Seconds on the monotonic clock
+uint64_t service_clock();
+
+struct DirtyTracker {
+  /*
+    Watches a working tree with inotify
+    (fanotify needs CAP_SYS_ADMIN, which
+    dugitd has no business holding) and
+    keeps the paths that may be dirty, so
+    a command only has git look at those.
+
+    Ignored directories, as listed by git
+    when watching starts, are not watched.
+    A queue overflow, a moved directory
+    or an edited .gitignore leave the set
+    in doubt until the next full rescan.
+  */
+
+  std::string toplevel_path;
+  std::string git_dir;
+  std::string common_dir;
+
+  // inotify instance, and the relative directory ("" or "dir/") of every watch
+  int inotify_fd;
+  std::unordered_map<int, std::string> watches;
+
+  // Ignored directories ("dir/"), never watched
+  std::unordered_set<std::string> ignored_dirs;
+
+  // Paths with events since dirty_paths was last computed
+  std::unordered_set<std::string> changed;
+  DirtyPaths dirty_paths;
+
+  // Submodule paths in the index dirty_paths was computed against
+  std::vector<std::string> gitlinks;
+
+  // Watches may be stale (overflow, moves, ignore rules), or could not all be added
+  bool rescan_needed;
+  bool failed;
+
+  // When the working tree was last changed by someone else than dugitd (service_clock)
+  uint64_t last_change;
+
+  DirtyTracker();
+  ~DirtyTracker();
+
+  // Watch the working tree and take the first full status
+  bool start(const std::string& toplevel_path, const std::string& git_dir, const std::string& common_dir);
+  void stop();
+  bool rescan();
+
+  void watch_tree(const std::string& directory, const bool report);
+  bool is_ignored(const std::string& path);
+  void mark(const std::string& path);
+
+  // Read every queued event
+  void drain();
+
+  // Dirty paths for the next command (NULL if in doubt), and exact again after it
+  const DirtyPaths* prepare();
+  bool refresh();
+};
+
+struct TimerEntry {
+  std::string key;
+
+  // Turns of the wheel left before it is due
+  uint64_t rounds;
+};
+
+struct TimerWheel {
+  /*
+    A hashed timing wheel with one second
+    slots. Scheduling and expiring are
+    O(1) per timer however many there
+    are, a timer further out than one
+    turn waits its remaining turns in
+    its slot.
+  */
+
+  static const uint32_t slot_count = 256;
+  std::vector<std::vector<TimerEntry>> slots;
+
+  // Last second processed, and timers pending
+  uint64_t tick;
+  size_t count;
+
+  TimerWheel();
+
+  void schedule(const std::string& key, const uint64_t delay);
+
+  // Expire every timer due up to now
+  void advance(const uint64_t now, std::vector<std::string>& due);
+};
+
+struct RemoteBackoff {
+  uint32_t failures;
+  uint64_t retry_at;
+};
+
+struct Autosync {
+  /*
+    Read from the repository's git config,
+
+      dugit.autosync          true to enable
+      dugit.autosyncInterval  seconds between syncs (900)
+      dugit.autosyncJitter    up to this many more seconds, at random (60)
+      dugit.autosyncQuiet     seconds the working tree must have been left
+                              alone before syncing (120)
+  */
+
+  uint64_t interval;
+  uint64_t jitter;
+  uint64_t quiet;
+
+  // Remotes that failed, left out until retry_at
+  std::unordered_map<std::string, RemoteBackoff> backoff;
+
+  Autosync();
+
+  // Whether autosync is enabled for the repository
+  bool load(const std::string& toplevel_path);
+};
+
+struct Service {
+  /*
+    dugitd keeps one Session per
+    repository alive between commands,
+    with its snapshot, configuration and
+    cat-file coprocess already loaded.
+
+    A client connects to the socket and
+    sends its working directory and args
+    along with its environment, umask and
+    own stdin, stdout and stderr (SCM_
+    RIGHTS). The command runs with those
+    as the daemon's, so output and
+    prompts go straight to the client's
+    terminal, and a single status byte is
+    written back when it is done. A
+    client that hangs up stops its
+    command. Commands are run one at a
+    time.
+
+    Between commands the daemon reads the
+    inotify queues of every working tree
+    it serves, so they do not overflow
+    while it is idle, and runs the
+    autosyncs that are due.
+  */
+
+  // Socket path and listening descriptor
+  std::string socket_path;
+  int listen_fd;
+
+  // Warm sessions, their working tree watches and autosyncs, by repository toplevel path
+  std::unordered_map<std::string, Session*> sessions;
+  std::unordered_map<std::string, DirtyTracker*> trackers;
+  std::unordered_map<std::string, Autosync> autosyncs;
+
+  // Autosync timers, and where their jitter comes from
+  TimerWheel wheel;
+  std::mt19937_64 random;
+
+  Service();
+  ~Service();
+
+  // Bind the socket, refusing to replace a daemon that is still alive
+  bool start();
+
+  // Accept and run commands until stopped
+  void run();
+  void stop();
+
+  // Run a single client's command
+  bool handle(const int client_fd);
+
+  // Run args in a session that get_session made ready, stopping if client_fd (-1 for none) hangs up
+  bool run_command(Session* session, const std::vector<std::string>& args, const int client_fd);
+
+  // Serve a repository from the start, without waiting for a client
+  bool open(const std::string& working_path);
+
+  // Start watching, or catch up with, the working tree of a session
+  void track(Session* session);
+
+  // Schedule autosync for a repository that has it enabled, and run one when due
+  void register_autosync(const std::string& toplevel_path);
+  void run_autosync(const std::string& toplevel_path);
+  uint64_t random_delay(const uint64_t limit);
+
+  // Find or start the session of the repository containing working_path
+  Session* get_session(const std::string& working_path);
+};
 
 #endif
\ No newline at end of file
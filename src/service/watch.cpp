@@ -0,0 +1,333 @@
+#include "service.h"
+
+#include <dirent.h>
+#include <sys/inotify.h>
+
+/*
+  Directory events that can make a path
+  differ from what git last reported.
+  Watches are per directory, inotify has
+  no recursive mode, so every directory
+  below the toplevel that is not .git or
+  ignored gets a watch of its own.
+*/
+static const uint32_t watch_mask = IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+// Paths of the gitlinks in the index, whose drift no working tree event shows
+static bool index_gitlinks (const std::string& git_dir, const std::string& common_dir, std::vector<std::string>& gitlinks) {
+  gitlinks.clear();
+
+  GitConfig config;
+  if (!config.load(git_dir, common_dir))
+    return false;
+
+  std::string value;
+  uint32_t hash_size = config.get("extensions.objectformat", value) && value == "sha256" ? 32 : 20;
+
+  // No index yet means no gitlinks yet
+  GitIndex index;
+  if (!index.load(git_dir, hash_size))
+    return errno == ENOENT;
+
+  for (const auto& entry : index.entries) {
+    if ((entry.mode & 0170000) == 0160000 && (gitlinks.empty() || gitlinks.back() != entry.path))
+      gitlinks.push_back(entry.path);
+  } return true;
+}
+
+DirtyTracker::DirtyTracker () {
+  this->inotify_fd = -1;
+  this->rescan_needed = true;
+  this->failed = false;
+  this->last_change = 0;
+}
+
+DirtyTracker::~DirtyTracker () {
+  this->stop();
+}
+
+// Close the inotify instance, which drops every watch
+void DirtyTracker::stop () {
+  if (this->inotify_fd != -1) {
+    close(this->inotify_fd);
+    this->inotify_fd = -1;
+  }
+
+  this->watches.clear();
+  this->ignored_dirs.clear();
+  this->changed.clear();
+  this->dirty_paths = DirtyPaths();
+  this->gitlinks.clear();
+  this->rescan_needed = true;
+}
+
+// Watch the working tree and take the first full status
+bool DirtyTracker::start (const std::string& toplevel_path, const std::string& git_dir, const std::string& common_dir) {
+  /*
+    Watches go in before git status runs,
+    so a change made while it runs is
+    either in its output or in the queue.
+  */
+
+  this->stop();
+  this->toplevel_path = toplevel_path;
+  this->git_dir = git_dir;
+  this->common_dir = common_dir;
+  this->failed = false;
+
+  this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (this->inotify_fd == -1) {
+    print_error("DirtyTracker::start() ==> Could not create an inotify instance.\n");
+    this->failed = true;
+    return false;
+  }
+
+  // Ignored directories are collapsed into a single dir/ entry
+  ProcessResult result;
+  if (!run_process({"git", "ls-files", "-z", "--others", "--ignored", "--exclude-standard", "--directory"}, toplevel_path, result)) {
+    std::string err_msg = "DirtyTracker::start() ==> Could not list ignored paths at path: " + toplevel_path + '\n' + result.err;
+    print_error(err_msg.c_str());
+    this->failed = true;
+    return false;
+  }
+
+  size_t position = 0;
+  while (position < result.out.size()) {
+    size_t end = result.out.find('\0', position);
+    if (end == std::string::npos) end = result.out.size();
+    if (end > position && result.out[end - 1] == '/')
+      this->ignored_dirs.insert(result.out.substr(position, end - position));
+    position = end + 1;
+  }
+
+  this->watch_tree("", false);
+  if (this->failed)
+    return false;
+
+  this->rescan_needed = false;
+  return this->rescan();
+}
+
+// Take the dirty paths from a full git status
+bool DirtyTracker::rescan () {
+  this->changed.clear();
+
+  RepoState state;
+  if (!index_gitlinks(this->git_dir, this->common_dir, this->gitlinks) || !state.load(this->toplevel_path, this->git_dir)) {
+    this->dirty_paths.known = false;
+    return false;
+  }
+
+  this->dirty_paths.paths = state.paths();
+  this->dirty_paths.record(this->git_dir, this->common_dir);
+  return true;
+}
+
+// Watch a directory (relative, "" or "dir/") and every directory below it
+void DirtyTracker::watch_tree (const std::string& directory, const bool report) {
+  /*
+    A directory that appears after start
+    may already have files in it by the
+    time its watch is added, so with
+    report every entry found counts as
+    changed.
+  */
+
+  std::string path = this->toplevel_path + '/' + directory;
+  int watch_descriptor = inotify_add_watch(this->inotify_fd, path.c_str(), watch_mask);
+  if (watch_descriptor == -1) {
+    // Gone already, the event that removed it is on its way
+    if (errno == ENOENT || errno == ENOTDIR)
+      return;
+
+    // Out of watches (fs.inotify.max_user_watches), nothing can be vouched for
+    std::string err_msg = "DirtyTracker::watch_tree() ==> Could not watch directory: " + path + '\n';
+    print_error(err_msg.c_str());
+    this->failed = true;
+    return;
+  } this->watches[watch_descriptor] = directory;
+
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL && !this->failed) {
+    std::string name = entry->d_name;
+    if (name == "." || name == ".." || (directory.empty() && name == ".git"))
+      continue;
+
+    std::string child = directory + name;
+    if (report)
+      this->mark(child);
+
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir = lstat((path + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    if (is_dir && this->ignored_dirs.find(child + '/') == this->ignored_dirs.end())
+      this->watch_tree(child + '/', report);
+  } closedir(dir);
+}
+
+// Read every queued event into the changed set
+void DirtyTracker::drain () {
+  alignas(struct inotify_event) char buffer[16384];
+
+  while (this->inotify_fd != -1) {
+    ssize_t length = read(this->inotify_fd, buffer, sizeof(buffer));
+    if (length == -1 && errno == EINTR)
+      continue;
+    if (length <= 0)
+      break;
+
+    for (char* position = buffer; position < buffer + length;) {
+      const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(position);
+      position += sizeof(struct inotify_event) + event->len;
+
+      // Events were dropped, only a full rescan is certain again
+      if (event->mask & IN_Q_OVERFLOW) {
+        this->rescan_needed = true;
+        continue;
+      }
+
+      auto watch = this->watches.find(event->wd);
+      if (watch == this->watches.end())
+        continue;
+
+      if (event->mask & IN_IGNORED) {
+        this->watches.erase(watch);
+        continue;
+      }
+
+      if (event->len == 0)
+        continue;
+
+      std::string name = event->name;
+      if (watch->second.empty() && name == ".git")
+        continue;
+
+      std::string path = watch->second + name;
+      if (this->ignored_dirs.count(path + '/'))
+        continue;
+
+      this->mark(path);
+      this->last_change = service_clock();
+
+      // New ignore rules change which directories should be watched
+      if (name == ".gitignore")
+        this->rescan_needed = true;
+
+      if (!(event->mask & IN_ISDIR))
+        continue;
+
+      // A moved directory keeps its watches under its old name
+      if (event->mask & IN_MOVED_FROM)
+        this->rescan_needed = true;
+      else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && !this->is_ignored(path))
+        this->watch_tree(path + '/', true);
+    }
+  }
+}
+
+// Record a changed path, anything inside a submodule as the submodule itself
+void DirtyTracker::mark (const std::string& path) {
+  /*
+    git status limited to a path inside
+    a submodule says nothing, the change
+    only shows as the gitlink drifting.
+  */
+
+  for (const auto& gitlink : this->gitlinks) {
+    if (path.size() > gitlink.size() && path[gitlink.size()] == '/' && path.compare(0, gitlink.size(), gitlink) == 0) {
+      this->changed.insert(gitlink);
+      return;
+    }
+  } this->changed.insert(path);
+}
+
+// Whether a directory that appeared after start is ignored
+bool DirtyTracker::is_ignored (const std::string& path) {
+  for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+    if (this->ignored_dirs.find(path.substr(0, slash + 1)) != this->ignored_dirs.end())
+      return true;
+  }
+
+  ProcessResult result;
+  run_process({"git", "check-ignore", "-q", "--", path + '/'}, this->toplevel_path, result);
+  if (result.exit_status != 0)
+    return false;
+
+  this->ignored_dirs.insert(path + '/');
+  return true;
+}
+
+// The dirty paths for the next command, NULL if they cannot be vouched for
+const DirtyPaths* DirtyTracker::prepare () {
+  this->drain();
+  if (this->failed || this->rescan_needed || !this->dirty_paths.known)
+    return NULL;
+
+  /*
+    A commit made inside a submodule
+    moves its HEAD under the .git of the
+    superproject, which is not watched,
+    so every gitlink is always looked at.
+  */
+
+  std::unordered_set<std::string> paths(this->dirty_paths.paths.begin(), this->dirty_paths.paths.end());
+  for (const auto& path : this->changed) {
+    if (paths.insert(path).second)
+      this->dirty_paths.paths.push_back(path);
+  }
+  for (const auto& gitlink : this->gitlinks) {
+    if (paths.insert(gitlink).second)
+      this->dirty_paths.paths.push_back(gitlink);
+  }
+
+  this->changed.clear();
+  return &this->dirty_paths;
+}
+
+// Bring the dirty paths back to exactly what git reports
+bool DirtyTracker::refresh () {
+  /*
+    Run once a command is done, while
+    nobody is waiting. Only the paths
+    seen changing are given to git, the
+    rest of the tree is known to be as
+    it was. A command that rewrote the
+    index or moved HEAD, or a queue that
+    overflowed, needs the whole tree.
+  */
+
+  this->drain();
+  if (this->failed || this->rescan_needed)
+    return this->start(this->toplevel_path, this->git_dir, this->common_dir);
+  if (!this->dirty_paths.current(this->git_dir, this->common_dir))
+    return this->rescan();
+
+  std::vector<std::string> paths = this->dirty_paths.paths;
+  std::unordered_set<std::string> seen(paths.begin(), paths.end());
+  for (const auto& path : this->changed) {
+    if (seen.insert(path).second)
+      paths.push_back(path);
+  }
+  for (const auto& gitlink : this->gitlinks) {
+    if (seen.insert(gitlink).second)
+      paths.push_back(gitlink);
+  } this->changed.clear();
+
+  RepoState state;
+  if (!state.load(this->toplevel_path, this->git_dir, paths)) {
+    this->dirty_paths.known = false;
+    return false;
+  }
+
+  this->dirty_paths.paths = state.paths();
+  this->dirty_paths.record(this->git_dir, this->common_dir);
+  return true;
+}
@@ -0,0 +1,336 @@
+#include "session.h"
+
+#include <climits>
+#include <dirent.h>
+
+/*
+  Fleet mode syncs many repositories from
+  one process, a Session per repository,
+  on a WorkPool. Nobody can answer a
+  prompt for hundreds of repositories at
+  once, so every sync runs with
+  --no-warning and --auto-message, and
+  the output of each repository is kept
+  apart and printed whole once it is
+  done.
+*/
+
+// Options only fleet mode takes, with their defaults
+static const std::unordered_map<std::string, std::string> fleet_default_options = {
+  {"--repos", ""},
+  {"--fleet-jobs", "8"},
+  {"--host-jobs", "4"},
+};
+
+// Deepest directory the scan descends into
+static const uint32_t fleet_scan_depth = 16;
+
+// The pool of the fleet (or submodules) being synced, for SIGINT
+static std::atomic<WorkPool*> fleet_pool(NULL);
+
+struct FleetRepo {
+  std::string path;
+
+  // Hosts the repository fetches from or pushes to
+  std::vector<std::string> hosts;
+
+  // Newest of its index, HEAD and HEAD reflog (0 if none)
+  int64_t activity;
+
+  bool started;
+  bool succeeded;
+  double seconds;
+  std::vector<std::string> failed_remotes;
+  std::string output;
+};
+
+// Whether args ask for fleet mode (sync --repos)
+bool is_fleet_command (const std::vector<std::string>& args) {
+  if (args.empty() || args.front() != "sync")
+    return false;
+
+  for (const auto& arg : args) {
+    if (arg == "--repos" || arg.compare(0, 8, "--repos=") == 0)
+      return true;
+  } return false;
+}
+
+// Stop starting syncs, false if no fleet is running
+bool interrupt_fleet () {
+  WorkPool* pool = fleet_pool.load();
+  if (pool == NULL)
+    return false;
+  pool->stopping = true;
+  return true;
+}
+
+// The pool SIGINT stops, NULL once it is done
+void register_fleet_pool (WorkPool* pool) {
+  fleet_pool = pool;
+}
+
+// Host part of a remote url, "local" for paths
+static std::string fleet_url_host (const std::string& url) {
+  /*
+    scheme://[user@]host[:port]/path, or
+    the scp-like [user@]host:path, whose
+    colon comes before any slash.
+  */
+
+  size_t scheme = url.find("://");
+  std::string rest;
+  if (scheme != std::string::npos) {
+    if (url.compare(0, scheme, "file") == 0)
+      return "local";
+    rest = url.substr(scheme + 3);
+    rest = rest.substr(0, rest.find('/'));
+  } else {
+    size_t colon = url.find(':');
+    if (colon == std::string::npos || url.find('/') < colon)
+      return "local";
+    rest = url.substr(0, colon);
+  }
+
+  size_t at = rest.rfind('@');
+  if (at != std::string::npos)
+    rest = rest.substr(at + 1);
+  if (!rest.empty() && rest[0] == '[')
+    return rest.substr(1, rest.find(']') - 1);
+  return rest.substr(0, rest.find(':'));
+}
+
+// Read a list file, one repository per line, # comments
+static bool fleet_read_list (const std::string& path, std::vector<std::string>& repos) {
+  std::string content;
+  if (!read_file(path, content)) {
+    std::string err_msg = "fleet_read_list() ==> Could not read repository list: " + path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  for (auto line : get_lines_from_string(content)) {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty() && line[0] != '#')
+      repos.push_back(line);
+  } return true;
+}
+
+// Collect every repository below a directory, not descending into repositories
+static void fleet_scan (const std::string& path, const uint32_t depth, std::vector<std::string>& repos) {
+  struct stat st;
+  if (lstat((path + "/.git").c_str(), &st) == 0) {
+    repos.push_back(path);
+    return;
+  }
+
+  if (depth == fleet_scan_depth)
+    return;
+
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL)
+    return;
+
+  std::vector<std::string> children;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    // Symbolic links are not followed, they could loop
+    std::string child = path + '/' + entry->d_name;
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN)
+      is_dir = lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (is_dir)
+      children.push_back(child);
+  } closedir(dir);
+
+  std::sort(children.begin(), children.end());
+  for (const auto& child : children)
+    fleet_scan(child, depth + 1, repos);
+}
+
+// Newest modification time of what git touches when someone works in the repository
+static int64_t fleet_activity (const std::string& git_dir) {
+  int64_t newest = 0;
+  for (const auto& name : {"/index", "/HEAD", "/logs/HEAD"}) {
+    struct stat st;
+    if (stat((git_dir + name).c_str(), &st) == 0)
+      newest = std::max<int64_t>(newest, st.st_mtim.tv_sec);
+  } return newest;
+}
+
+// Parse a positive count option
+static uint32_t fleet_count (const std::string& value) {
+  if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.length() > 4)
+    return 0;
+  return std::stoul(value);
+}
+
+// Sync every repository of a list file or directory (sync --repos <path>)
+bool fleet_sync (const std::vector<std::string>& args) {
+  /*
+    Repositories are sorted by their last
+    activity, newest first, which is the
+    order the pool starts them in. Their
+    hosts come from the remote urls in
+    their configuration, and at most
+    --host-jobs syncs talk to the same
+    host at any time.
+  */
+
+  // Split off the fleet options, everything else goes to every sync
+  std::unordered_map<std::string, std::string> options = fleet_default_options;
+  std::vector<std::string> sync_args;
+  for (uint32_t arg = 0; arg < args.size(); arg++) {
+    std::string name = args[arg].substr(0, args[arg].find('='));
+    auto option = options.find(name);
+    if (option == options.end()) {
+      sync_args.push_back(args[arg]);
+      continue;
+    }
+
+    if (name.length() < args[arg].length())
+      option->second = args[arg].substr(name.length() + 1);
+    else if (arg + 1 < args.size())
+      option->second = args[++arg];
+    else {
+      std::string err_msg = '\"' + name + "\" option requires a value.\n";
+      print_error(err_msg.c_str());
+      return false;
+    }
+  }
+
+  uint32_t fleet_jobs = fleet_count(options.at("--fleet-jobs"));
+  uint32_t host_jobs = fleet_count(options.at("--host-jobs"));
+  if (fleet_jobs == 0 || host_jobs == 0) {
+    print_error("\"--fleet-jobs\" and \"--host-jobs\" expect a positive number.\n");
+    return false;
+  }
+
+  for (const auto& flag : {"--no-warning", "--auto-message"}) {
+    if (std::find(sync_args.begin(), sync_args.end(), flag) == sync_args.end())
+      sync_args.push_back(flag);
+  }
+
+  // Repositories, from a list file or a scan
+  std::vector<std::string> paths;
+  const std::string& source = options.at("--repos");
+  struct stat st;
+  if (stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    fleet_scan(source, 0, paths);
+  else if (!fleet_read_list(source, paths))
+    return false;
+
+  std::vector<FleetRepo> repos;
+  std::unordered_set<std::string> seen;
+  for (const auto& path : paths) {
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) != NULL && !seen.insert(resolved).second)
+      continue;
+
+    FleetRepo repo;
+    repo.path = path;
+    repo.activity = 0;
+    repo.started = false;
+    repo.succeeded = false;
+    repo.seconds = 0;
+
+    std::string git_dir;
+    std::string common_dir;
+    if (get_git_dirs(path, git_dir, common_dir))
+      repo.activity = fleet_activity(git_dir);
+
+    std::vector<RemoteLinks> remotes;
+    std::unordered_set<std::string> hosts;
+    if (get_remote_configs(path, remotes)) {
+      for (const auto& remote : remotes) {
+        for (const auto* links : {&remote.fetch_links, &remote.push_links}) {
+          for (const auto& link : *links) {
+            if (hosts.insert(fleet_url_host(link)).second)
+              repo.hosts.push_back(fleet_url_host(link));
+          }
+        }
+      }
+    }
+
+    repos.push_back(repo);
+  }
+
+  if (repos.empty()) {
+    std::cout << "No repositories found in " << source << std::endl;
+    return true;
+  }
+
+  std::stable_sort(repos.begin(), repos.end(), [] (const FleetRepo& a, const FleetRepo& b) {
+    return a.activity > b.activity;
+  });
+
+  std::cout << "Syncing " << repos.size() << " repositories, " << fleet_jobs << " at a time, at most " <<
+    host_jobs << " per host..." << std::endl;
+
+  // One task per repository
+  std::atomic<uint32_t> done(0);
+  std::vector<PoolTask> tasks;
+  for (auto& repo : repos) {
+    PoolTask task;
+    task.keys = repo.hosts;
+    task.run = [&repo, &sync_args, &done, &repos] () {
+      auto start = std::chrono::steady_clock::now();
+      repo.started = true;
+      {
+        ThreadOutput capture(repo.output);
+        Session session;
+        repo.succeeded = session.session_startup_sequence(repo.path) && session.args_parser(sync_args);
+        repo.failed_remotes.assign(session.failed_remotes.begin(), session.failed_remotes.end());
+        std::sort(repo.failed_remotes.begin(), repo.failed_remotes.end());
+      }
+      repo.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      // Progress line, and the whole output of a repository that failed
+      std::ostringstream progress;
+      progress << '[' << ++done << '/' << repos.size() << "] " << repo.path << ": " <<
+        (repo.succeeded ? "synced" : "\033[41;1mfailed\033[0m") << " (" << std::fixed << std::setprecision(1) << repo.seconds << "s)\n";
+      if (!repo.succeeded) {
+        for (const auto& line : get_lines_from_string(repo.output))
+          progress << "    " << line << '\n';
+      } print_whole(progress.str());
+    };
+    tasks.push_back(task);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  WorkPool pool(fleet_jobs, host_jobs);
+  register_fleet_pool(&pool);
+  pool.run(tasks);
+  register_fleet_pool(NULL);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Summary
+  uint32_t synced = 0;
+  uint32_t failed = 0;
+  double busy = 0;
+  for (const auto& repo : repos) {
+    busy += repo.seconds;
+    if (repo.succeeded) synced++;
+    else if (repo.started) failed++;
+  }
+
+  std::cout << "\nFleet summary:\n" << std::fixed << std::setprecision(1) <<
+    "    " << synced << " synced, " << failed << " failed, " << repos.size() - synced - failed << " not started\n" <<
+    "    " << seconds << "s, for " << busy << "s of syncing\n";
+  for (const auto& repo : repos) {
+    if (repo.succeeded || !repo.started)
+      continue;
+    std::cout << "    \033[41;1mfailed\033[0m " << repo.path;
+    if (!repo.failed_remotes.empty()) {
+      std::cout << " (remotes:";
+      for (const auto& remote : repo.failed_remotes)
+        std::cout << ' ' << remote;
+      std::cout << ')';
+    } std::cout << std::endl;
+  }
+
+  return failed == 0 && synced == repos.size();
+}
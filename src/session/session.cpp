@@ -1,8 +1,9 @@
 #include "session.h"
 
 Session::Session () {
-  // Dummy method
-  return;
+  // Read only commands run without a startup sequence
+  this->stashed_changes = false;
+  this->kept_changes = false;
 }
 
 Session::~Session () {
@@ -18,9 +19,13 @@ Session::~Session () {
 }
 
 bool Session::clean_up () {
-  // Unset lock
-  if (this->lock_secured)
-    this->lock_secured = !unset_lock_file(this->dugit_path + "/.lock");
+  // Release lock
+  this->lock.release();
+  this->ready_stages &= ~stage_lock;
+
+  // Nothing else to clean up without a repository
+  if (!(this->ready_stages & stage_repository))
+    return true;
 
   // Abort merge
   if (check_merge_head_file(this->toplevel_path) ||
@@ -59,7 +64,9 @@ void print_help () {
     "    --abort-merge   When merging branches, any Dugit command will automatically",
     "                    quit if a merge conflict is detected, and leave the merge",
     "                    conflict for the user to fix. If you want Dugit to",
-    "                    automatically abort the merge, use this flag.",
+    "                    automatically abort the merge, use this flag. With git 2.38",
+    "                    or newer, sync detects the conflict in memory and stops",
+    "                    before anything is stashed or merged.",
     "",
     "    --stage-all     If you wish to stage (add) all changes made to the repository",
     "                    including untracked changes (not yet tracked by git, if you do",
@@ -86,6 +93,45 @@ void print_help () {
     "    --fast-forward  When merging, by default Dugit does not allow fast forwarding,",
     "                    but if desired, the user may this flag to allow fast forwarding.",
     "",
+    "    --octopus       When syncing, merge every remote that has new commits in a",
+    "                    single octopus merge (one merge commit), falling back to merging",
+    "                    one remote at a time if git refuses the octopus merge.",
+    "",
+    "    --isolated      When syncing, merge and commit in a separate worktree under",
+    "                    .dugit instead of your checkout, so nothing is ever stashed and",
+    "                    you can keep editing. Your checkout is fast-forwarded to the",
+    "                    result afterwards, but only if it has no local changes.",
+    "",
+    "    --show-log      When syncing, print the log of the commits about to be merged",
+    "                    from each remote, not just how many there are.",
+    "",
+    "    --jobs <n>      When syncing, Dugit fetches from and pushes to up to <n> remotes",
+    "                    at the same time (default 4). Use --jobs 1 to go one at a time.",
+    "",
+    "    --recursive     When syncing, sync every checked out submodule (and the ones",
+    "                    inside them) first, as if \"sync\" was run in each of them with",
+    "                    --no-warning and --auto-message. Submodules whose own",
+    "                    submodules are done sync at the same time, and the new",
+    "                    commits of the submodules that moved are committed in their",
+    "                    parent before the parent syncs.",
+    "",
+    "    --submodule-jobs <n>",
+    "                    With --recursive, sync up to <n> submodules at the same time",
+    "                    (default 8).",
+    "",
+    "    --repos <path>  Sync every repository listed in the file <path> (one per line,",
+    "                    # for comments), or found below the directory <path>, as",
+    "                    if \"sync\" was run in each of them with --no-warning and",
+    "                    --auto-message. The most recently used repositories go first,",
+    "                    and a summary of all of them is printed at the end.",
+    "",
+    "    --fleet-jobs <n>",
+    "                    With --repos, sync up to <n> repositories at the same time",
+    "                    (default 8).",
+    "",
+    "    --host-jobs <n> With --repos, sync at most <n> repositories at the same time",
+    "                    with remotes on any one host (default 4).",
+    "",
     "",
     "\033[4;1mThese are common Dugit commands used in various situations:\033[0m",
     "\033[41;1mPlease read how to use flags before using commands\033[0m",
@@ -195,6 +241,103 @@ void print_usage_examples () {
     std::cout << line << std::endl;
 }
 
+// Whether args only run read only commands (no args prints help)
+bool is_read_only_command (const std::vector<std::string>& args) {
+  for (const auto& arg : args) {
+    if (arg.compare(0, 2, "--") == 0)
+      continue;
+    auto stages = command_stages.find(arg);
+    if (stages == command_stages.end() || stages->second != 0)
+      return false;
+  } return true;
+}
+
+// State directory of the repository at toplevel_path, .dugit/modules/<path> for a submodule
+std::string get_state_path (const std::string& superproject_path, const std::string& toplevel_path) {
+  /*
+    Every repository has a snapshot and
+    an --isolated worktree of its own,
+    a submodule sharing the ones of its
+    superproject would take its refs and
+    its branch for its own.
+  */
+
+  std::string path = superproject_path + "/.dugit";
+  if (toplevel_path.length() > superproject_path.length() + 1 &&
+  toplevel_path.compare(0, superproject_path.length() + 1, superproject_path + '/') == 0)
+    path += "/modules/" + toplevel_path.substr(superproject_path.length() + 1);
+  return path;
+}
+
+// The lock is the superproject's, a submodule never syncs behind a recursive sync's back
+std::string Session::lock_path () const {
+  return this->superproject_path + "/.dugit/.lock";
+}
+
+// Take .dugit/.lock, waiting a bounded time for whoever holds it
+bool Session::acquire_lock () {
+  /*
+    Every command that takes the lock
+    changes the repository, so it takes
+    it exclusive, and waits up to
+    $DUGIT_LOCK_TIMEOUT seconds for it.
+    The ones that change nothing do not
+    take it at all, a sync holding it
+    does not keep them from running.
+  */
+
+  std::string path = this->lock_path();
+  std::string owner = std::string(program_invocation_short_name) + " (pid " + std::to_string(getpid()) + ')';
+
+  uint32_t timeout = default_lock_timeout;
+  const char* timeout_env = getenv("DUGIT_LOCK_TIMEOUT");
+  if (timeout_env != NULL && *timeout_env != '\0') {
+    std::string value = timeout_env;
+    if (value.find_first_not_of("0123456789") == std::string::npos && value.length() <= 6)
+      timeout = std::stoul(value);
+  }
+
+  return this->lock.acquire(path, false, owner, timeout);
+}
+
+// Resume Sequence
+bool Session::session_resume_sequence () {
+  /*
+    A session kept by dugitd has already
+    been through the startup sequence.
+    Between commands only the per command
+    state is reset, and the lock and the
+    refs are left for the next command to
+    take again, if it needs them. The
+    cat-file coprocess stays running.
+  */
+
+  for (auto& flag : this->flags)
+    flag.second = false;
+  this->options = this->default_options;
+  this->stashed_changes = false;
+  this->kept_changes = false;
+  this->skipped_remotes.clear();
+  this->failed_remotes.clear();
+
+  // The repository may be gone, or .dugit removed, since the last command
+  this->probes.clear();
+  if (!this->probes.is_dir(this->toplevel_path) || !this->probes.is_dir(this->dugit_path))
+    return false;
+
+  // Reload branches and remotes from the snapshot, or from the repository, when needed
+  for (const auto& branch : this->branches)
+    delete(branch);
+  for (const auto& remote : this->remotes)
+    delete(remote);
+  this->branches.clear();
+  this->remotes.clear();
+  this->current_branch = NULL;
+  this->ready_stages &= stage_repository | stage_objects;
+
+  return true;
+}
+
 // dugit args parser
 bool Session::args_parser (const std::vector<std::string>& args) {
   /*
@@ -208,12 +351,71 @@ bool Session::args_parser (const std::vector<std::string>& args) {
     return true;
   }
 
+  // Extract options and their values
+  std::vector<std::string> args_without_options;
+  for (uint32_t arg = 0; arg < args.size(); arg++) {
+    std::string name = args[arg].substr(0, args[arg].find('='));
+    auto option = this->options.find(name);
+    if (option == this->options.end()) {
+      args_without_options.push_back(args[arg]);
+      continue;
+    }
+
+    if (name.length() < args[arg].length())
+      option->second = args[arg].substr(name.length() + 1);
+    else if (arg + 1 < args.size())
+      option->second = args[++arg];
+    else {
+      std::string err_msg = '\"' + name + "\" option requires a value.\n";
+      print_error(err_msg.c_str());
+      return false;
+    }
+  }
+
+  if (this->jobs() == 0) {
+    std::string err_msg = "\"--jobs\" expects a positive number, got \"" + this->options.at("--jobs") + "\".\n";
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  if (this->submodule_jobs() == 0) {
+    std::string err_msg = "\"--submodule-jobs\" expects a positive number, got \"" + this->options.at("--submodule-jobs") + "\".\n";
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  return this->args_parser_commands(args_without_options);
+}
+
+// Number of concurrent git jobs (--jobs)
+uint32_t Session::jobs () {
+  const std::string& value = this->options.at("--jobs");
+  if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.length() > 4)
+    return 0;
+  return std::stoul(value);
+}
+
+// Number of submodules synced at once (--submodule-jobs)
+uint32_t Session::submodule_jobs () {
+  const std::string& value = this->options.at("--submodule-jobs");
+  if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.length() > 4)
+    return 0;
+  return std::stoul(value);
+}
+
+// dugit command and flag parser
+bool Session::args_parser_commands (const std::vector<std::string>& args) {
+  if (args.empty()) {
+    print_help();
+    return true;
+  }
+
   // Check commands
   for (const auto& arg : args) {
     bool found = false;
     std::string err_msg = '\"' + arg + "\" command not recognized.\n";
     if (arg.length() < 2) {
-      perror(err_msg.c_str());
+      print_error(err_msg.c_str());
       return false;
     }
 
@@ -228,7 +430,7 @@ bool Session::args_parser (const std::vector<std::string>& args) {
     }
 
     if (!found) {
-      perror(err_msg.c_str());
+      print_error(err_msg.c_str());
       return false;
     }
   }
@@ -247,12 +449,17 @@ bool Session::args_parser (const std::vector<std::string>& args) {
       }
 
       if (!found) {
-        perror(err_msg.c_str());
+        print_error(err_msg.c_str());
         return false;
       }
     }
   }
 
+  // Only what the command needs
+  auto stages = command_stages.find(args.front());
+  if (stages != command_stages.end() && !this->prepare(stages->second))
+    return false;
+
   if (args.front() == "help")
     print_help();
   else if (args.front() == "version")
@@ -262,14 +469,14 @@ bool Session::args_parser (const std::vector<std::string>& args) {
   else if (args.front() == "commit") {
     if (!this->commit_repository()) {
       std::string err_msg = "fatal: Could not sync repository at " + this->toplevel_path + "\nCheck your git status for more information: git status";
-      perror(err_msg.c_str());
+      print_error(err_msg.c_str());
       return false;
     }
   }
   else if (args.front() == "sync") {
-    if (!this->sync_repository()) {
+    if (!(this->flags.at("--recursive") ? this->sync_recursive() : this->sync_repository())) {
       std::string err_msg = "fatal: Could not sync repository at " + this->toplevel_path + "\nCheck your git status for more information: git status";
-      perror(err_msg.c_str());
+      print_error(err_msg.c_str());
       return false;
     }
   } else
@@ -285,35 +492,21 @@ bool Session::session_startup_sequence () {
 
 // Startup Sequence
 bool Session::session_startup_sequence (const std::string path) {
-  // Set lock secured status
-  this->lock_secured = false;
+  /*
+    Nothing is loaded here, not even the
+    repository, which help, version and
+    examples do not need. Commands run
+    the stages they need with prepare.
+  */
 
   // Set stashed changes status
   this->stashed_changes = false;
-
-  // Check dugit dependencies
-  if (!check_dugit_external_dependencies())
-    return false;
-
-  // Check git version
-  std::string* git_version = get_git_version();
-  if (git_version == NULL)
-    return false;
-  
-  this->git_version = *git_version;
-  delete(git_version);
-
-  // Get PPID
-  std::string* ppid = get_ppid();
-  if (ppid == NULL)
-    return false;
-  
-  this->ppid =*ppid;
-  delete(ppid);
+  this->kept_changes = false;
+  this->ready_stages = 0;
 
   // Set Working Path (check path override)
   if (!path.empty()) {
-    if (!dir_exists(path))
+    if (!this->probes.is_dir(path))
       return false;
     this->working_path = path;
   } else {
@@ -325,39 +518,111 @@ bool Session::session_startup_sequence (const std::string path) {
     delete(working_path);
   }
 
-  // Check if inside git repository
-  if (!is_inside_working_tree(this->working_path))
-    return false;
+  return true;
+}
 
-    // Fetch Repository toplevel_path
-  std::string* toplevel_path = get_toplevel_path_manually(this->working_path);
-  if (toplevel_path == NULL)
-    return false;
+// Run the startup stages that are not done yet
+bool Session::prepare (uint32_t stages) {
+  /*
+    Every stage needs the repository, and
+    the refs are only read (and their
+    snapshot written) under the lock.
+    The refs go before the objects, the
+    snapshot knows the git version, and
+    saves asking git for it.
+  */
 
-  this->toplevel_path = *toplevel_path;
-  delete(toplevel_path);
+  if (stages != 0)
+    stages |= stage_repository;
+  if (stages & stage_refs)
+    stages |= stage_lock;
 
-  std::string* dugit_path = get_dugit_path(this->working_path);
-  if (dugit_path == NULL)
-    // Create .dugit directory
-    if (!create_dugit_directory(this->toplevel_path))
+  if (stages & ~this->ready_stages & stage_repository) {
+    // Check dugit dependencies
+    if (!check_dugit_external_dependencies())
+      return false;
+
+    // Find the repository toplevel_path, its gitdir and the common dir shared by worktrees
+    RepoLocation location;
+    if (!discover_repository(this->working_path, location) || location.toplevel.empty())
       return false;
-    // Try again
-    else dugit_path = get_dugit_path(this->working_path);
-  
-  // If failed this time, quit
-  if (dugit_path == NULL)
-    return false;
 
-  this->dugit_path = *dugit_path;
-  delete(dugit_path);
+    this->toplevel_path = location.toplevel;
+    this->git_dir = location.git_dir;
+    this->common_dir = location.common_dir;
+
+    // .dugit lives in the superproject, created on first use, with a directory for each submodule
+    this->superproject_path = location.superproject;
+    this->dugit_path = get_state_path(this->superproject_path, this->toplevel_path);
+    if (!this->probes.is_dir(this->dugit_path) && !this->probes.create_dirs(this->dugit_path))
+      return false;
+
+    // Never staged, not even by git add . (--stage-all)
+    std::string superproject_git_dir = location.git_dir;
+    std::string superproject_common_dir = location.common_dir;
+    if (location.superproject != location.toplevel &&
+    !get_git_dirs(location.superproject, superproject_git_dir, superproject_common_dir))
+      return false;
+    if (!exclude_dugit(superproject_common_dir))
+      return false;
+    this->ready_stages |= stage_repository;
+  }
 
   // Acquire .dugit lock
-  if (!set_lock_file(this->dugit_path + "/.lock", this->ppid))
+  if (stages & ~this->ready_stages & stage_lock) {
+    if (!this->acquire_lock())
+      return false;
+    this->ready_stages |= stage_lock;
+  }
+
+  // Use the persisted snapshot if nothing changed since it was taken
+  if (stages & ~this->ready_stages & stage_refs) {
+    std::string git_version = this->git_version;
+    if (!this->load_snapshot()) {
+      if (!this->load_repository_state())
+        return false;
+      this->save_snapshot();
+    }
+
+    // A new git needs a new coprocess
+    if ((this->ready_stages & stage_objects) && git_version != this->git_version)
+      this->cat_file.set_repository(this->toplevel_path, this->git_version);
+    this->ready_stages |= stage_refs;
+  }
+
+  // Object queries go through a single cat-file coprocess
+  if (stages & ~this->ready_stages & stage_objects) {
+    if (this->git_version.empty()) {
+      std::string* git_version = get_git_version();
+      if (git_version == NULL)
+        return false;
+
+      this->git_version = *git_version;
+      delete(git_version);
+    }
+
+    this->cat_file.set_repository(this->toplevel_path, this->git_version);
+    this->ready_stages |= stage_objects;
+  }
+
+  return true;
+}
+
+// Build branches, remotes and the current branch from the repository
+bool Session::load_repository_state () {
+  /*
+    This is the expensive part of the
+    startup, whose result is persisted
+    as a snapshot in .dugit.
+  */
+
+  // Check git version
+  std::string* git_version = get_git_version();
+  if (git_version == NULL)
     return false;
 
-  // Set lock secured status
-  this->lock_secured = true;
+  this->git_version = *git_version;
+  delete(git_version);
 
   // Get Local Branch names
   std::string* local_branch_names_str = get_local_branch_names(this->toplevel_path);
@@ -374,30 +639,24 @@ bool Session::session_startup_sequence (const std::string path) {
     this->branches.push_back(new_branch);
   } delete(local_branch_names_str);
 
-  // Get Remote names
-  std::string* remote_names_str = get_remote_names(this->toplevel_path);
-  if (remote_names_str == NULL)
+  // Create Remotes, all read from the git configuration in one pass
+  GitConfig config;
+  if (!config.load(this->git_dir, this->common_dir))
     return false;
+  this->config_files = config.files;
 
-  // Create Remotes
-  for (const auto& remote_name : get_lines_from_string(*remote_names_str)) {
+  for (const auto& remote_config : config.get_remotes()) {
     Remote* new_remote = new Remote;
-    new_remote->name = remote_name;
-
-    std::string* fetch_links_str = get_remote_links(this->toplevel_path, remote_name, "(fetch)");
-    if (fetch_links_str != NULL) {
-      new_remote->fetch_links = get_lines_from_string(*fetch_links_str);
-      delete(fetch_links_str);
-    }
-
-    std::string* push_links_str = get_remote_links(this->toplevel_path, remote_name, "(push)");
-    if (push_links_str != NULL) {
-      new_remote->push_links = get_lines_from_string(*push_links_str);
-      delete(push_links_str);
-    }
-
+    new_remote->name = remote_config.name;
+    new_remote->fetch_links = remote_config.fetch_links;
+    new_remote->push_links = remote_config.push_links;
     this->remotes.push_back(new_remote);
-  } delete(remote_names_str);
+  }
+
+  // Index branches by name, remotes can carry tens of thousands of them
+  std::unordered_map<std::string, Branch*> branches_by_name;
+  for (const auto& branch : this->branches)
+    branches_by_name[branch->name] = branch;
 
   // Update Branches to is_remote or create remote-only Branches
   for (uint32_t remote = 0; remote < this->remotes.size(); remote++) {
@@ -408,20 +667,17 @@ bool Session::session_startup_sequence (const std::string path) {
 
     // Filter pre-existing branches
     for (const auto& remote_branch_name : get_lines_from_string(*remote_branch_names_str)) {
-      bool found = false;
-      for (const auto& local_branch : this->branches) {
-        if (remote_branch_name == local_branch->name) {
-          local_branch->remotes.push_back(this->remotes.at(remote));
-          found = true;
-          break;
-        }
-      } if (!found) {
+      auto existing = branches_by_name.find(remote_branch_name);
+      if (existing != branches_by_name.end()) {
+        existing->second->remotes.push_back(this->remotes.at(remote));
+      } else {
         // Create new remote-only branch
         Branch* new_branch = new Branch;
         new_branch->name = remote_branch_name;
         new_branch->is_local = false;
         new_branch->remotes = {this->remotes.at(remote)};
         this->branches.push_back(new_branch);
+        branches_by_name[remote_branch_name] = new_branch;
       }
     } delete(remote_branch_names_str);
   }
@@ -447,97 +703,137 @@ bool Session::session_startup_sequence (const std::string path) {
   return true;
 }
 
-bool Session::commit_repository () {
-  std::string* diff;
+bool Session::commit_repository (const bool stage) {
+  /*
+    Without stage only what is already
+    in the index is committed, which is
+    how merges are committed while local
+    changes were kept out of the stash.
+  */
+
+  RepoState state;
+  if (!this->load_state(state, stage))
+    return false;
 
   // Check if any untracked changes
-  if (check_untracked(this->toplevel_path)) {
+  if (stage && !state.untracked.empty()) {
     if (!this->flags.at("--no-warning")) {
-      diff = get_status(this->toplevel_path);
-      if (diff != NULL) {
-        std::cout << std::endl << *diff << std::endl;
-        delete(diff);
+      std::string* status = get_status(this->toplevel_path);
+      if (status != NULL) {
+        std::cout << std::endl << *status << std::endl;
+        delete(status);
         this->flags.at("--stage-all") = response_generator("There are untracked changes in your repository.\nWould you like to stage (add) these untracked changes to your next commit?");
       }
     }
-  } diff = NULL;
-
-  // Check if any changes to stage
-  diff = get_diff_uncached(this->toplevel_path);
-  if (diff != NULL) {
-    bool diff_empty = diff->empty();
-    delete(diff);
-
-    // Stage Changes
-    if (!diff_empty) {
-      std::cout << "Staging..." << std::endl;
-      if (!stage_changes(this->toplevel_path, this->flags.at("--stage-all")))
-        return false;
-      std::cout << "Staging successful..." << std::endl;
-    }
-  } diff = NULL;
+  }
 
-  // Check if anything to commit
-  diff = get_diff_cached(this->toplevel_path);
-  if (diff != NULL) {
-    bool diff_empty = diff->empty();
-    delete(diff);
-    
-    // Commit staged changes
-    if (!diff_empty) {
-      std::cout << "Committing..." << std::endl;
-      std::string commit_message = "";
-      if (this->flags.at("--auto-message"))
-        commit_message = commit_local_message(this->toplevel_path);
-      else commit_message = commit_custom_message();
-      clean_commit_message(commit_message);
-      if (!commit(this->toplevel_path, commit_message))
-        return false;
-      std::cout << "Commit successful..." << std::endl;
-    }
+  // Stage Changes
+  if (stage && (!state.unstaged.empty() || (this->flags.at("--stage-all") && !state.untracked.empty()))) {
+    std::cout << "Staging..." << std::endl;
+    if (!stage_changes(this->toplevel_path, this->flags.at("--stage-all")))
+      return false;
+    std::cout << "Staging successful..." << std::endl;
+
+    // Staging changed what is in the index
+    state = RepoState();
+    if (!state.load(this->toplevel_path, this->git_dir))
+      return false;
+  }
+
+  // Commit staged changes
+  if (!state.staged.empty()) {
+    std::cout << "Committing..." << std::endl;
+    std::string commit_message = "";
+    if (this->flags.at("--auto-message"))
+      commit_message = commit_local_message(this->toplevel_path);
+    else commit_message = commit_custom_message();
+    if (!commit(this->toplevel_path, commit_message))
+      return false;
+    std::cout << "Commit successful..." << std::endl;
   }
 
   return true;
 }
 
+// Repository state from the index if it can be read natively, otherwise from git status
+bool Session::load_state (RepoState& state, const bool check_untracked) {
+  /*
+    A clean working tree, by far the most
+    common case, is answered without any
+    git status. Anything the native check
+    is unsure about goes to git status.
+    Under dugitd, git status only needs to
+    look at the paths the working tree
+    watch reported.
+  */
+
+  if (this->dirty_paths != NULL && this->dirty_paths->current(this->git_dir, this->common_dir))
+    return state.load(this->toplevel_path, this->git_dir, this->dirty_paths->paths);
+
+  std::string head_tree = this->cat_file.resolve("HEAD^{tree}");
+  if (state.load_native(this->toplevel_path, this->git_dir, this->common_dir, head_tree, check_untracked))
+    return true;
+  return state.load(this->toplevel_path, this->git_dir);
+}
+
+// Whether local changes have to be stashed before merging incoming_refs
+bool Session::stash_needed (const RepoState& state, const std::vector<std::string>& incoming_refs) {
+  /*
+    git merge only refuses to run over
+    local changes to the paths it has to
+    update, and requires nothing to be
+    staged. When no incoming commit
+    touches a dirty path, the changes
+    can stay where they are instead of
+    being written out and back again by
+    a stash and a pop. Any doubt means
+    stashing, as before.
+  */
+
+  if (!state.staged.empty() || !state.conflicted.empty())
+    return true;
+
+  std::vector<std::string> incoming_paths;
+  if (!get_incoming_paths(this->toplevel_path, "HEAD", incoming_refs, this->jobs(), incoming_paths))
+    return true;
+
+  std::unordered_set<std::string> incoming(incoming_paths.begin(), incoming_paths.end());
+  for (const auto& path : state.unstaged) {
+    if (incoming.count(path))
+      return true;
+  } return false;
+}
+
 // Stash sequence
-bool Session::stash_repository () {
+bool Session::stash_repository (const std::vector<std::string>& incoming_refs) {
+  RepoState state;
+  if (!this->load_state(state, false))
+    return false;
+
+  // A dirty state always comes from git status, with every path in it
+  if (!state.dirty())
+    return true;
+
   // Check if in the middle of a merge right now
-  std::string* diff[2];
-  std::string* status;
-  bool diff_found = false;
-
-  diff[0] = get_diff_uncached(this->toplevel_path);
-  if (diff[0] == NULL) return false;
-  if (!diff[0]->empty()) diff_found = true;
-  delete(diff[0]);
-  
-  diff[1] = get_diff_cached(this->toplevel_path);
-  if (diff[1] == NULL) return false;
-  if (!diff[1]->empty()) diff_found = true;
-  delete(diff[1]);
-
-  status = get_status(this->toplevel_path);
-  if (status == NULL) return false;
-
-  if (diff_found) {
-    if (check_merge_head_file(this->toplevel_path) ||
-    check_merge_msg_file(this->toplevel_path) ||
-    check_merge_mode_file(this->toplevel_path)) {
-      if (!this->flags.at("--no-warning")) {
-        std::cout << std::endl << *status << std::endl;
-        this->flags.at("--commit") = response_generator("You are currently inside a merge operation that has yet to be committed.\nWould you like to commit these merge changes?");
-      }
-    } if (status != NULL) delete(status); status = NULL;
+  if (state.merging && !this->flags.at("--no-warning")) {
+    std::string* status = get_status(this->toplevel_path);
+    if (status != NULL) {
+      std::cout << std::endl << *status << std::endl;
+      delete(status);
+    } this->flags.at("--commit") = response_generator("You are currently inside a merge operation that has yet to be committed.\nWould you like to commit these merge changes?");
+  }
+
+  if (!this->flags.at("--commit") && !this->stash_needed(state, incoming_refs)) {
+    std::cout << "Local changes do not overlap incoming changes, merging without stashing..." << std::endl;
+    this->kept_changes = true;
+  } else if (!this->flags.at("--commit")) {
+    std::cout << "Stashing..." << std::endl;
+    if (!stash(this->toplevel_path, this->flags.at("--keep-index")))
+      return false;
+    this->stashed_changes = true;
+    std::cout << "Stashing successful..." << std::endl;
+  }
 
-    if (!this->flags.at("--commit")) {
-      std::cout << "Stashing..." << std::endl;
-      if (!stash(this->toplevel_path, this->flags.at("--keep-index")))
-        return false;
-      this->stashed_changes = true;
-      std::cout << "Stashing successful..." << std::endl;
-    }
-  } if (status != NULL) delete(status); status = NULL;
   return true;
 }
 
@@ -546,43 +842,90 @@ bool Session::sync_repository () {
     Sync the repository on the current
     branch that is loaded.
 
-    Currently very unsafe, does not
-    check for possible merge conflicts.
+    Fetching and planning only touch
+    refs and the object store, so they
+    run before the local changes are
+    stashed or committed, and a merge
+    that is known to conflict can stop
+    the sync before anything is touched.
+    With --commit, the local changes are
+    committed first, the preview merges
+    into HEAD and has to see them.
   */
 
-  std::string* diff;
+  if (this->flags.at("--isolated"))
+    return this->sync_isolated();
 
   // Apply commits if enabled
-  if (this->flags.at("--commit")) {
-    if (!this->commit_repository())
-      return false;
-  } else if (!this->stash_repository())
+  if (this->flags.at("--commit") && !this->commit_repository())
     return false;
 
-  // Fetch and merge from remote repositories that have the currently selected branch
-  bool log_diff_found = false;
-  for (const auto& remote : this->current_branch->remotes) {
-    std::cout << "Fetching from " << remote->name << '/' << this->current_branch->name << std::endl;
-    if (!fetch_remote(this->toplevel_path, remote->name, this->current_branch->name)) 
-      continue;
+  // Fetch from every remote that has the currently selected branch
+  std::vector<bool> fetched;
+  this->fetch_current_branch(fetched);
+
+  // Find the remotes with something to merge
+  std::vector<Remote*> diverged;
+  if (!this->find_diverged(fetched, "refs/heads/" + this->current_branch->name, diverged))
+    return false;
+  bool log_diff_found = !diverged.empty();
 
-    std::string* log_diff = get_log_diff(this->toplevel_path, this->current_branch->name, remote->name + '/' + this->current_branch->name);
-    if (log_diff == NULL)
+  std::vector<std::string> diverged_refs;
+  for (const auto& remote : diverged)
+    diverged_refs.push_back(remote->name + '/' + this->current_branch->name);
+
+  // Preview the merges in memory, git merge-tree --write-tree needs git 2.38
+  if (!diverged.empty() && git_version_at_least(this->git_version, 2, 38)) {
+    std::string conflicting_ref;
+    std::vector<std::string> conflicts;
+    if (!preview_merges(this->toplevel_path, diverged_refs, conflicting_ref, conflicts))
       return false;
-    
-    if (!log_diff->empty()) {
-      log_diff_found = true;
-      std::cout << "Log Difference between HEAD and " << remote->name << '/' << this->current_branch->name << ":\n" << *log_diff << std::endl;
-      delete(log_diff);
-      std::cout << "Merging " << remote->name << '/' << this->current_branch->name << std::endl;
-      if (!merge(this->toplevel_path, remote->name, this->current_branch->name, this->flags.at("--fast-forward")))
+
+    if (!conflicting_ref.empty()) {
+      std::cout << "\033[41;1mMerging " << conflicting_ref << " will conflict in:\033[0m" << std::endl;
+      for (const auto& path : conflicts)
+        std::cout << "    " << path << std::endl;
+
+      // Nothing has been stashed, merged or checked out yet
+      if (this->flags.at("--abort-merge")) {
+        std::cout << "Sync aborted, the working tree was left untouched." << std::endl;
         return false;
-    } else {
-      delete(log_diff);
-      std::cout << "Nothing to merge from " << remote->name << '/' << this->current_branch->name << std::endl;
+      }
+      if (!this->flags.at("--no-warning") &&
+      !response_generator("\nWould you like to merge anyway and resolve the conflicts yourself?"))
+        return true;
     }
   }
 
+  // Committed already with --commit, stashed otherwise
+  if (!this->flags.at("--commit") && !this->stash_repository(diverged_refs))
+    return false;
+
+  // Merge every diverged remote at once if asked to
+  bool merged = false;
+  if (this->flags.at("--octopus") && diverged.size() > 1) {
+    std::vector<std::string> diverged_names;
+    for (const auto& remote : diverged)
+      diverged_names.push_back(remote->name);
+
+    std::cout << "Merging " << diverged.size() << " remotes in a single octopus merge" << std::endl;
+    merged = merge_octopus(this->toplevel_path, diverged_names, this->current_branch->name, this->flags.at("--fast-forward"));
+
+    // Octopus does not resolve conflicts, redo them as ordinary two-way merges
+    if (!merged) {
+      if (check_merge_head_file(this->toplevel_path) && !merge_abort(this->toplevel_path))
+        return false;
+      std::cout << "Octopus merge refused, merging one remote at a time..." << std::endl;
+    }
+  }
+
+  // Merge from remote repositories one at a time, in remote order
+  for (uint32_t remote = 0; !merged && remote < diverged.size(); remote++) {
+    std::cout << "Merging " << diverged.at(remote)->name << '/' << this->current_branch->name << std::endl;
+    if (!merge(this->toplevel_path, diverged.at(remote)->name, this->current_branch->name, this->flags.at("--fast-forward")))
+      return false;
+  }
+
   // Ask whether to commit these merges
   if (log_diff_found ||
   check_merge_head_file(this->toplevel_path) ||
@@ -598,30 +941,259 @@ bool Session::sync_repository () {
     !response_generator("\nWould you like to go ahead an commit these merges?"))
       return true;
 
-    // Check if anything to commit
-    if (!this->commit_repository())
+    // Check if anything to commit, local changes that were kept stay uncommitted
+    if (!this->commit_repository(!this->kept_changes))
       return false;
   }
 
-  // Push merged to where necessary
-  for (const auto& remote : this->remotes) {
-    std::string* log_diff;
-    if (!this->current_branch->remotes.empty() &&
-    std::find(this->current_branch->remotes.begin(), this->current_branch->remotes.end(), remote) != this->current_branch->remotes.end()) {
-      // Do this check only if the branch exists on the remote
-      log_diff = get_log_diff(this->toplevel_path, remote->name + '/' + this->current_branch->name, this->current_branch->name);
-      if (log_diff == NULL)
+  // Push wherever the branch is missing or behind
+  return this->push_current_branch("refs/heads/" + this->current_branch->name, this->current_branch->name);
+}
+
+// Sync in a linked worktree under .dugit, leaving the user's checkout alone
+bool Session::sync_isolated () {
+  /*
+    Merging and committing happen in
+    .dugit/worktree, a linked worktree
+    that shares objects and refs with the
+    repository and is detached at the
+    current branch. The user's checkout
+    is never stashed nor merged into, the
+    merged commit is pushed straight from
+    the object store, and the checkout is
+    only fast-forwarded to it at the end,
+    if it has no local changes.
+  */
+
+  std::string branch_ref = "refs/heads/" + this->current_branch->name;
+  std::string worktree_path = this->dugit_path + "/worktree";
+
+  // Committing touches the index and the branch, not the files being edited
+  if (this->flags.at("--commit") && !this->commit_repository())
+    return false;
+
+  std::vector<bool> fetched;
+  this->fetch_current_branch(fetched);
+
+  std::vector<Remote*> diverged;
+  if (!this->find_diverged(fetched, branch_ref, diverged))
+    return false;
+
+  std::string start = this->cat_file.resolve(branch_ref);
+  if (start.empty())
+    return false;
+
+  // Merge and commit every diverged remote in the worktree
+  std::string synced = start;
+  if (!diverged.empty()) {
+    std::cout << "Merging in " << worktree_path << std::endl;
+    if (!prepare_worktree(this->toplevel_path, worktree_path, start))
+      return false;
+
+    for (const auto& remote : diverged) {
+      std::string ref = remote->name + '/' + this->current_branch->name;
+      std::cout << "Merging " << ref << std::endl;
+      if (!merge_commit(worktree_path, ref, this->flags.at("--fast-forward"), commit_sync_message())) {
+        merge_abort(worktree_path);
+        std::cout << "\033[41;1mSync stopped, " << ref << " does not merge cleanly. Your checkout was left untouched.\033[0m" << std::endl;
         return false;
-    } else log_diff = new std::string("branch not in repository");
-    
-    if (!log_diff->empty()) {
-      delete(log_diff);
-      std::cout << "Pushing to " << remote->name << '/' << this->current_branch->name << std::endl;
-      if (!push_remote(this->toplevel_path, remote->name, this->current_branch->name))
+      }
+    }
+
+    std::string* head = get_head_commit(worktree_path);
+    if (head == NULL)
+      return false;
+    synced = *head;
+    delete(head);
+  }
+
+  // Push the merged commit, the user's branch has not moved yet
+  bool pushed_all = this->push_current_branch(synced, synced + ':' + branch_ref);
+
+  // Bring the checkout up to date only if that touches nothing the user changed
+  if (synced != start) {
+    RepoState state;
+    if (state.load(this->toplevel_path, this->git_dir) && !state.dirty() && !state.merging) {
+      std::cout << "Fast-forwarding " << this->current_branch->name << " to " << synced << std::endl;
+      if (!fast_forward(this->toplevel_path, synced))
         return false;
+    } else std::cout << "Your checkout has local changes, " << this->current_branch->name << " was not fast-forwarded.\n" <<
+      "Run 'git merge --ff-only " << synced << "' once they are committed." << std::endl;
+  }
+
+  return pushed_all;
+}
+
+// Fetch the current branch from every remote that has it, concurrently
+void Session::fetch_current_branch (std::vector<bool>& fetched) {
+  std::vector<std::string> remote_names;
+  for (const auto& remote : this->current_branch->remotes) {
+    if (this->skipped_remotes.count(remote->name)) {
+      std::cout << "Skipping " << remote->name << '/' << this->current_branch->name << ", it failed recently" << std::endl;
+      continue;
+    }
+    std::cout << "Fetching from " << remote->name << '/' << this->current_branch->name << std::endl;
+    remote_names.push_back(remote->name);
+  }
+
+  std::vector<ProcessResult> fetch_results;
+  fetch_remotes(this->toplevel_path, remote_names, this->current_branch->name, this->jobs(), fetch_results);
+
+  // Report each remote's fetch in remote order, skipped ones count as not fetched
+  fetched.clear();
+  uint32_t remote = 0;
+  for (const auto& branch_remote : this->current_branch->remotes) {
+    if (remote == remote_names.size() || remote_names.at(remote) != branch_remote->name) {
+      fetched.push_back(false);
+      continue;
+    }
+
+    const ProcessResult& result = fetch_results.at(remote);
+    fetched.push_back(result.exit_status == 0);
+    if (fetched.back()) {
+      std::cout << "Fetched from " << remote_names.at(remote) << '/' << this->current_branch->name << std::endl;
+      if (!result.err.empty())
+        std::cout << result.err;
+    } else {
+      std::string err_msg = "fetch_remote() ==> Could not fetch from remote " + remote_names.at(remote) + '/' + this->current_branch->name + '\n' + result.err;
+      print_error(err_msg.c_str());
+      this->failed_remotes.insert(remote_names.at(remote));
+    } remote++;
+  }
+}
+
+// Collect the fetched remotes with commits base does not have, in remote order
+bool Session::find_diverged (const std::vector<bool>& fetched, const std::string& base, std::vector<Remote*>& diverged) {
+  // Count incoming commits for every remote at once
+  std::vector<AheadBehind> incoming;
+  if (!this->plan_sync(base, incoming))
+    return false;
+
+  // Find the remotes with something to merge, in remote order
+  diverged.clear();
+  for (uint32_t remote_index = 0; remote_index < this->current_branch->remotes.size(); remote_index++) {
+    Remote* remote = this->current_branch->remotes.at(remote_index);
+    if (!fetched.at(remote_index))
+      continue;
+
+    const AheadBehind& count = incoming.at(remote_index);
+    if (count.valid && count.incoming > 0) {
+      diverged.push_back(remote);
+      std::cout << remote->name << '/' << this->current_branch->name << " has " << count.incoming << " new commit(s)" << std::endl;
+
+      // Only render the log when asked for
+      if (this->flags.at("--show-log")) {
+        std::string* log_diff = get_log_diff(this->toplevel_path, base, remote->name + '/' + this->current_branch->name);
+        if (log_diff == NULL)
+          return false;
+        std::cout << "Log Difference between HEAD and " << remote->name << '/' << this->current_branch->name << ":\n" << *log_diff << std::endl;
+        delete(log_diff);
+      }
+    } else {
+      std::cout << "Nothing to merge from " << remote->name << '/' << this->current_branch->name << std::endl;
+    }
+  }
+
+  return true;
+}
+
+// Push base as refspec to every remote that is missing it or behind, and summarize
+bool Session::push_current_branch (const std::string& base, const std::string& refspec) {
+  // Count outgoing commits for every remote at once
+  std::vector<AheadBehind> outgoing;
+  if (!this->plan_sync(base, outgoing))
+    return false;
+
+  // Work out which remotes need a push
+  std::vector<std::string> push_names;
+  std::vector<Remote*> up_to_date;
+  for (const auto& remote : this->remotes) {
+    if (this->skipped_remotes.count(remote->name))
+      continue;
+
+    // Push if the branch is not on the remote yet, or the remote is behind
+    bool push = true;
+    for (uint32_t remote_index = 0; remote_index < this->current_branch->remotes.size(); remote_index++) {
+      if (this->current_branch->remotes.at(remote_index) == remote && outgoing.at(remote_index).valid)
+        push = outgoing.at(remote_index).outgoing > 0;
+    }
+
+    if (push) {
+      std::cout << "Pushing to " << remote->name << '/' << this->current_branch->name << std::endl;
+      push_names.push_back(remote->name);
     } else {
-      delete(log_diff);
       std::cout << "Nothing to push to " << remote->name << '/' << this->current_branch->name << std::endl;
+      up_to_date.push_back(remote);
+    }
+  }
+
+  // Push to all of them concurrently, one failing remote does not stop the others
+  std::vector<ProcessResult> push_results;
+  bool pushed_all = push_remotes(this->toplevel_path, push_names, refspec, this->jobs(), push_results);
+
+  // Summary
+  std::cout << "\nSync summary for " << this->current_branch->name << ":\n";
+  for (const auto& remote : this->remotes) {
+    std::string state;
+    if (std::find(up_to_date.begin(), up_to_date.end(), remote) != up_to_date.end())
+      state = "up to date";
+    if (this->skipped_remotes.count(remote->name))
+      state = "skipped, failed recently";
+    for (uint32_t push = 0; push < push_names.size(); push++) {
+      if (push_names.at(push) != remote->name)
+        continue;
+      if (push_results.at(push).exit_status == 0)
+        state = "pushed, up to date";
+      else {
+        state = "\033[41;1mpush failed\033[0m\n" + push_results.at(push).err;
+        this->failed_remotes.insert(remote->name);
+      }
+    }
+    std::cout << "    " << remote->name << '/' << this->current_branch->name << ": " << state << std::endl;
+  }
+
+  return pushed_all;
+}
+
+bool Session::plan_sync (const std::string& base, std::vector<AheadBehind>& counts) {
+  /*
+    All tips are resolved in one round-trip
+    to the cat-file coprocess first. Remote
+    refs that do not exist are left invalid,
+    identical tips are 0/0 without asking
+    git, and everything else is counted in
+    a single get_ahead_behind call.
+  */
+
+  std::vector<std::string> names = {base};
+  for (const auto& remote : this->current_branch->remotes)
+    names.push_back("refs/remotes/" + remote->name + '/' + this->current_branch->name);
+
+  std::vector<ObjectInfo> tips;
+  if (!this->cat_file.info(names, tips) || !tips.front().exists)
+    return false;
+
+  counts.clear();
+  std::vector<std::string> diverged;
+  for (uint32_t tip = 1; tip < tips.size(); tip++) {
+    AheadBehind count;
+    count.ref = names.at(tip);
+    count.incoming = 0;
+    count.outgoing = 0;
+    count.valid = tips.at(tip).exists && tips.at(tip).oid == tips.front().oid;
+    if (tips.at(tip).exists && !count.valid)
+      diverged.push_back(count.ref);
+    counts.push_back(count);
+  }
+
+  std::vector<AheadBehind> diverged_counts;
+  if (!get_ahead_behind(this->toplevel_path, this->git_version, base, diverged, this->jobs(), diverged_counts))
+    return false;
+
+  for (const auto& diverged_count : diverged_counts) {
+    for (auto& count : counts) {
+      if (count.ref == diverged_count.ref)
+        count = diverged_count;
     }
   }
 
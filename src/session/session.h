@@ -19,6 +19,54 @@ typedef struct Branch Branch;
 // Release version
 const std::string dugit_version = "0.0.2";
 
+/*
+  Startup happens in stages, run on
+  demand, and each command names the
+  ones it needs in command_stages.
+*/
+
+// git on $PATH, toplevel, gitdirs and .dugit
+const uint32_t stage_repository = 1 << 0;
+
+// .dugit/.lock, released at clean up
+const uint32_t stage_lock = 1 << 1;
+
+// Branches, remotes and the current branch, from the snapshot or the repository
+const uint32_t stage_refs = 1 << 2;
+
+// git version and the cat-file coprocess
+const uint32_t stage_objects = 1 << 3;
+
+const uint32_t stage_all = stage_repository | stage_lock | stage_refs | stage_objects;
+
+// Stages every command needs before it runs
+const std::unordered_map<std::string, uint32_t> command_stages = {
+  {"help", 0},
+  {"version", 0},
+  {"examples", 0},
+  {"commit", stage_repository | stage_lock | stage_objects},
+  {"sync", stage_all},
+};
+
+// Seconds to wait for .dugit/.lock before giving up ($DUGIT_LOCK_TIMEOUT overrides)
+const uint32_t default_lock_timeout = 60;
+
+// State directory of the repository at toplevel_path, .dugit/modules/<path> for a submodule
+std::string get_state_path(const std::string& superproject_path, const std::string& toplevel_path);
+
+// Whether args only run read only commands, which need no stage (no args prints help)
+bool is_read_only_command(const std::vector<std::string>& args);
+
+// Fleet mode (sync --repos <list file or directory>), run without a session of its own
+bool is_fleet_command(const std::vector<std::string>& args);
+bool fleet_sync(const std::vector<std::string>& args);
+
+// Stop starting syncs, false if no fleet is running
+bool interrupt_fleet();
+
+// The pool SIGINT stops, NULL once it is done
+void register_fleet_pool(WorkPool* pool);
+
 struct Session {
   /*
     This struct holds all session
@@ -31,20 +79,33 @@ struct Session {
   // Git version, this determines how git is called
   std::string git_version;
 
-  // $PPID - Parent Process ID
-  std::string ppid;
-
   // Working Path
   std::string working_path;
 
   // The local path to the repository
   std::string toplevel_path;
 
-  // .dugit path
+  // Outermost working tree, its .dugit holds the lock for every repository in it
+  std::string superproject_path;
+
+  // .dugit path, the state (snapshot, worktree) of this repository
   std::string dugit_path;
 
-  // .lock secured
-  bool lock_secured;
+  // gitdir of the working tree, and the common dir shared by its worktrees
+  std::string git_dir;
+  std::string common_dir;
+
+  // git configuration files the remotes were read from
+  std::vector<std::string> config_files;
+
+  // .dugit/.lock, held from the lock stage to clean up
+  FileLock lock;
+
+  // Startup stages done so far
+  uint32_t ready_stages = 0;
+
+  // stat results for the paths probed again and again (toplevel, .dugit)
+  ProbeCache probes;
 
   // Commands
   const std::vector<std::string> commands = {
@@ -64,11 +125,29 @@ struct Session {
     {"--no-warning", false},
     {"--fast-forward", false},
     {"--keep-index", false},
+    {"--show-log", false},
+    {"--octopus", false},
+    {"--isolated", false},
+    {"--recursive", false},
   };
 
+  // Command options that take a value (--option value or --option=value)
+  const std::unordered_map<std::string, std::string> default_options = {
+    {"--jobs", "4"},
+    {"--submodule-jobs", "8"},
+  };
+  std::unordered_map<std::string, std::string> options = default_options;
+
+  // Number of concurrent git jobs (--jobs), and of submodules synced at once (--submodule-jobs)
+  uint32_t jobs();
+  uint32_t submodule_jobs();
+
   // Stashed changes
   bool stashed_changes;
 
+  // Local changes left in the working tree during the merges
+  bool kept_changes;
+
   // Current branch
   Branch* current_branch;
 
@@ -78,6 +157,16 @@ struct Session {
   // List of Remotes
   std::vector<Remote*> remotes;
 
+  // git cat-file coprocess for object and ref queries
+  CatFile cat_file;
+
+  // Remotes a sync leaves out (dugitd backing off), and remotes a sync failed on
+  std::unordered_set<std::string> skipped_remotes;
+  std::unordered_set<std::string> failed_remotes;
+
+  // Paths dugitd saw change, NULL when nobody is watching the working tree
+  const DirtyPaths* dirty_paths = NULL;
+
   // Constructor Sequences
   Session();
 
@@ -88,18 +177,58 @@ struct Session {
   bool session_startup_sequence();
   bool session_startup_sequence(const std::string path);
 
+  // Get a long lived session (dugitd) ready for its next command
+  bool session_resume_sequence();
+
+  // Run the startup stages that are not done yet
+  bool prepare(uint32_t stages);
+
+  // Take .dugit/.lock, waiting a bounded time for whoever holds it
+  std::string lock_path() const;
+  bool acquire_lock();
+
+  // Startup for a submodule below anchor, which holds the lock for both
+  bool session_nested_sequence(const Session& anchor, const std::string& relative_path);
+
+  // Build branches, remotes and the current branch from the repository
+  bool load_repository_state();
+
+  // Persisted session snapshot in .dugit
+  bool load_snapshot();
+  bool save_snapshot();
+  std::vector<std::string> snapshot_key_paths();
+
   // dugit args parser
   bool args_parser(const std::vector<std::string>& args);
+  bool args_parser_commands(const std::vector<std::string>& args);
 
-  // Stash sequence
-  bool stash_repository();
+  // Repository state, natively when possible
+  bool load_state(RepoState& state, const bool check_untracked);
+
+  // Stash sequence, skipped when no incoming ref touches a dirty path
+  bool stash_repository(const std::vector<std::string>& incoming_refs);
+  bool stash_needed(const RepoState& state, const std::vector<std::string>& incoming_refs);
 
   // Commit Repository
-  bool commit_repository();
+  bool commit_repository(const bool stage = true);
 
   // Sync Repository
   bool sync_repository();
 
+  // Sync in a linked worktree under .dugit, leaving the user's checkout alone
+  bool sync_isolated();
+
+  // Sync every submodule below, leaves first, then the repository itself (sync --recursive)
+  bool sync_recursive();
+
+  // Sync steps shared by both modes
+  void fetch_current_branch(std::vector<bool>& fetched);
+  bool find_diverged(const std::vector<bool>& fetched, const std::string& base, std::vector<Remote*>& diverged);
+  bool push_current_branch(const std::string& base, const std::string& refspec);
+
+  // Ahead/behind counts of base against each remote of the current branch
+  bool plan_sync(const std::string& base, std::vector<AheadBehind>& counts);
+
   // Clean up sequence
   bool clean_up();
 };
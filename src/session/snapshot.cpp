@@ -0,0 +1,384 @@
+#include "session.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+/*
+  The snapshot is a small binary file,
+  .dugit/snapshot, laid out as
+
+    magic, format version
+    key:  identity (toplevel, gitdir, common dir, config environment),
+          config files,
+          path, exists, inode, size, mtime (s, ns) for every key path
+          (git executable, HEAD, packed-refs, config files, ref dirs)
+    data: git version,
+          remotes (name, fetch links, push links),
+          branches (name, is_local, remote indices),
+          current branch index
+
+  with strings stored as a u32 length
+  followed by the bytes. It is valid
+  for the same repository, seen through
+  the same environment, for as long as
+  its key paths are the ones the session
+  would pick, and every one of them
+  stats exactly as when it was taken.
+*/
+
+static const char snapshot_magic[8] = {'D', 'U', 'G', 'I', 'T', 'S', 'N', 'P'};
+static const uint32_t snapshot_format = 2;
+
+struct SnapshotWriter {
+  std::string data;
+
+  void u32 (const uint32_t value) { data.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+  void u64 (const uint64_t value) { data.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+  void str (const std::string& value) { u32(value.size()); data.append(value); }
+};
+
+struct SnapshotReader {
+  const char* position;
+  const char* end;
+  bool ok;
+
+  bool take (void* out, const size_t length) {
+    if (!ok || static_cast<size_t>(end - position) < length)
+      return ok = false;
+    memcpy(out, position, length);
+    position += length;
+    return true;
+  }
+
+  uint32_t u32 () { uint32_t value = 0; take(&value, sizeof(value)); return value; }
+  uint64_t u64 () { uint64_t value = 0; take(&value, sizeof(value)); return value; }
+  std::string str () {
+    uint32_t length = u32();
+    if (!ok || static_cast<size_t>(end - position) < length) {
+      ok = false;
+      return "";
+    }
+    std::string value(position, length);
+    position += length;
+    return value;
+  }
+};
+
+// Stat a key path into the writer
+static void snapshot_stat (SnapshotWriter& writer, const std::string& path) {
+  struct stat st;
+  writer.str(path);
+  if (stat(path.c_str(), &st) != 0) {
+    writer.u32(0);
+    writer.u64(0);
+    writer.u64(0);
+    writer.u64(0);
+    writer.u64(0);
+    return;
+  }
+
+  writer.u32(1);
+  writer.u64(st.st_ino);
+  writer.u64(st.st_size);
+  writer.u64(st.st_mtim.tv_sec);
+  writer.u64(st.st_mtim.tv_nsec);
+}
+
+// Collect a ref directory and every directory below it
+static void snapshot_ref_dirs (const std::string& path, std::vector<std::string>& paths) {
+  paths.push_back(path);
+
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    std::string child = path + '/' + entry->d_name;
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir = stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    if (is_dir)
+      snapshot_ref_dirs(child, paths);
+  } closedir(dir);
+}
+
+// Environment git reads configuration through
+static const std::vector<std::string> snapshot_environment = {
+  "GIT_DIR",
+  "GIT_WORK_TREE",
+  "GIT_CONFIG_NOSYSTEM",
+  "GIT_CONFIG_SYSTEM",
+  "GIT_CONFIG_GLOBAL",
+  "XDG_CONFIG_HOME",
+  "HOME",
+  "GIT_CONFIG_COUNT",
+};
+
+// What the snapshot was taken of, a snapshot of anything else is not this session's
+static std::vector<std::string> snapshot_identity (const Session& session) {
+  std::vector<std::string> identity = {session.toplevel_path, session.git_dir, session.common_dir};
+
+  // Unset and empty differ for some of them (GIT_CONFIG_NOSYSTEM)
+  for (const auto& name : snapshot_environment) {
+    const char* value = getenv(name.c_str());
+    identity.push_back(value == NULL ? name : name + '=' + value);
+  }
+
+  const char* count = getenv("GIT_CONFIG_COUNT");
+  for (int entry = 0; count != NULL && entry < std::atoi(count); entry++) {
+    for (const auto& name : {"GIT_CONFIG_KEY_", "GIT_CONFIG_VALUE_"}) {
+      std::string variable = name + std::to_string(entry);
+      const char* value = getenv(variable.c_str());
+      identity.push_back(value == NULL ? variable : variable + '=' + value);
+    }
+  }
+
+  return identity;
+}
+
+// Paths whose metadata decides whether the snapshot is still valid
+std::vector<std::string> Session::snapshot_key_paths () {
+  /*
+    Loose refs are always written to a
+    lock file and renamed into place,
+    which updates the mtime of their
+    directory, so the ref directories
+    stand in for every loose ref.
+  */
+
+  std::vector<std::string> paths;
+
+  std::string* git_executable = get_executable_path("git");
+  if (git_executable != NULL) {
+    paths.push_back(*git_executable);
+    delete(git_executable);
+  }
+
+  paths.push_back(this->git_dir + "/HEAD");
+  paths.push_back(this->common_dir + "/packed-refs");
+  for (const auto& config_file : this->config_files)
+    paths.push_back(config_file);
+
+  snapshot_ref_dirs(this->common_dir + "/refs/heads", paths);
+  snapshot_ref_dirs(this->common_dir + "/refs/remotes", paths);
+  return paths;
+}
+
+// Persist the derived session state
+bool Session::save_snapshot () {
+  SnapshotWriter writer;
+  writer.data.append(snapshot_magic, sizeof(snapshot_magic));
+  writer.u32(snapshot_format);
+
+  // Key
+  std::vector<std::string> identity = snapshot_identity(*this);
+  writer.u32(identity.size());
+  for (const auto& value : identity)
+    writer.str(value);
+
+  writer.u32(this->config_files.size());
+  for (const auto& config_file : this->config_files)
+    writer.str(config_file);
+
+  std::vector<std::string> paths = this->snapshot_key_paths();
+  writer.u32(paths.size());
+  for (const auto& path : paths)
+    snapshot_stat(writer, path);
+
+  // Data
+  writer.str(this->git_version);
+
+  std::unordered_map<Remote*, uint32_t> remote_indices;
+  writer.u32(this->remotes.size());
+  for (uint32_t remote = 0; remote < this->remotes.size(); remote++) {
+    remote_indices[this->remotes[remote]] = remote;
+    writer.str(this->remotes[remote]->name);
+    writer.u32(this->remotes[remote]->fetch_links.size());
+    for (const auto& link : this->remotes[remote]->fetch_links)
+      writer.str(link);
+    writer.u32(this->remotes[remote]->push_links.size());
+    for (const auto& link : this->remotes[remote]->push_links)
+      writer.str(link);
+  }
+
+  uint32_t current_branch = UINT32_MAX;
+  writer.u32(this->branches.size());
+  for (uint32_t branch = 0; branch < this->branches.size(); branch++) {
+    if (this->branches[branch] == this->current_branch)
+      current_branch = branch;
+    writer.str(this->branches[branch]->name);
+    writer.u32(this->branches[branch]->is_local);
+    writer.u32(this->branches[branch]->remotes.size());
+    for (const auto& remote : this->branches[branch]->remotes)
+      writer.u32(remote_indices[remote]);
+  }
+  writer.u32(current_branch);
+
+  // Write to a temporary file and rename it into place
+  std::string path = this->dugit_path + "/snapshot";
+  std::string temporary_path = path + ".tmp";
+  int file_descriptor = open(temporary_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+  if (file_descriptor == -1) {
+    std::string err_msg = "save_snapshot() ==> Failed to open file: " + temporary_path + '\n';
+    print_error(err_msg.c_str());
+    return false;
+  }
+
+  size_t written = 0;
+  while (written < writer.data.size()) {
+    ssize_t count = write(file_descriptor, writer.data.data() + written, writer.data.size() - written);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count <= 0) {
+      close(file_descriptor);
+      remove(temporary_path.c_str());
+      return false;
+    } written += count;
+  }
+
+  close(file_descriptor);
+  if (rename(temporary_path.c_str(), path.c_str()) != 0) {
+    remove(temporary_path.c_str());
+    return false;
+  } return true;
+}
+
+// Load the derived session state if it is still valid
+bool Session::load_snapshot () {
+  std::string path = this->dugit_path + "/snapshot";
+  int file_descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(file_descriptor, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(snapshot_magic) + sizeof(uint32_t))) {
+    close(file_descriptor);
+    return false;
+  }
+
+  void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+  close(file_descriptor);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  SnapshotReader reader;
+  reader.position = static_cast<const char*>(mapped);
+  reader.end = reader.position + st.st_size;
+  reader.ok = true;
+
+  std::vector<Remote*> remotes;
+  std::vector<Branch*> branches;
+  Branch* current_branch = NULL;
+  std::string git_version;
+  std::vector<std::string> config_files;
+  bool valid = memcmp(reader.position, snapshot_magic, sizeof(snapshot_magic)) == 0;
+  reader.position += sizeof(snapshot_magic);
+  valid = valid && reader.u32() == snapshot_format;
+
+  // Key, the same repository and environment
+  std::vector<std::string> identity = snapshot_identity(*this);
+  valid = valid && reader.u32() == identity.size();
+  for (uint32_t value = 0; valid && value < identity.size(); value++)
+    valid = reader.str() == identity[value] && reader.ok;
+
+  // Config files are needed to pick the key paths, and to take the next snapshot
+  uint32_t config_file_count = valid ? reader.u32() : 0;
+  for (uint32_t config_file = 0; reader.ok && config_file < config_file_count; config_file++)
+    config_files.push_back(reader.str());
+
+  // The paths this session would key on, each one stating exactly as it did
+  std::vector<std::string> paths;
+  if (valid && reader.ok) {
+    std::vector<std::string> session_config_files = this->config_files;
+    this->config_files = config_files;
+    paths = this->snapshot_key_paths();
+    this->config_files = session_config_files;
+  }
+
+  uint32_t path_count = valid ? reader.u32() : 0;
+  valid = valid && reader.ok && path_count == paths.size();
+  for (uint32_t key = 0; valid && key < path_count; key++) {
+    std::string key_path = reader.str();
+    uint32_t exists = reader.u32();
+    uint64_t inode = reader.u64();
+    uint64_t size = reader.u64();
+    uint64_t mtime_sec = reader.u64();
+    uint64_t mtime_nsec = reader.u64();
+    if (!reader.ok || key_path != paths[key]) {
+      valid = false;
+      break;
+    }
+
+    struct stat key_st;
+    if (stat(key_path.c_str(), &key_st) != 0)
+      valid = exists == 0;
+    else valid = exists == 1 && inode == static_cast<uint64_t>(key_st.st_ino) &&
+      size == static_cast<uint64_t>(key_st.st_size) &&
+      mtime_sec == static_cast<uint64_t>(key_st.st_mtim.tv_sec) &&
+      mtime_nsec == static_cast<uint64_t>(key_st.st_mtim.tv_nsec);
+  }
+
+  // Data
+  if (valid) {
+    git_version = reader.str();
+
+    uint32_t remote_count = reader.u32();
+    for (uint32_t remote = 0; reader.ok && remote < remote_count; remote++) {
+      Remote* new_remote = new Remote;
+      remotes.push_back(new_remote);
+      new_remote->name = reader.str();
+      uint32_t fetch_count = reader.u32();
+      for (uint32_t link = 0; reader.ok && link < fetch_count; link++)
+        new_remote->fetch_links.push_back(reader.str());
+      uint32_t push_count = reader.u32();
+      for (uint32_t link = 0; reader.ok && link < push_count; link++)
+        new_remote->push_links.push_back(reader.str());
+    }
+
+    uint32_t branch_count = reader.u32();
+    for (uint32_t branch = 0; reader.ok && branch < branch_count; branch++) {
+      Branch* new_branch = new Branch;
+      branches.push_back(new_branch);
+      new_branch->name = reader.str();
+      new_branch->is_local = reader.u32() != 0;
+      uint32_t remote_count = reader.u32();
+      for (uint32_t remote = 0; reader.ok && remote < remote_count; remote++) {
+        uint32_t index = reader.u32();
+        if (index >= remotes.size()) {
+          reader.ok = false;
+          break;
+        } new_branch->remotes.push_back(remotes[index]);
+      }
+    }
+
+    uint32_t current_branch_index = reader.u32();
+    if (current_branch_index < branches.size())
+      current_branch = branches[current_branch_index];
+
+    valid = reader.ok && current_branch != NULL && !git_version.empty();
+  }
+
+  munmap(mapped, st.st_size);
+
+  if (!valid) {
+    for (const auto& branch : branches)
+      delete(branch);
+    for (const auto& remote : remotes)
+      delete(remote);
+    return false;
+  }
+
+  this->git_version = git_version;
+  this->remotes = remotes;
+  this->branches = branches;
+  this->current_branch = current_branch;
+  this->config_files = config_files;
+  return true;
+}
@@ -0,0 +1,268 @@
+#include "session.h"
+
+/*
+  sync --recursive syncs every checked
+  out submodule below the repository it
+  runs in, nested ones included, before
+  the repository itself. A submodule can
+  only be synced once every submodule
+  inside it is, since it has to commit
+  their new gitlinks first, so they go
+  level by level: all the leaves at once
+  on a WorkPool, then everything whose
+  submodules are all done, and so on up.
+*/
+
+struct SubmoduleNode {
+  // Path relative to the repository sync runs in, "" for that repository
+  std::string path;
+
+  // Index of the parent node (-1 for the repository itself) and of the children
+  int32_t parent;
+  std::vector<uint32_t> children;
+
+  // 0 for leaves, one more than the highest child otherwise
+  uint32_t height;
+
+  // Nothing to sync on a detached HEAD, which is how git submodule update leaves them
+  bool detached;
+
+  bool started;
+  bool succeeded;
+
+  // Commit the parent's index records, and whether HEAD is elsewhere after the sync
+  std::string gitlink;
+  bool moved;
+
+  double seconds;
+  std::vector<std::string> failed_remotes;
+  std::string output;
+};
+
+// Commit the gitlinks of the children of a node that synced and moved
+static bool commit_gitlinks (const std::string& toplevel_path, const std::vector<SubmoduleNode>& nodes, const uint32_t node) {
+  std::string prefix = nodes[node].path.empty() ? "" : nodes[node].path + '/';
+
+  std::vector<std::string> paths;
+  for (const auto& child : nodes[node].children) {
+    if (nodes[child].moved)
+      paths.push_back(nodes[child].path.substr(prefix.length()));
+  }
+
+  if (paths.empty())
+    return true;
+
+  std::cout << "Committing the new commits of submodules:" << std::endl;
+  for (const auto& path : paths)
+    std::cout << "    " << path << std::endl;
+  return commit_paths(toplevel_path + '/' + prefix, paths, commit_submodule_message(paths));
+}
+
+// Commit the gitlinks of a submodule, then sync it in a session of its own
+static bool sync_submodule (const Session& anchor, std::vector<SubmoduleNode>& nodes, const uint32_t node) {
+  SubmoduleNode& current = nodes[node];
+  if (current.detached) {
+    std::cout << "HEAD is detached, nothing to sync" << std::endl;
+    for (const auto& child : current.children) {
+      if (nodes[child].moved)
+        std::cout << nodes[child].path << " moved, its gitlink is not committed on a detached HEAD" << std::endl;
+    } return true;
+  }
+
+  Session session;
+  if (!session.session_nested_sequence(anchor, current.path))
+    return false;
+
+  /*
+    Compared with the gitlink, not with
+    HEAD before the sync, a commit made
+    in the submodule by hand also has
+    to be committed in its parent.
+  */
+
+  bool synced = commit_gitlinks(anchor.toplevel_path, nodes, node) && session.sync_repository();
+
+  std::string head = session.cat_file.resolve("HEAD");
+  current.moved = synced && !head.empty() && head != current.gitlink;
+  current.failed_remotes.assign(session.failed_remotes.begin(), session.failed_remotes.end());
+  std::sort(current.failed_remotes.begin(), current.failed_remotes.end());
+  return synced;
+}
+
+// Startup for a submodule below anchor, which holds the lock for both
+bool Session::session_nested_sequence (const Session& anchor, const std::string& relative_path) {
+  /*
+    Nobody can answer a prompt for a
+    submodule synced in the background,
+    so it runs with --no-warning and
+    --auto-message. Its snapshot and
+    worktree live in .dugit/modules/
+    <path>, under the lock the anchor
+    already holds.
+  */
+
+  this->stashed_changes = false;
+  this->kept_changes = false;
+  this->git_version = anchor.git_version;
+
+  this->flags = anchor.flags;
+  this->flags.at("--recursive") = false;
+  this->flags.at("--no-warning") = true;
+  this->flags.at("--auto-message") = true;
+  this->options = anchor.options;
+
+  this->working_path = anchor.toplevel_path + '/' + relative_path;
+  this->toplevel_path = this->working_path;
+  if (!get_git_dirs(this->toplevel_path, this->git_dir, this->common_dir))
+    return false;
+
+  this->superproject_path = anchor.superproject_path;
+  this->dugit_path = get_state_path(this->superproject_path, this->toplevel_path);
+  if (!create_dirs(this->dugit_path))
+    return false;
+
+  if (!this->load_snapshot()) {
+    if (!this->load_repository_state())
+      return false;
+    this->save_snapshot();
+  }
+
+  this->cat_file.set_repository(this->toplevel_path, this->git_version);
+
+  // Everything, the lock is the anchor's
+  this->ready_stages = stage_all;
+  return true;
+}
+
+// Sync every submodule below, leaves first, then the repository itself (sync --recursive)
+bool Session::sync_recursive () {
+  // Every checked out submodule, parents always before their children
+  std::vector<SubmoduleNode> nodes(1);
+  nodes.front().parent = -1;
+  for (uint32_t node = 0; node < nodes.size(); node++) {
+    nodes[node].height = 0;
+    nodes[node].started = false;
+    nodes[node].succeeded = false;
+    nodes[node].moved = false;
+    nodes[node].seconds = 0;
+
+    std::string path = this->toplevel_path + (nodes[node].path.empty() ? "" : '/' + nodes[node].path);
+    std::string git_dir;
+    std::string common_dir;
+    Ref head;
+    nodes[node].detached = node > 0 && get_git_dirs(path, git_dir, common_dir) && read_head(git_dir, head) && head.symref.empty();
+
+    std::vector<Submodule> submodules;
+    if (!get_submodules(path, submodules)) {
+      std::string err_msg = "sync_recursive() ==> Could not read the submodules at path: " + path + '\n';
+      print_error(err_msg.c_str());
+      return false;
+    }
+
+    for (const auto& submodule : submodules) {
+      SubmoduleNode child;
+      child.path = nodes[node].path.empty() ? submodule.path : nodes[node].path + '/' + submodule.path;
+      child.parent = node;
+      child.gitlink = submodule.gitlink;
+      nodes[node].children.push_back(nodes.size());
+      nodes.push_back(child);
+    }
+  }
+
+  for (uint32_t node = nodes.size() - 1; node > 0; node--) {
+    SubmoduleNode& parent = nodes[nodes[node].parent];
+    parent.height = std::max(parent.height, nodes[node].height + 1);
+  }
+
+  if (nodes.size() == 1) {
+    std::cout << "No submodules are checked out, syncing " << this->toplevel_path << " alone" << std::endl;
+    return this->sync_repository();
+  }
+
+  uint32_t total = nodes.size() - 1;
+  std::cout << "Syncing " << total << " submodule(s), " << this->submodule_jobs() << " at a time, innermost first..." << std::endl;
+
+  // One pool per level, a level starts once the one below it is done
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<uint32_t> done(0);
+  bool interrupted = false;
+  for (uint32_t height = 0; height < nodes.front().height && !interrupted; height++) {
+    std::vector<PoolTask> tasks;
+    for (uint32_t node = 1; node < nodes.size(); node++) {
+      if (nodes[node].height != height)
+        continue;
+
+      PoolTask task;
+      task.run = [this, &nodes, node, &done, total] () {
+        SubmoduleNode& current = nodes[node];
+        auto start = std::chrono::steady_clock::now();
+        current.started = true;
+        {
+          ThreadOutput capture(current.output);
+          current.succeeded = sync_submodule(*this, nodes, node);
+        }
+        current.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::string state = current.detached ? "detached, not synced" : current.moved ? "synced, moved" : "synced";
+        if (!current.succeeded)
+          state = "\033[41;1mfailed\033[0m";
+
+        // Progress line, and the whole output of a submodule that failed
+        std::ostringstream progress;
+        progress << '[' << ++done << '/' << total << "] " << current.path << ": " << state <<
+          " (" << std::fixed << std::setprecision(1) << current.seconds << "s)\n";
+        if (!current.succeeded) {
+          for (const auto& line : get_lines_from_string(current.output))
+            progress << "    " << line << '\n';
+        } print_whole(progress.str());
+      };
+      tasks.push_back(task);
+    }
+
+    WorkPool pool(this->submodule_jobs(), tasks.size());
+    register_fleet_pool(&pool);
+    pool.run(tasks);
+    register_fleet_pool(NULL);
+    interrupted = pool.stopping;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Summary
+  uint32_t synced = 0;
+  uint32_t detached = 0;
+  uint32_t failed = 0;
+  double busy = 0;
+  for (uint32_t node = 1; node < nodes.size(); node++) {
+    busy += nodes[node].seconds;
+    if (nodes[node].succeeded && nodes[node].detached) detached++;
+    else if (nodes[node].succeeded) synced++;
+    else if (nodes[node].started) failed++;
+  }
+
+  std::cout << "\nSubmodule summary:\n" << std::fixed << std::setprecision(1) <<
+    "    " << synced << " synced, " << detached << " detached, " << failed << " failed, " <<
+    total - synced - detached - failed << " not started\n" <<
+    "    " << seconds << "s, for " << busy << "s of syncing\n";
+  for (uint32_t node = 1; node < nodes.size(); node++) {
+    if (nodes[node].succeeded || !nodes[node].started)
+      continue;
+    std::cout << "    \033[41;1mfailed\033[0m " << nodes[node].path;
+    if (!nodes[node].failed_remotes.empty()) {
+      std::cout << " (remotes:";
+      for (const auto& remote : nodes[node].failed_remotes)
+        std::cout << ' ' << remote;
+      std::cout << ')';
+    } std::cout << std::endl;
+  }
+  std::cout << std::endl;
+
+  if (interrupted) {
+    std::cout << "Interrupted, " << this->toplevel_path << " was not synced." << std::endl;
+    return false;
+  }
+
+  // The repository itself, with the prompts the user asked for
+  if (!commit_gitlinks(this->toplevel_path, nodes, 0) || !this->sync_repository())
+    return false;
+  return failed == 0;
+}
@@ -7,6 +7,7 @@ void run_tests () {
   t_get_cwd();
   t_get_pwd();
   t_get_exec_path();
+  t_run_process();
   t_check_dugit_external_dependencies();
   t_get_git_version();
   t_get_remote_names();
@@ -21,10 +22,19 @@ void run_tests () {
   t_get_dugit_path();
   t_create_dugit_directory();
   t_add_dugit_to_gitignore();
-  t_set_lock_file();
-  t_check_lock_file();
-  t_unset_lock_file();
+  t_file_lock();
   t_fetch_remote();
+  t_cat_file();
+  t_repo_state();
+  t_git_index();
+  t_dirty_paths();
+  t_timer_wheel();
+  t_work_pool();
+  t_get_submodules();
+  t_discover_repository();
+  t_probe_cache();
+  t_command_stages();
+  t_snapshot_identity();
 }
 
 // Definitions
@@ -102,6 +112,37 @@ void t_get_exec_path () {
   delete(git_exec_path);
 }
 
+void t_run_process () {
+  // Arguments must reach the child untouched, quotes and all
+  ProcessResult result;
+  std::string arg = "say \"hi\" $HOME `x`";
+  if (!run_process({"printf", "%s", arg}, "/", result)) {
+    std::cout << "t_run_process: NULL\n";
+    return;
+  }
+
+  if (result.out == arg)
+    std::cout << "t_run_process: SUCCESS\n";
+  else std::cout << "t_run_process: " << result.out << " NULL\n";
+
+  // More than a pipe buffer on both streams at once must not deadlock
+  size_t streamed = 0;
+  if (!run_process({"sh", "-c", "head -c 1000000 /dev/zero >&2; head -c 1000000 /dev/zero"}, "", result,
+  [&streamed] (const char*, size_t length) { streamed += length; }, StreamCallback())) {
+    std::cout << "t_run_process: large output NULL\n";
+    return;
+  }
+
+  if (result.out.size() == 1000000 && result.err.size() == 1000000 && streamed == 1000000)
+    std::cout << "t_run_process: large output SUCCESS\n";
+  else std::cout << "t_run_process: large output NULL\n";
+
+  // A bounded run stops an endless writer once it has enough
+  if (run_process_bounded({"yes"}, "", 10, result) && result.truncated && result.out.size() == 10)
+    std::cout << "t_run_process: bounded SUCCESS\n";
+  else std::cout << "t_run_process: bounded NULL\n";
+}
+
 void t_get_git_version () {
   std::string* git_version = get_git_version();
 
@@ -420,122 +461,342 @@ void t_add_dugit_to_gitignore () {
   delete(toplevel_path);
 }
 
-void t_check_lock_file () {
-  std::string* ppid = get_ppid();
-  if (ppid == NULL) {
-    std::cout << "t_check_lock_file: NULL\n";
-    return;
-  }
+void t_check_dugit_external_dependencies () {
+  if (check_dugit_external_dependencies())
+    std::cout << "t_check_dugit_external_dependencies: SUCCESS\n";
+  else std::cout << "t_check_dugit_external_dependencies: NULL\n";
+}
 
+void t_fetch_remote () {
   std::string* cwd = get_cwd();
   if (cwd == NULL) {
-    delete(ppid);
-    std::cout << "t_check_lock_file: NULL\n";
+    std::cout << "t_fetch_remote: NULL\n";
     return;
   }
 
-  std::string* dugit_path = get_dugit_path(*cwd);
-  if (dugit_path == NULL) {
-    delete(ppid);
+  std::string* remote_names = get_remote_names(*cwd);
+  if (remote_names == NULL) {
     delete(cwd);
-    std::cout << "t_check_lock_file: NULL\n";
+    std::cout << "t_fetch_remote: NULL\n";
     return;
   }
 
-  if (check_lock_file(*dugit_path + "/.lock", *ppid))
-    std::cout << "t_check_lock_file: SUCCESS\n";
-  else std::cout << "t_check_lock_file: NULL\n";
-  delete(ppid);
+  std::string* current_branch_name = get_current_branch_name(*cwd);
+  if (current_branch_name == NULL) {
+    delete(cwd);
+    delete(remote_names);
+    std::cout << "t_fetch_remote: NULL\n";
+    return;
+  }
+
+  for (const auto& remote_name : get_lines_from_string(*remote_names)) {
+    if (fetch_remote(*cwd, remote_name, *current_branch_name))
+      std::cout << "t_fetch_remote: " << remote_name << "/" << *current_branch_name << " SUCCESS"<< std::endl;
+    else std::cout << "t_fetch_remote: " << remote_name << "/" << *current_branch_name << " NULL"<< std::endl;
+  }
+
   delete(cwd);
-  delete(dugit_path);
+  delete(remote_names);
+  delete(current_branch_name);
 }
 
-void t_set_lock_file () {
-  std::string* ppid = get_ppid();
-  if (ppid == NULL) {
-    std::cout << "t_set_lock_file: NULL\n";
-    return;
-  }
 
+void t_cat_file () {
   std::string* cwd = get_cwd();
   if (cwd == NULL) {
-    delete(ppid);
-    std::cout << "t_set_lock_file: NULL\n";
+    std::cout << "t_cat_file: NULL\n";
     return;
   }
 
-  std::string* dugit_path = get_dugit_path(*cwd);
-  if (dugit_path == NULL) {
-    delete(ppid);
+  std::string* git_version = get_git_version();
+  if (git_version == NULL) {
     delete(cwd);
-    std::cout << "t_set_lock_file: NULL\n";
+    std::cout << "t_cat_file: NULL\n";
     return;
   }
 
-  if (set_lock_file(*dugit_path + "/.lock", *ppid))
-    std::cout << "t_set_lock_file: SUCCESS\n";
-  else std::cout << "t_set_lock_file: NULL\n";
-  delete(ppid);
+  CatFile cat_file;
+  cat_file.set_repository(*cwd, *git_version);
   delete(cwd);
-  delete(dugit_path);
+  delete(git_version);
+
+  std::vector<ObjectInfo> infos;
+  if (!cat_file.info({"HEAD", "HEAD^{tree}", "refs/heads/does-not-exist"}, infos) || infos.size() != 3) {
+    std::cout << "t_cat_file: NULL\n";
+    return;
+  }
+
+  for (const auto& info : infos) {
+    if (info.exists)
+      std::cout << "t_cat_file: " << info.name << " => " << info.oid << ' ' << info.type << ' ' << info.size << std::endl;
+    else std::cout << "t_cat_file: " << info.name << " => missing" << std::endl;
+  }
+
+  ObjectInfo head;
+  std::string content;
+  if (cat_file.contents("HEAD", head, content) && head.exists && content.size() == head.size)
+    std::cout << "t_cat_file: contents SUCCESS\n";
+  else std::cout << "t_cat_file: contents NULL\n";
+}
+void t_repo_state () {
+  const char output[] =
+    "# branch.oid 1111111111111111111111111111111111111111\0"
+    "# branch.head main\0"
+    "# branch.upstream origin/main\0"
+    "# branch.ab +2 -3\0"
+    "1 M. N... 100644 100644 100644 aaaa bbbb staged file\0"
+    "1 .M N... 100644 100644 100644 aaaa aaaa unstaged\0"
+    "2 R. N... 100644 100644 100644 aaaa aaaa R100 new\0old\0"
+    "u UU N... 100644 100644 100644 100644 aaaa bbbb cccc conflict\0"
+    "? untracked\0";
+
+  RepoState state;
+  state.parse(output, sizeof(output) - 1);
+
+  if (state.head == "main" && state.upstream == "origin/main" && state.ahead == 2 && state.behind == 3 &&
+  state.staged.size() == 2 && state.staged.front() == "staged file" &&
+  state.unstaged.size() == 1 && state.unstaged.front() == "unstaged" &&
+  state.renamed_from.size() == 1 && state.renamed_from.front() == "old" &&
+  state.conflicted.size() == 1 && state.conflicted.front() == "conflict" &&
+  state.untracked.size() == 1 && state.untracked.front() == "untracked")
+    std::cout << "t_repo_state: SUCCESS\n";
+  else std::cout << "t_repo_state: NULL\n";
 }
 
-void t_unset_lock_file () {
+void t_git_index () {
   std::string* cwd = get_cwd();
   if (cwd == NULL) {
-    std::cout << "t_unset_lock_file: NULL\n";
+    std::cout << "t_git_index: NULL\n";
     return;
   }
 
-  std::string* dugit_path = get_dugit_path(*cwd);
-  if (dugit_path == NULL) {
+  GitIndex index;
+  if (!index.load(*cwd + "/.git", 20) || index.entries.empty()) {
     delete(cwd);
-    std::cout << "t_unset_lock_file: NULL\n";
+    std::cout << "t_git_index: NULL\n";
+    return;
+  } delete(cwd);
+
+  std::cout << "t_git_index: version " << index.version << ", " << index.entries.size() << " entries, cache-tree " <<
+    (index.tree_oid.empty() ? "invalid" : index.tree_oid) << std::endl;
+  if (index.tracked(index.entries.back().path) && !index.tracked(index.entries.back().path + "-missing"))
+    std::cout << "t_git_index: lookup SUCCESS\n";
+  else std::cout << "t_git_index: lookup NULL\n";
+}
+
+void t_dirty_paths () {
+  std::string* cwd = get_cwd();
+  if (cwd == NULL) {
+    std::cout << "t_dirty_paths: NULL\n";
     return;
   }
 
-  if (unset_lock_file(*dugit_path + "/.lock"))
-    std::cout << "t_unset_lock_file: SUCCESS\n";
-  else std::cout << "t_unset_lock_file: NULL\n";
+  // Limited to a path that does not exist, nothing can be reported
+  DirtyPaths dirty_paths;
+  dirty_paths.record(*cwd + "/.git", *cwd + "/.git");
+  RepoState state;
+  if (dirty_paths.current(*cwd + "/.git", *cwd + "/.git") &&
+  state.load(*cwd, *cwd + "/.git", {"t_dirty_paths-missing"}) && state.paths().empty())
+    std::cout << "t_dirty_paths: SUCCESS\n";
+  else std::cout << "t_dirty_paths: NULL\n";
   delete(cwd);
-  delete(dugit_path);
 }
 
-void t_check_dugit_external_dependencies () {
-  if (check_dugit_external_dependencies())
-    std::cout << "t_check_dugit_external_dependencies: SUCCESS\n";
-  else std::cout << "t_check_dugit_external_dependencies: NULL\n";
+void t_timer_wheel () {
+  // One timer within the first turn, one more than a turn out
+  TimerWheel wheel;
+  uint64_t start = wheel.tick;
+  wheel.schedule("near", 3);
+  wheel.schedule("far", TimerWheel::slot_count + 3);
+
+  std::vector<std::string> due;
+  wheel.advance(start + 3, due);
+  bool near = due.size() == 1 && due.front() == "near";
+
+  due.clear();
+  wheel.advance(start + TimerWheel::slot_count + 2, due);
+  bool early = !due.empty();
+  wheel.advance(start + TimerWheel::slot_count + 3, due);
+
+  if (near && !early && due.size() == 1 && due.front() == "far" && wheel.count == 0)
+    std::cout << "t_timer_wheel: SUCCESS\n";
+  else std::cout << "t_timer_wheel: NULL\n";
 }
 
-void t_fetch_remote () {
+void t_work_pool () {
+  // Every task runs once, and never more than two hold the same key
+  std::mutex mutex;
+  std::unordered_map<std::string, uint32_t> running;
+  uint32_t most = 0;
+  std::atomic<uint32_t> ran(0);
+
+  std::vector<PoolTask> tasks;
+  for (uint32_t task = 0; task < 24; task++) {
+    PoolTask pool_task;
+    pool_task.keys = {task % 2 ? "odd" : "even", "all"};
+    pool_task.run = [&mutex, &running, &most, &ran, pool_task] () {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& key : pool_task.keys)
+          most = std::max(most, ++running[key]);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& key : pool_task.keys)
+          running[key]--;
+      } ran++;
+    };
+    tasks.push_back(pool_task);
+  }
+
+  WorkPool pool(4, 2);
+  pool.run(tasks);
+
+  if (ran == tasks.size() && most <= 2)
+    std::cout << "t_work_pool: SUCCESS\n";
+  else std::cout << "t_work_pool: NULL\n";
+}
+
+void t_get_submodules () {
+  // A superproject with a single submodule, checked out at lib
+  char dir_template[] = "/tmp/dugit_submodules_XXXXXX";
+  if (mkdtemp(dir_template) == NULL) {
+    std::cout << "t_get_submodules: NULL\n";
+    return;
+  }
+
+  std::string root = dir_template;
+  std::vector<std::vector<std::string>> commands = {
+    {"git", "init", "-q", root + "/sub"},
+    {"git", "-C", root + "/sub", "-c", "user.name=dugit", "-c", "user.email=dugit@localhost", "commit", "-q", "--allow-empty", "-m", "sub"},
+    {"git", "init", "-q", root + "/super"},
+    {"git", "-C", root + "/super", "-c", "protocol.file.allow=always", "submodule", "add", "-q", root + "/sub", "lib"},
+  };
+
+  ProcessResult result;
+  bool created = true;
+  for (const auto& command : commands)
+    created = created && run_process(command, "", result);
+
+  ProcessResult head;
+  std::vector<Submodule> submodules;
+  bool found = created && run_process({"git", "-C", root + "/sub", "rev-parse", "HEAD"}, "", head) &&
+    get_submodules(root + "/super", submodules) && submodules.size() == 1 && submodules[0].name == "lib" &&
+    submodules[0].path == "lib" && submodules[0].gitlink + '\n' == head.out;
+  run_process({"rm", "-rf", root}, "", result);
+
+  std::cout << "t_get_submodules: " << (found ? "SUCCESS" : "NULL") << std::endl;
+}
+
+void t_discover_repository () {
   std::string* cwd = get_cwd();
   if (cwd == NULL) {
-    std::cout << "t_fetch_remote: NULL\n";
+    std::cout << "t_discover_repository: NULL\n";
     return;
   }
 
-  std::string* remote_names = get_remote_names(*cwd);
-  if (remote_names == NULL) {
-    delete(cwd);
-    std::cout << "t_fetch_remote: NULL\n";
+  // Must agree with git rev-parse --show-toplevel
+  RepoLocation location;
+  std::string* toplevel_path = get_toplevel_path(*cwd);
+  if (toplevel_path != NULL && discover_repository(*cwd, location) && location.toplevel == *toplevel_path)
+    std::cout << "t_discover_repository: " << location.toplevel << ", gitdir " << location.git_dir << ", superproject " << location.superproject << std::endl;
+  else std::cout << "t_discover_repository: NULL\n";
+  delete(toplevel_path);
+  delete(cwd);
+}
+
+void t_probe_cache () {
+  // A missing directory stays missing in the cache until the cache creates it, parents included
+  std::string path = "/tmp/dugit-t_probe_cache-" + std::to_string(getpid());
+  ProbeCache probes;
+  bool missing = !probes.is_dir(path) && !probes.is_dir(path + "/nested");
+  bool created = probes.create_dirs(path + "/nested") && probes.is_dir(path) && probes.is_dir(path + "/nested");
+  rmdir((path + "/nested").c_str());
+  rmdir(path.c_str());
+
+  if (missing && created && probes.is_dir("/tmp"))
+    std::cout << "t_probe_cache: SUCCESS\n";
+  else std::cout << "t_probe_cache: NULL\n";
+}
+
+void t_file_lock () {
+  char dir_template[] = "/tmp/dugit_lock_XXXXXX";
+  if (mkdtemp(dir_template) == NULL) {
+    std::cout << "t_file_lock: NULL\n";
     return;
   }
 
-  std::string* current_branch_name = get_current_branch_name(*cwd);
-  if (current_branch_name == NULL) {
-    delete(cwd);
-    delete(remote_names);
-    std::cout << "t_fetch_remote: NULL\n";
+  std::string path = std::string(dir_template) + "/.lock";
+  FileLock exclusive;
+  FileLock shared;
+  FileLock other;
+
+  // An exclusive holder keeps everyone out, and says who it is
+  std::string owner;
+  bool held = exclusive.try_acquire(path, false, "t_file_lock") && read_file(path, owner) && owner == "t_file_lock\n";
+  bool refused = !shared.try_acquire(path, true, "") && shared.contended && !other.acquire(path, false, "", 0);
+
+  // Shared holders only keep exclusive ones out, and leave no name behind
+  exclusive.release();
+  bool together = shared.try_acquire(path, true, "") && other.try_acquire(path, true, "");
+  shared.release();
+  bool exclusive_refused = !exclusive.try_acquire(path, false, "t_file_lock") && exclusive.contended;
+  other.release();
+  bool released = exclusive.try_acquire(path, false, "t_file_lock");
+  exclusive.release();
+  released = released && read_file(path, owner) && owner.empty() && !exclusive.held();
+
+  std::remove(path.c_str());
+  rmdir(dir_template);
+
+  std::cout << "t_file_lock: " << (held ? "SUCCESS" : "NULL") << " (exclusive)\n";
+  std::cout << "t_file_lock: " << (refused ? "SUCCESS" : "NULL") << " (contended)\n";
+  std::cout << "t_file_lock: " << (together && exclusive_refused ? "SUCCESS" : "NULL") << " (shared)\n";
+  std::cout << "t_file_lock: " << (released ? "SUCCESS" : "NULL") << " (released)\n";
+}
+
+void t_command_stages () {
+  // version runs anywhere, without even looking for a repository
+  Session outside;
+  bool lazy = outside.session_startup_sequence("/") && outside.args_parser({"version"}) &&
+    outside.ready_stages == 0 && outside.toplevel_path.empty();
+  std::cout << "t_command_stages: " << (lazy ? "SUCCESS" : "NULL") << " (version)\n";
+
+  // commit needs the lock and cat-file, never the remotes
+  Session inside;
+  bool prepared = inside.session_startup_sequence() && inside.prepare(command_stages.at("commit")) &&
+    inside.lock.held() && !(inside.ready_stages & stage_refs) && inside.remotes.empty() &&
+    !inside.cat_file.resolve("HEAD").empty();
+  std::cout << "t_command_stages: " << (prepared ? "SUCCESS" : "NULL") << " (commit)\n";
+}
+
+void t_snapshot_identity () {
+  // Taken with the refs stage, valid for the same session
+  Session session;
+  if (!session.session_startup_sequence() || !session.prepare(stage_refs)) {
+    std::cout << "t_snapshot_identity: NULL\n";
     return;
   }
+  session.clean_up();
 
-  for (const auto& remote_name : get_lines_from_string(*remote_names)) {
-    if (fetch_remote(*cwd, remote_name, *current_branch_name))
-      std::cout << "t_fetch_remote: " << remote_name << "/" << *current_branch_name << " SUCCESS"<< std::endl;
-    else std::cout << "t_fetch_remote: " << remote_name << "/" << *current_branch_name << " NULL"<< std::endl;
+  Session loader;
+  if (!loader.session_startup_sequence() || !loader.prepare(stage_repository)) {
+    std::cout << "t_snapshot_identity: NULL\n";
+    return;
   }
 
-  delete(cwd);
-  delete(remote_names);
-  delete(current_branch_name);
+  // Not through another global configuration, nor for another repository
+  setenv("GIT_CONFIG_GLOBAL", "/dev/null", 1);
+  bool other_config = loader.load_snapshot();
+  unsetenv("GIT_CONFIG_GLOBAL");
+
+  std::string toplevel_path = loader.toplevel_path;
+  loader.toplevel_path = "/";
+  bool other_repository = loader.load_snapshot();
+  loader.toplevel_path = toplevel_path;
+
+  bool same = loader.load_snapshot();
+
+  std::cout << "t_snapshot_identity: " << (same && !other_config && !other_repository ? "SUCCESS" : "NULL") << '\n';
 }
@@ -6,6 +6,9 @@
 #include "include.h"
 #include "git.h"
 #include "session.h"
+#include "service.h"
+
+#include <thread>
 
 // Test runner
 void run_tests();
@@ -16,6 +19,7 @@ void t_get_ppid();
 void t_get_cwd();
 void t_get_pwd();
 void t_get_exec_path();
+void t_run_process();
 void t_get_git_version();
 void t_get_remote_names();
 void t_get_remote_links();
@@ -29,10 +33,19 @@ void t_get_toplevel_path_manually();
 void t_get_dugit_path();
 void t_create_dugit_directory();
 void t_add_dugit_to_gitignore();
-void t_check_lock_file();
-void t_set_lock_file();
-void t_unset_lock_file();
 void t_check_dugit_external_dependencies();
 void t_fetch_remote();
+void t_cat_file();
+void t_repo_state();
+void t_git_index();
+void t_dirty_paths();
+void t_timer_wheel();
+void t_work_pool();
+void t_get_submodules();
+void t_discover_repository();
+void t_probe_cache();
+void t_file_lock();
+void t_command_stages();
+void t_snapshot_identity();
 
 #endif
\ No newline at end of file